@@ -23,7 +23,7 @@ struct config {
   list roa_tables;			/* Configured ROA tables (struct roa_table_config) */
   list logfiles;			/* Configured log fils (sysdep) */
 
-  int mrtdump_file;			/* Configured MRTDump file (sysdep, fd in unix) */
+  struct mrt_file *mrtdump_file;		/* Configured MRTDump file */
   char *syslog_name;			/* Name used for syslog (NULL -> no syslog) */
   struct rtable_config *master_rtc;	/* Configuration of master routing table */
   struct iface_patt *router_id_from;	/* Configured list of router ID iface patterns */
@@ -39,6 +39,7 @@ struct config {
   struct timeformat tf_log;		/* Time format for the logfile */
   struct timeformat tf_base;		/* Time format for other purposes */
   u32 gr_wait;				/* Graceful restart wait timeout */
+  uint export_threads;			/* Number of threads running export filters */
 
   int cli_debug;			/* Tracing of CLI connections and commands */
   int latency_debug;			/* I/O loop tracks duration of each event */
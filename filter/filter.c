@@ -468,12 +468,13 @@ val_format(struct f_val v, buffer *buf)
   }
 }
 
-static struct rte **f_rte;
-static struct rta *f_old_rta;
-static struct ea_list **f_tmp_attrs;
-static struct linpool *f_pool;
-static struct buffer f_buf;
-static int f_flags;
+/* Filters without side effects may be run by worker threads, see i_pure() */
+static THREAD_LOCAL struct rte **f_rte;
+static THREAD_LOCAL struct rta *f_old_rta;
+static THREAD_LOCAL struct ea_list **f_tmp_attrs;
+static THREAD_LOCAL struct linpool *f_pool;
+static THREAD_LOCAL struct buffer f_buf;
+static THREAD_LOCAL int f_flags;
 
 static inline void f_rte_cow(void)
 {
@@ -1475,6 +1476,211 @@ i_same(struct f_inst *f1, struct f_inst *f2)
   return i_same(f1->next, f2->next);
 }
 
+#undef ARG
+#define ARG(x,y) \
+	if (!i_net_independent(what->y)) \
+		return 0;
+
+/*
+ * i_net_independent - check whether an instruction tree never accesses the
+ * network of the route, either directly or by an implicit ROA check.
+ * Results of such trees are the same for all routes with the same attributes.
+ */
+int
+i_net_independent(struct f_inst *what)
+{
+  for (; what; what = what->next)
+    switch(what->code) {
+    case ',':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '|':
+    case '&':
+    case P('m','p'):
+    case P('m','c'):
+    case P('!','='):
+    case P('=','='):
+    case '<':
+    case P('<','='):
+    case '~':
+    case '?':
+    case P('i','M'):
+    case P('A','p'):
+    case P('C','a'): TWOARGS; break;
+
+    case '!':
+    case P('d','e'):
+    case 'p':
+    case 'L':
+    case 'r':
+    case P('c','p'):
+    case P('a','f'):
+    case P('a','l'):
+    case P('a','L'):
+    case P('p',','):
+    case P('P','S'):
+    case P('a','S'):
+    case P('e','S'): ONEARG; break;
+
+    case 's': ARG(v2, a2.p); break;
+    case P('c','a'): ONEARG; ARG(v2, a2.p); break;
+
+    case P('S','W'):
+      ONEARG;
+      if (!tree_all_data(what->a2.p, i_net_independent))
+	return 0;
+      break;
+
+    case 'a':
+      if (what->a2.i == SA_NET)
+	return 0;
+      break;
+
+    case P('R','C'):
+      /* ROA check without arguments uses the network of the route */
+      if (!what->arg1)
+	return 0;
+      TWOARGS;
+      break;
+
+    case 'c':
+    case 'C':
+    case 'V':
+    case '0':
+    case 'E':
+    case 'P':
+    case P('e','a'):
+    case P('c','v'): break;
+
+    default:
+      bug( "Unknown instruction %d in net_independent (%c)", what->code, what->code & 0xff);
+    }
+
+  return 1;
+}
+
+/**
+ * filter_net_independent - check whether a filter depends on the network
+ * @filter: filter to be checked
+ *
+ * Returns 1 if the result of @filter is the same for all routes with the
+ * same attributes, regardless of their networks. That allows to run it
+ * only once for a batch of such routes, see rte_update_batch().
+ */
+int
+filter_net_independent(struct filter *filter)
+{
+  if (filter == FILTER_ACCEPT || filter == FILTER_REJECT)
+    return 1;
+  return filter->net_independent;
+}
+
+#undef ARG
+#define ARG(x,y) \
+	if (!i_pure(what->y)) \
+		return 0;
+
+/*
+ * i_pure - check whether an instruction tree has no side effects. Such trees
+ * do not modify the route, variables or any other shared state, and may be
+ * therefore run in parallel by multiple threads.
+ */
+int
+i_pure(struct f_inst *what)
+{
+  for (; what; what = what->next)
+    switch(what->code) {
+    case ',':
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '|':
+    case '&':
+    case P('m','p'):
+    case P('m','c'):
+    case P('!','='):
+    case P('=','='):
+    case '<':
+    case P('<','='):
+    case '~':
+    case '?':
+    case P('i','M'):
+    case P('A','p'):
+    case P('C','a'):
+    case P('c','a'): TWOARGS; break;
+
+    case '!':
+    case P('d','e'):
+    case 'L':
+    case 'r':
+    case P('c','p'):
+    case P('a','f'):
+    case P('a','l'):
+    case P('a','L'): ONEARG; break;
+
+    case P('S','W'):
+      ONEARG;
+      if (!tree_all_data(what->a2.p, i_pure))
+	return 0;
+      break;
+
+    case P('p',','):
+      /* Messages are printed through a shared buffer */
+      if (what->a1.p)
+	return 0;
+      if ((what->a2.i != F_ACCEPT) && (what->a2.i != F_REJECT) && (what->a2.i != F_ERROR))
+	return 0;
+      break;
+
+    case P('c','v'):
+      /* Local variables are stored in their symbols */
+      if (what->a1.p)
+	return 0;
+      break;
+
+    case 's':
+    case 'p':
+    case P('P','S'):
+    case P('a','S'):
+    case P('e','S'):
+    case P('R','C'):	/* Caches results in the ROA table */
+      return 0;
+
+    case 'c':
+    case 'C':
+    case 'V':
+    case '0':
+    case 'E':
+    case 'P':
+    case 'a':
+    case P('e','a'): break;
+
+    default:
+      bug( "Unknown instruction %d in pure (%c)", what->code, what->code & 0xff);
+    }
+
+  return 1;
+}
+
+/**
+ * filter_pure - check whether a filter has no side effects
+ * @filter: filter to be checked
+ *
+ * Returns 1 if @filter just decides whether to accept a route, without
+ * modifying it or anything else. Such filter may be run by a worker thread,
+ * see rt_notify_basic_all().
+ */
+int
+filter_pure(struct filter *filter)
+{
+  if (filter == FILTER_ACCEPT || filter == FILTER_REJECT)
+    return 1;
+  return filter->pure;
+}
+
 /**
  * f_run - run a filter for a route
  * @filter: filter to run
@@ -1627,3 +1833,134 @@ filter_same(struct filter *new, struct filter *old)
     return 0;
   return i_same(new->root, old->root);
 }
+
+#ifdef TEST
+
+/*
+ * Checks of the instruction tree predicates. Filters in filter/test.conf are
+ * only run, not inspected, so the trees are built here as the parser would
+ * build them from the filters in the comments. Besides control filters, these
+ * are the cases where the predicates must look into |case| arms.
+ *
+ * It is built by 'make tests' and run by 'make check'.
+ */
+
+#include "lib/unix.h"
+
+/* BGP attributes bgp_path and bgp_community */
+#define FT_AS_PATH	EA_CODE(EAP_BGP, 0x02)
+#define FT_COMMUNITY	EA_CODE(EAP_BGP, 0x08)
+
+static struct f_inst *
+ft_inst(int code, void *a1, void *a2)
+{
+  struct f_inst *i = xmalloc(sizeof(struct f_inst));
+
+  memset(i, 0, sizeof(struct f_inst));
+  i->code = code;
+  i->a1.p = a1;
+  i->a2.p = a2;
+  return i;
+}
+
+static struct f_inst *
+ft_const(int val)
+{
+  struct f_inst *i = ft_inst('c', NULL, NULL);
+
+  i->aux = T_INT;
+  i->a2.i = val;
+  return i;
+}
+
+static struct f_inst *
+ft_attr(int code, int aux, int attr)
+{
+  struct f_inst *i = ft_inst(code, NULL, NULL);
+
+  i->aux = aux;
+  i->a2.i = attr;
+  return i;
+}
+
+static struct f_inst *
+ft_break(int how, struct f_inst *what)
+{
+  struct f_inst *i = ft_inst(P('p',','), what, NULL);
+
+  i->a2.i = how;
+  return i;
+}
+
+/* Arm of a case statement, int value or else arm when @else_arm is set */
+static struct f_tree *
+ft_arm(struct f_tree *next, int else_arm, int val, struct f_inst *cmds)
+{
+  struct f_tree *t = xmalloc(sizeof(struct f_tree));
+
+  memset(t, 0, sizeof(struct f_tree));
+  t->from.type = t->to.type = else_arm ? T_VOID : T_INT;
+  t->from.val.i = t->to.val.i = val;
+  t->right = next;
+  t->data = cmds;
+  return t;
+}
+
+/* case bgp_path.len { <arms> } accept; */
+static struct f_inst *
+ft_case_path_len(struct f_tree *arms)
+{
+  struct f_inst *path = ft_attr(P('e','a'), EAF_TYPE_AS_PATH, FT_AS_PATH);
+  struct f_inst *sw = ft_inst(P('S','W'), ft_inst('L', path, NULL), arms);
+
+  sw->next = ft_break(F_ACCEPT, NULL);
+  return sw;
+}
+
+static int
+ft_check(char *name, struct f_inst *root, int net_independent, int pure)
+{
+  int ni = i_net_independent(root);
+  int pu = i_pure(root);
+
+  debug("%s: net_independent %d, pure %d\n", name, ni, pu);
+  return (ni == net_independent) && (pu == pure);
+}
+
+int
+main(void)
+{
+  struct f_inst *net_len, *add, *cmds;
+  int ok = 1;
+
+  log_init_debug("");
+  resource_init();
+
+  /* case bgp_path.len { 0: reject; else: reject; } accept; */
+  ok &= ft_check("case_reject",
+		 ft_case_path_len(ft_arm(ft_arm(NULL, 1, 0, ft_break(F_REJECT, NULL)),
+					 0, 0, ft_break(F_REJECT, NULL))), 1, 1);
+
+  /* case bgp_path.len { 0: reject; else: if net.len > 24 then reject; } accept; */
+  net_len = ft_inst('L', ft_attr('a', T_PREFIX, SA_NET), NULL);
+  cmds = ft_inst('?', ft_inst('<', ft_const(24), net_len), ft_break(F_REJECT, NULL));
+  ok &= ft_check("case_net",
+		 ft_case_path_len(ft_arm(ft_arm(NULL, 1, 0, cmds),
+					 0, 0, ft_break(F_REJECT, NULL))), 0, 1);
+
+  /* case bgp_path.len { 0: reject; 1: bgp_community.add((65000, 1)); else: print "long path"; } accept; */
+  add = ft_inst(P('C','a'), ft_attr(P('e','a'), EAF_TYPE_INT_SET, FT_COMMUNITY),
+		ft_const((65000 << 16) | 1));
+  add->aux = 'a';
+  cmds = ft_attr(P('e','S'), EAF_TYPE_INT_SET, FT_COMMUNITY);
+  cmds->a1.p = add;
+  ok &= ft_check("case_side_effect",
+		 ft_case_path_len(ft_arm(ft_arm(ft_arm(NULL, 1, 0, ft_break(F_NOP, ft_inst('p', ft_const(0), NULL))),
+						0, 1, cmds),
+					 0, 0, ft_break(F_REJECT, NULL))), 1, 0);
+
+  debug(ok ? "OK\n" : "FAILED\n");
+  return !ok;
+}
+
+#endif
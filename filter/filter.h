@@ -66,6 +66,8 @@ struct f_val {
 struct filter {
   char *name;
   struct f_inst *root;
+  int net_independent;			/* Result does not depend on the network, see i_net_independent() */
+  int pure;				/* Filter has no side effects, see i_pure() */
 };
 
 struct f_inst *f_new_inst(void);
@@ -78,6 +80,7 @@ struct f_inst *f_generate_roa_check(struct symbol *sym, struct f_inst *prefix, s
 struct f_tree *build_tree(struct f_tree *);
 struct f_tree *find_tree(struct f_tree *t, struct f_val val);
 int same_tree(struct f_tree *t1, struct f_tree *t2);
+int tree_all_data(struct f_tree *t, int (*test)(struct f_inst *));
 void tree_format(struct f_tree *t, buffer *buf);
 
 struct f_trie *f_new_trie(linpool *lp, uint node_size);
@@ -116,6 +119,10 @@ char *filter_name(struct filter *filter);
 int filter_same(struct filter *new, struct filter *old);
 
 int i_same(struct f_inst *f1, struct f_inst *f2);
+int i_net_independent(struct f_inst *what);
+int filter_net_independent(struct filter *filter);
+int i_pure(struct f_inst *what);
+int filter_pure(struct filter *filter);
 
 int val_compare(struct f_val v1, struct f_val v2);
 int val_same(struct f_val v1, struct f_val v2);
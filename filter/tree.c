@@ -138,6 +138,24 @@ same_tree(struct f_tree *t1, struct f_tree *t2)
   return 1;
 }
 
+/**
+ * tree_all_data
+ * @t: tree to be checked
+ * @test: predicate on instruction trees
+ *
+ * Applies @test to the instructions of all nodes, i.e. to all arms of
+ * a |case| statement. Returns 1 if @test holds for all of them.
+ */
+int
+tree_all_data(struct f_tree *t, int (*test)(struct f_inst *))
+{
+  if (!t)
+    return 1;
+  return test(t->data) &&
+    tree_all_data(t->left, test) &&
+    tree_all_data(t->right, test);
+}
+
 
 static void
 tree_node_format(struct f_tree *t, buffer *buf)
@@ -9,6 +9,23 @@
 #ifndef _BIRD_BIRDLIB_H_
 #define _BIRD_BIRDLIB_H_
 
+/* Microsecond time */
+
+typedef s64 btime;
+
+#define S_	*1000000
+#define MS_	*1000
+#define US_	*1
+#define TO_S	/1000000
+#define TO_MS	/1000
+#define TO_US	/1
+
+#ifndef PARSER
+#define S	S_
+#define MS	MS_
+#define US	US_
+#endif
+
 #include "timer.h"
 #include "alloca.h"
 
@@ -61,24 +78,9 @@
 #define NORET __attribute__((noreturn))
 #define UNUSED __attribute__((unused))
 #define PACKED __attribute__((packed))
+#define THREAD_LOCAL __thread
 
 
-/* Microsecond time */
-
-typedef s64 btime;
-
-#define S_	*1000000
-#define MS_	*1000
-#define US_	*1
-#define TO_S	/1000000
-#define TO_MS	/1000
-#define TO_US	/1
-
-#ifndef PARSER
-#define S	S_
-#define MS	MS_
-#define US	US_
-#endif
 
 
 /* Rate limiting */
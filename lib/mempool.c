@@ -38,12 +38,14 @@ struct linpool {
   struct lp_chunk *first, *current, **plast;	/* Normal (reusable) chunks */
   struct lp_chunk *first_large;			/* Large chunks */
   uint chunk_size, threshold, total, total_large;
+  char *name;					/* Allocation class for rmemstat(), NULL if none */
 };
 
 static void lp_free(resource *);
 static void lp_dump(resource *);
 static resource *lp_lookup(resource *, unsigned long);
 static size_t lp_memsize(resource *r);
+static void lp_memstat(resource *r, struct memstat *ms);
 
 static struct resclass lp_class = {
   "LinPool",
@@ -51,7 +53,8 @@ static struct resclass lp_class = {
   lp_free,
   lp_dump,
   lp_lookup,
-  lp_memsize
+  lp_memsize,
+  lp_memstat
 };
 
 /**
@@ -73,6 +76,20 @@ linpool
   return m;
 }
 
+/**
+ * lp_set_name - set allocation class of a &linpool
+ * @m: linear memory pool
+ * @name: allocation class name
+ *
+ * Memory of @m is accounted to the allocation class @name by rmemstat()
+ * instead of the class of the pool containing the &linpool.
+ */
+void
+lp_set_name(linpool *m, char *name)
+{
+  m->name = name;
+}
+
 /**
  * lp_alloc - allocate memory from a &linpool
  * @m: linear memory pool
@@ -254,6 +271,29 @@ lp_memsize(resource *r)
     m->total + m->total_large;
 }
 
+static void
+lp_memstat(resource *r, struct memstat *ms)
+{
+  linpool *m = (linpool *) r;
+  struct lp_chunk *c;
+
+  if (m->name)
+    ms->name = m->name;
+
+  /* Chunks before the current one are in use, except their unusable tails */
+  ms->used = m->total_large;
+  ms->objs = 0;
+  for(c=m->first; c && (c != m->current); c=c->next)
+    {
+      if ((m->ptr >= c->data) && (m->ptr <= c->data + c->size))
+	{
+	  ms->used += m->ptr - c->data;
+	  break;
+	}
+      ms->used += c->size;
+    }
+}
+
 
 static resource *
 lp_lookup(resource *r, unsigned long a)
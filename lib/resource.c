@@ -38,6 +38,7 @@ static void pool_dump(resource *);
 static void pool_free(resource *);
 static resource *pool_lookup(resource *, unsigned long);
 static size_t pool_memsize(resource *P);
+static void pool_memstat(resource *P, struct memstat *ms);
 
 static struct resclass pool_class = {
   "Pool",
@@ -45,7 +46,8 @@ static struct resclass pool_class = {
   pool_free,
   pool_dump,
   pool_lookup,
-  pool_memsize
+  pool_memsize,
+  pool_memstat
 };
 
 pool root_pool;
@@ -110,6 +112,16 @@ pool_memsize(resource *P)
   return sum;
 }
 
+static void
+pool_memstat(resource *P, struct memstat *ms)
+{
+  pool *p = (pool *) P;
+
+  ms->name = p->name;
+  ms->total = ms->used = sizeof(pool) + ALLOC_OVERHEAD;
+  ms->objs = 0;
+}
+
 static resource *
 pool_lookup(resource *P, unsigned long a)
 {
@@ -204,6 +216,82 @@ rmemsize(void *res)
   return r->class->memsize(r);
 }
 
+static uint
+memstat_add(struct memstat *tab, uint n, uint max, struct memstat *ms)
+{
+  uint i;
+
+  for (i = 0; i < n; i++)
+    if ((tab[i].name == ms->name) || !strcmp(tab[i].name, ms->name))
+      goto found;
+
+  if (n < max)
+    {
+      tab[n] = (struct memstat) { .name = ms->name };
+      i = n++;
+    }
+  else
+    {
+      /* Out of space, account everything else to the last class */
+      i = max - 1;
+      tab[i].name = "Other";
+    }
+
+found:
+  tab[i].total += ms->total;
+  tab[i].used += ms->used;
+  tab[i].objs += ms->objs;
+  return n;
+}
+
+static uint
+pool_memstat_walk(pool *p, struct memstat *tab, uint n, uint max)
+{
+  struct memstat ms;
+  resource *r;
+
+  pool_memstat(&p->r, &ms);
+  n = memstat_add(tab, n, max, &ms);
+
+  WALK_LIST(r, p->inside)
+    {
+      if (r->class == &pool_class)
+	{
+	  n = pool_memstat_walk((pool *) r, tab, n, max);
+	  continue;
+	}
+
+      ms = (struct memstat) { .name = p->name, .total = rmemsize(r), .objs = 1 };
+      ms.used = ms.total;
+      if (r->class->memstat)
+	r->class->memstat(r, &ms);
+      n = memstat_add(tab, n, max, &ms);
+    }
+
+  return n;
+}
+
+/**
+ * rmemstat - collect memory usage by allocation class
+ * @p: pool
+ * @tab: table of allocation classes to fill in
+ * @max: size of @tab
+ *
+ * This function walks all resources inside the pool @p and sums up their
+ * memory usage into @tab by allocation classes. By default, a resource
+ * belongs to the class named after the innermost pool it is in, but slabs
+ * and linear pools may be given their own class by sl_set_name() and
+ * lp_set_name(). Besides the total allocated memory, resource classes may
+ * report how much of it is actually used by live objects.
+ *
+ * Returns the number of filled in entries of @tab.
+ */
+uint
+rmemstat(pool *p, struct memstat *tab, uint max)
+{
+  return pool_memstat_walk(p, tab, 0, max);
+}
+
 /**
  * ralloc - create a resource
  * @p: pool to create the resource in
@@ -312,13 +400,21 @@ mbl_memsize(resource *r)
   return ALLOC_OVERHEAD + sizeof(struct mblock) + m->size;
 }
 
+static void
+mbl_memstat(resource *r, struct memstat *ms)
+{
+  struct mblock *m = (struct mblock *) r;
+  ms->used = m->size;
+}
+
 static struct resclass mb_class = {
   "Memory",
   0,
   mbl_free,
   mbl_debug,
   mbl_lookup,
-  mbl_memsize
+  mbl_memsize,
+  mbl_memstat
 };
 
 /**
@@ -18,6 +18,15 @@ typedef struct resource {
   struct resclass *class;		/* Resource class */
 } resource;
 
+/* Memory usage of an allocation class, see rmemstat() */
+
+struct memstat {
+  char *name;				/* Allocation class name */
+  size_t total;				/* Allocated memory, including overhead */
+  size_t used;				/* Memory used by live objects */
+  uint objs;				/* Number of live objects */
+};
+
 /* Resource class */
 
 struct resclass {
@@ -27,6 +36,7 @@ struct resclass {
   void (*dump)(resource *);		/* Dump to debug output */
   resource *(*lookup)(resource *, unsigned long);	/* Look up address (only for debugging) */
   size_t (*memsize)(resource *);	/* Return size of memory used by the resource, may be NULL */
+  void (*memstat)(resource *, struct memstat *);	/* Fill in used memory and objects, may be NULL */
 };
 
 /* Estimate of system allocator overhead per item, for memory consumtion stats */
@@ -41,6 +51,7 @@ pool *rp_new(pool *, char *);		/* Create new pool */
 void rfree(void *);			/* Free single resource */
 void rdump(void *);			/* Dump to debug output */
 size_t rmemsize(void *res);		/* Return size of memory used by the resource */
+uint rmemstat(pool *, struct memstat *, uint max); /* Collect memory usage by allocation class */
 void rlookup(unsigned long);		/* Look up address (only for debugging) */
 void rmove(void *, pool *);		/* Move to a different pool */
 
@@ -64,6 +75,7 @@ void *lp_alloc(linpool *, unsigned size);	/* Aligned */
 void *lp_allocu(linpool *, unsigned size);	/* Unaligned */
 void *lp_allocz(linpool *, unsigned size);	/* With clear */
 void lp_flush(linpool *);			/* Free everything, but leave linpool */
+void lp_set_name(linpool *, char *);		/* Set allocation class for rmemstat() */
 
 /* Slabs */
 
@@ -72,6 +84,9 @@ typedef struct slab slab;
 slab *sl_new(pool *, unsigned size);
 void *sl_alloc(slab *);
 void sl_free(slab *, void *);
+void sl_set_name(slab *, char *);		/* Set allocation class for rmemstat() */
+int sl_reclaim(uint max);			/* Release unused memory, called when idle */
+extern u64 sl_reclaimed;			/* Bytes released by Slabs so far */
 
 /*
  * Low-level memory allocation functions, please don't use
@@ -80,6 +95,12 @@ void sl_free(slab *, void *);
 
 void buffer_realloc(void **buf, unsigned *size, unsigned need, unsigned item_size);
 
+#ifdef USE_SLAB_ARENAS
+#define ARENA_PAGE_SIZE 4096
+void *alloc_page(void);			/* Page from mmap'd arenas, see sysdep/unix/alloc.c */
+void free_page(void *);
+#endif
+
 
 #ifdef HAVE_LIBDMALLOC
 /*
@@ -22,6 +22,15 @@
  * newly allocated and freed blocks with a special pattern to make detection
  * of use of uninitialized or already freed memory easier.
  *
+ * Objects cannot be moved once allocated, so a Slab keeps heads holding only
+ * a few objects on a separate list of sparse heads and allocates from them
+ * only when there are no denser ones. Sparse heads are thus given a chance
+ * to drain completely when many objects are freed, e.g. when a big BGP
+ * peer goes down. Empty heads are released immediately, except for a few
+ * per Slab which are kept to absorb the churn. These are released later by
+ * sl_reclaim(), which is called when BIRD is idle and which also asks the
+ * system allocator to return the freed memory to the system.
+ *
  * Example: Nodes of a FIB are allocated from a per-FIB Slab.
  */
 
@@ -32,6 +41,10 @@
 #include "lib/resource.h"
 #include "lib/string.h"
 
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
+
 #undef FAKE_SLAB	/* Turn on if you want to debug memory allocations */
 
 #ifdef DEBUGGING
@@ -42,6 +55,9 @@ static void slab_free(resource *r);
 static void slab_dump(resource *r);
 static resource *slab_lookup(resource *r, unsigned long addr);
 static size_t slab_memsize(resource *r);
+static void slab_memstat(resource *r, struct memstat *ms);
+
+u64 sl_reclaimed;			/* Bytes of Slab blocks released so far */
 
 #ifdef FAKE_SLAB
 
@@ -53,6 +69,7 @@ struct slab {
   resource r;
   uint size;
   list objs;
+  char *name;
 };
 
 static struct resclass sl_class = {
@@ -61,7 +78,8 @@ static struct resclass sl_class = {
   slab_free,
   slab_dump,
   NULL,
-  slab_memsize
+  slab_memsize,
+  slab_memstat
 };
 
 struct sl_obj {
@@ -132,6 +150,25 @@ slab_memsize(resource *r)
   return ALLOC_OVERHEAD + sizeof(struct slab) + cnt * (ALLOC_OVERHEAD + s->size);
 }
 
+static void
+slab_memstat(resource *r, struct memstat *ms)
+{
+  slab *s = (slab *) r;
+  struct sl_obj *o;
+
+  if (s->name)
+    ms->name = s->name;
+  ms->objs = 0;
+  WALK_LIST(o, s->objs)
+    ms->objs++;
+  ms->used = (size_t) ms->objs * s->size;
+}
+
+int
+sl_reclaim(uint max UNUSED)
+{
+  return 0;
+}
 
 #else
 
@@ -140,21 +177,52 @@ slab_memsize(resource *r)
  */
 
 #define SLAB_SIZE 4096
-#define MAX_EMPTY_HEADS 1
+#define MAX_EMPTY_HEADS 16		/* Kept until the next sl_reclaim() pass */
+#define SL_TRIM_THRESHOLD (1 << 20)	/* Ask malloc to return memory after that many bytes freed */
+
+#ifdef USE_SLAB_ARENAS
+#if SLAB_SIZE != ARENA_PAGE_SIZE
+#error "Slab blocks must be whole arena pages"
+#endif
+static inline void *sl_alloc_block(void) { return alloc_page(); }
+static inline void sl_free_block(void *h) { free_page(h); }
+#else
+static inline void *sl_alloc_block(void) { return xmalloc(SLAB_SIZE); }
+static inline void sl_free_block(void *h) { xfree(h); }
+#endif
+
+static size_t sl_untrimmed;		/* Bytes freed since the last malloc_trim() */
+
+static inline void
+sl_release_head(void *h)
+{
+  sl_free_block(h);
+  sl_reclaimed += SLAB_SIZE;
+  sl_untrimmed += SLAB_SIZE;
+}
 
 struct slab {
   resource r;
   uint obj_size, head_size, objs_per_slab, num_empty_heads, data_size;
-  list empty_heads, partial_heads, full_heads;
+  uint sparse_limit;			/* Heads with at most that many objects are sparse */
+  list empty_heads, partial_heads, sparse_heads, full_heads;
+  node reclaim_n;			/* In sl_reclaim_list if there are empty heads */
+  uint reclaim_pass;			/* Pass of sl_reclaim() during which it was queued */
+  char *name;				/* Allocation class for rmemstat(), NULL if none */
 };
 
+static list sl_reclaim_list;		/* Slabs keeping empty heads */
+static uint sl_reclaim_pass;
+static int sl_reclaim_initialized;
+
 static struct resclass sl_class = {
   "Slab",
   sizeof(struct slab),
   slab_free,
   slab_dump,
   slab_lookup,
-  slab_memsize
+  slab_memsize,
+  slab_memstat
 };
 
 struct sl_head {
@@ -201,17 +269,24 @@ sl_new(pool *p, uint size)
   s->objs_per_slab = (SLAB_SIZE - s->head_size) / size;
   if (!s->objs_per_slab)
     bug("Slab: object too large");
+  s->sparse_limit = s->objs_per_slab / 4;
   s->num_empty_heads = 0;
   init_list(&s->empty_heads);
   init_list(&s->partial_heads);
+  init_list(&s->sparse_heads);
   init_list(&s->full_heads);
+  if (!sl_reclaim_initialized)
+    {
+      init_list(&sl_reclaim_list);
+      sl_reclaim_initialized = 1;
+    }
   return s;
 }
 
 static struct sl_head *
 sl_new_head(slab *s)
 {
-  struct sl_head *h = xmalloc(SLAB_SIZE);
+  struct sl_head *h = sl_alloc_block();
   struct sl_obj *o = (struct sl_obj *)((byte *)h+s->head_size);
   struct sl_obj *no;
   uint n = s->objs_per_slab;
@@ -262,6 +337,13 @@ full_partial:
   goto redo;
 
 no_partial:
+  h = HEAD(s->sparse_heads);
+  if (h->n.next)
+    {
+      rem_node(&h->n);
+      add_head(&s->partial_heads, &h->n);
+      goto okay;
+    }
   h = HEAD(s->empty_heads);
   if (h->n.next)
     {
@@ -298,11 +380,16 @@ sl_free(slab *s, void *oo)
     {
       rem_node(&h->n);
       if (s->num_empty_heads >= MAX_EMPTY_HEADS)
-	xfree(h);
+	sl_release_head(h);
       else
 	{
 	  add_head(&s->empty_heads, &h->n);
 	  s->num_empty_heads++;
+	  if (!s->reclaim_n.next)
+	    {
+	      add_tail(&sl_reclaim_list, &s->reclaim_n);
+	      s->reclaim_pass = sl_reclaim_pass;
+	    }
 	}
     }
   else if (!o->u.next)
@@ -310,6 +397,67 @@ sl_free(slab *s, void *oo)
       rem_node(&h->n);
       add_head(&s->partial_heads, &h->n);
     }
+  else if (h->num_full <= s->sparse_limit)
+    {
+      /* Do not allocate from it while there are denser heads */
+      rem_node(&h->n);
+      add_tail(&s->sparse_heads, &h->n);
+    }
+}
+
+/**
+ * sl_reclaim - release unused memory of Slabs
+ * @max: maximum number of Slabs to process
+ *
+ * Empty heads kept by Slabs after their objects have been freed are
+ * released by the first pass of this function started after the Slab began
+ * keeping them, with at most @max Slabs processed per call. All empty heads
+ * of such Slab are released then, including ones emptied just before, only
+ * the heads reused meanwhile are kept. When a pass is finished and enough
+ * memory has been freed since the last trim, the system allocator is asked
+ * to return it to the system. This function is called from the main loop
+ * when there is nothing else to do, it returns 1 if the pass has not been
+ * finished and it should be called again soon.
+ */
+int
+sl_reclaim(uint max)
+{
+  static int running;
+  slab *s;
+  node *n;
+
+  if (!sl_reclaim_initialized)
+    return 0;
+
+  if (!running)
+    sl_reclaim_pass++;
+
+  /* Slabs queued during this pass wait for the next one */
+  while ((n = HEAD(sl_reclaim_list))->next &&
+	 (s = SKIP_BACK(slab, reclaim_n, n))->reclaim_pass != sl_reclaim_pass)
+    {
+      if (!max--)
+	return running = 1;
+
+      struct sl_head *h, *g;
+      WALK_LIST_DELSAFE(h, g, s->empty_heads)
+	{
+	  rem_node(&h->n);
+	  sl_release_head(h);
+	}
+      s->num_empty_heads = 0;
+      rem_node(&s->reclaim_n);
+    }
+
+#ifdef HAVE_MALLOC_TRIM
+  if (sl_untrimmed >= SL_TRIM_THRESHOLD)
+    {
+      malloc_trim(0);
+      sl_untrimmed = 0;
+    }
+#endif
+
+  return running = 0;
 }
 
 static void
@@ -318,28 +466,35 @@ slab_free(resource *r)
   slab *s = (slab *) r;
   struct sl_head *h, *g;
 
+  if (s->reclaim_n.next)
+    rem_node(&s->reclaim_n);
+
   WALK_LIST_DELSAFE(h, g, s->empty_heads)
-    xfree(h);
+    sl_free_block(h);
   WALK_LIST_DELSAFE(h, g, s->partial_heads)
-    xfree(h);
+    sl_free_block(h);
+  WALK_LIST_DELSAFE(h, g, s->sparse_heads)
+    sl_free_block(h);
   WALK_LIST_DELSAFE(h, g, s->full_heads)
-    xfree(h);
+    sl_free_block(h);
 }
 
 static void
 slab_dump(resource *r)
 {
   slab *s = (slab *) r;
-  int ec=0, pc=0, fc=0;
+  int ec=0, pc=0, sc=0, fc=0;
   struct sl_head *h;
 
   WALK_LIST(h, s->empty_heads)
     ec++;
   WALK_LIST(h, s->partial_heads)
     pc++;
+  WALK_LIST(h, s->sparse_heads)
+    sc++;
   WALK_LIST(h, s->full_heads)
     fc++;
-  debug("(%de+%dp+%df blocks per %d objs per %d bytes)\n", ec, pc, fc, s->objs_per_slab, s->obj_size);
+  debug("(%de+%dp+%ds+%df blocks per %d objs per %d bytes)\n", ec, pc, sc, fc, s->objs_per_slab, s->obj_size);
 }
 
 static size_t
@@ -353,12 +508,34 @@ slab_memsize(resource *r)
     heads++;
   WALK_LIST(h, s->partial_heads)
     heads++;
+  WALK_LIST(h, s->sparse_heads)
+    heads++;
   WALK_LIST(h, s->full_heads)
     heads++;
 
   return ALLOC_OVERHEAD + sizeof(struct slab) + heads * (ALLOC_OVERHEAD + SLAB_SIZE);
 }
 
+static void
+slab_memstat(resource *r, struct memstat *ms)
+{
+  slab *s = (slab *) r;
+  struct sl_head *h;
+
+  if (s->name)
+    ms->name = s->name;
+
+  /* Empty heads hold no objects */
+  ms->objs = 0;
+  WALK_LIST(h, s->partial_heads)
+    ms->objs += h->num_full;
+  WALK_LIST(h, s->sparse_heads)
+    ms->objs += h->num_full;
+  WALK_LIST(h, s->full_heads)
+    ms->objs += h->num_full;
+  ms->used = (size_t) ms->objs * s->data_size;
+}
+
 static resource *
 slab_lookup(resource *r, unsigned long a)
 {
@@ -368,6 +545,9 @@ slab_lookup(resource *r, unsigned long a)
   WALK_LIST(h, s->partial_heads)
     if ((unsigned long) h < a && (unsigned long) h + SLAB_SIZE < a)
       return r;
+  WALK_LIST(h, s->sparse_heads)
+    if ((unsigned long) h < a && (unsigned long) h + SLAB_SIZE < a)
+      return r;
   WALK_LIST(h, s->full_heads)
     if ((unsigned long) h < a && (unsigned long) h + SLAB_SIZE < a)
       return r;
@@ -375,3 +555,17 @@ slab_lookup(resource *r, unsigned long a)
 }
 
 #endif
+
+/**
+ * sl_set_name - set allocation class of a Slab
+ * @s: slab
+ * @name: allocation class name
+ *
+ * Objects allocated from @s are accounted to the allocation class @name
+ * by rmemstat() instead of the class of the pool containing the Slab.
+ */
+void
+sl_set_name(slab *s, char *name)
+{
+  s->name = name;
+}
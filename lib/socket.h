@@ -48,8 +48,10 @@ typedef struct birdsock {
   int af;				/* Address family (AF_INET, AF_INET6 or 0 for non-IP) of fd */
   int fd;				/* System-dependent data */
   int index;				/* Index in poll buffer */
+  int revents;				/* Pending poll events, kept between loops with epoll */
   int rcv_ttl;				/* TTL of last received datagram */
   node n;
+  node ready_n;				/* Node in list of ready sockets (epoll) */
   void *rbuf_alloc, *tbuf_alloc;
   char *password;			/* Password for MD5 authentication */
   char *err;				/* Error message */
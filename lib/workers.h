@@ -0,0 +1,19 @@
+/*
+ *	BIRD Library -- Worker Threads
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_WORKERS_H_
+#define _BIRD_WORKERS_H_
+
+#include "lib/resource.h"
+
+/* Hook for i-th item of a job, @lp is flushed after each call */
+typedef void (*worker_hook)(void *data, uint i, linpool *lp);
+
+void workers_set(uint num);
+uint workers_count(void);
+void workers_run(worker_hook hook, void *data, uint count);
+
+#endif
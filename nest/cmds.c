@@ -6,6 +6,8 @@
  *	Can be freely distributed and used under the terms of the GNU GPL.
  */
 
+#include <stdlib.h>
+
 #include "nest/bird.h"
 #include "nest/protocol.h"
 #include "nest/route.h"
@@ -64,8 +66,8 @@ cmd_show_symbols(struct sym_show_data *sd)
     }
 }
 
-static void
-print_size(char *dsc, size_t val)
+static char *
+format_size(char *buf, size_t val)
 {
   char *px = " kMG";
   int i = 0;
@@ -75,7 +77,61 @@ print_size(char *dsc, size_t val)
       i++;
     }
 
-  cli_msg(-1018, "%-17s %4u %cB", dsc, (unsigned) val, px[i]);
+  bsprintf(buf, "%4u %cB", (unsigned) val, px[i]);
+  return buf;
+}
+
+static void
+print_size(char *dsc, size_t val)
+{
+  char buf[16];
+  cli_msg(-1018, "%-17s %s", dsc, format_size(buf, val));
+}
+
+#define MEMSTAT_MAX 64
+
+static int
+memstat_compare(const void *a, const void *b)
+{
+  const struct memstat *x = a, *y = b;
+  return (x->total < y->total) - (x->total > y->total);
+}
+
+static void
+show_memory_classes(void)
+{
+  struct memstat tab[MEMSTAT_MAX];
+  char b1[16], b2[16];
+  uint i, n;
+
+  n = rmemstat(&root_pool, tab, MEMSTAT_MAX);
+  qsort(tab, n, sizeof(struct memstat), memstat_compare);
+
+  cli_msg(-1018, "");
+  cli_msg(-1018, "%-24s %10s %10s %10s", "Allocation class", "Objects", "Used", "Allocated");
+  for (i = 0; i < n; i++)
+    cli_msg(-1018, "%-24s %10u %10s %10s", tab[i].name, tab[i].objs,
+	    format_size(b1, tab[i].used), format_size(b2, tab[i].total));
+}
+
+static void
+show_memory_protocols(void)
+{
+  struct proto *p;
+  node *nn;
+  char b1[16], b2[16];
+
+  cli_msg(-1018, "");
+  cli_msg(-1018, "%-24s %10s %10s %10s", "Protocol", "Routes", "In tables", "In pool");
+  WALK_LIST2(p, nn, proto_list, glob_node)
+    {
+      /* Routes are kept in tables, each of them takes one rte */
+      uint routes = p->stats.imp_routes + p->stats.filt_routes;
+
+      cli_msg(-1018, "%-24s %10u %10s %10s", p->name, routes,
+	      format_size(b1, (size_t) routes * sizeof(rte)),
+	      format_size(b2, p->pool ? rmemsize(p->pool) : 0));
+    }
 }
 
 extern pool *rt_table_pool;
@@ -84,7 +140,7 @@ extern pool *roa_pool;
 extern pool *proto_pool;
 
 void
-cmd_show_memory(void)
+cmd_show_memory(int detailed)
 {
   cli_msg(-1018, "BIRD memory usage");
   print_size("Routing tables:", rmemsize(rt_table_pool));
@@ -92,6 +148,14 @@ cmd_show_memory(void)
   print_size("ROA tables:", rmemsize(roa_pool));
   print_size("Protocols:", rmemsize(proto_pool));
   print_size("Total:", rmemsize(&root_pool));
+  print_size("Reclaimed:", sl_reclaimed);
+
+  if (detailed)
+    {
+      show_memory_classes();
+      show_memory_protocols();
+    }
+
   cli_msg(0, "");
 }
 
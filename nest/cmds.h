@@ -15,5 +15,5 @@ struct f_inst;
 
 void cmd_show_status(void);
 void cmd_show_symbols(struct sym_show_data *sym);
-void cmd_show_memory(void);
+void cmd_show_memory(int detailed);
 void cmd_eval(struct f_inst *expr);
@@ -15,10 +15,16 @@
 
 /* MRTdump types */
 
+#define TABLE_DUMP_V2		13
 #define BGP4MP			16
+#define BGP4MP_ET		17
 
 /* MRTdump subtypes */
 
+#define PEER_INDEX_TABLE	1
+#define RIB_IPV4_UNICAST	2
+#define RIB_IPV6_UNICAST	4
+
 #define BGP4MP_MESSAGE		1
 #define BGP4MP_MESSAGE_AS4	4
 #define BGP4MP_STATE_CHANGE_AS4	5
@@ -27,5 +33,14 @@
 /* implemented in sysdep */
 void mrt_dump_message(struct proto *p, u16 type, u16 subtype, byte *buf, u32 len);
 
+#define MRT_NAME_MAX		512		/* Max length of a file name */
+#define MRT_FILE_BUFFER		(4 << 20)	/* Default memory for queued records */
+#define MRT_FILE_BUFFER_MIN	(128 << 10)
+
+struct mrt_file;
+struct mrt_file *mrt_file_open(pool *p, char *name, uint buffer, uint rotate_size, uint rotate_period);
+int mrt_file_write(struct mrt_file *f, byte *buf, uint len);
+int mrt_file_busy(struct mrt_file *f);
+
 #endif
 
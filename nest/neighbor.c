@@ -412,6 +412,7 @@ neigh_init(pool *if_pool)
   int i;
 
   neigh_slab = sl_new(if_pool, sizeof(neighbor));
+  sl_set_name(neigh_slab, "Neighbors");
   init_list(&sticky_neigh_list);
   for(i=0; i<NEIGH_HASH_SIZE; i++)
     init_list(&neigh_hash_table[i]);
@@ -76,7 +76,7 @@ void protos_dump_all(void);
 
 extern struct protocol
   proto_device, proto_radv, proto_rip, proto_static,
-  proto_ospf, proto_pipe, proto_bgp, proto_bfd, proto_babel;
+  proto_ospf, proto_pipe, proto_bgp, proto_bfd, proto_babel, proto_mrt;
 
 /*
  *	Routing Protocol Instance
@@ -219,6 +219,7 @@ struct proto {
   struct announce_hook *ahooks;		/* Announcement hooks for this protocol */
 
   struct fib_iterator *feed_iterator;	/* Routing table iterator used during protocol feeding */
+  struct fib_ordered_iterator *feed_ordered; /* Used instead of feed_iterator for tables with trie */
   struct announce_hook *feed_ahook;	/* Announce hook we currently feed */
 
   /* Hic sunt protocol-specific data */
@@ -286,6 +287,7 @@ proto_get_router_id(struct proto_config *pc)
 }
 
 extern list active_proto_list;
+extern list proto_list;
 
 /*
  *  Each protocol instance runs two different state machines:
@@ -30,6 +30,7 @@ struct cli;
  *		- deletion of entry
  *		- searching for entry by network prefix
  *		- asynchronous retrieval of fib contents
+ *		- longest-match lookup using an optional prefix trie
  */
 
 struct fib_node {
@@ -50,6 +51,14 @@ struct fib_iterator {			/* See lib/slists.h for an explanation */
   uint hash;
 };
 
+struct fib_trie_node {
+  struct fib_trie_node *c[2];		/* Children, selected by bit at position plen */
+  struct fib_trie_node *parent;
+  struct fib_node *node;		/* FIB node with this prefix or NULL for branching nodes */
+  ip_addr addr;				/* Prefix, masked to plen bits */
+  byte plen;
+};
+
 typedef void (*fib_init_func)(struct fib_node *);
 
 struct fib {
@@ -59,9 +68,14 @@ struct fib {
   uint hash_size;			/* Number of hash table entries (a power of two) */
   uint hash_order;			/* Binary logarithm of hash_size */
   uint hash_shift;			/* 16 - hash_log */
+  struct fib_node **old_table;		/* Hash table being re-hashed from, NULL if none */
+  uint old_order, old_shift;		/* Order and shift of old_table */
+  uint rehash_pos;			/* Nodes with primary keys below are in hash_table */
   uint entries;				/* Number of entries */
   uint entries_min, entries_max;	/* Entry count limits (else start rehashing) */
   fib_init_func init;			/* Constructor */
+  slab *trie_slab;			/* Slab holding trie nodes, NULL if trie is disabled */
+  struct fib_trie_node *trie_root;	/* Prefix trie indexing all nodes */
 };
 
 void fib_init(struct fib *, pool *, unsigned node_size, unsigned hash_order, fib_init_func init);
@@ -71,18 +85,21 @@ void *fib_route(struct fib *, ip_addr, int);	/* Longest-match routing lookup */
 void fib_delete(struct fib *, void *);	/* Remove fib entry */
 void fib_free(struct fib *);		/* Destroy the fib */
 void fib_check(struct fib *);		/* Consistency check for debugging */
+void fib_init_trie(struct fib *);	/* Build and maintain prefix trie for fib_route() */
+void fib_free_trie(struct fib *);	/* Drop prefix trie, fall back to hash probing */
 
 void fit_init(struct fib_iterator *, struct fib *); /* Internal functions, don't call */
+struct fib_node *fib_chain(struct fib *f, uint *pos, int next);
 struct fib_node *fit_get(struct fib *, struct fib_iterator *);
 void fit_put(struct fib_iterator *, struct fib_node *);
 void fit_put_next(struct fib *f, struct fib_iterator *i, struct fib_node *n, uint hpos);
 
 
 #define FIB_WALK(fib, z) do {					\
-	struct fib_node *z, **ff = (fib)->hash_table;		\
-	uint count = (fib)->hash_size;				\
-	while (count--)						\
-	  for(z = *ff++; z; z=z->next)
+	struct fib_node *z;					\
+	uint fpos = 0;						\
+	for(z = fib_chain(fib, &fpos, 0); z;			\
+	    z = z->next ? : fib_chain(fib, &fpos, 1))
 
 #define FIB_WALK_END } while (0)
 
@@ -90,16 +107,10 @@ void fit_put_next(struct fib *f, struct fib_iterator *i, struct fib_node *n, uin
 
 #define FIB_ITERATE_START(fib, it, z) do {			\
 	struct fib_node *z = fit_get(fib, it);			\
-	uint count = (fib)->hash_size;				\
 	uint hpos = (it)->hash;					\
 	for(;;) {						\
-	  if (!z)						\
-            {							\
-	       if (++hpos >= count)				\
-		 break;						\
-	       z = (fib)->hash_table[hpos];			\
-	       continue;					\
-	    }
+	  if (!z && !(z = fib_chain(fib, &hpos, 1)))		\
+	    break;
 
 #define FIB_ITERATE_END(z) z = z->next; } } while(0)
 
@@ -109,6 +120,42 @@ void fit_put_next(struct fib *f, struct fib_iterator *i, struct fib_node *n, uin
 
 #define FIB_ITERATE_UNLINK(it, fib) fit_get(fib, it)
 
+#define FIB_WALK_COVERING(fib, px, len, z) do {			\
+	struct fib_node *z;					\
+	for(z = fib_route(fib, px, len); z;			\
+	    z = z->pxlen ? fib_route(fib, px, z->pxlen - 1) : NULL)
+
+#define FIB_WALK_COVERING_END } while (0)
+
+struct fib_ordered_iterator {		/* Walks the FIB in prefix order using its trie */
+  struct fib_trie_node *node;		/* Current node, valid only inside FIB_ORDERED_START() */
+  ip_addr prefix;			/* Prefix to continue from */
+  ip_addr limit;			/* Walk only prefixes inside limit/limit_len */
+  byte pxlen, limit_len;
+  byte state;				/* FOT_* */
+};
+
+#define FOT_RUNNING	0
+#define FOT_END		1
+
+void fot_init(struct fib_ordered_iterator *, struct fib *, ip_addr, int);
+struct fib_node *fot_get(struct fib *, struct fib_ordered_iterator *);
+struct fib_node *fot_next(struct fib *, struct fib_ordered_iterator *);
+
+static inline void
+fot_put(struct fib_ordered_iterator *i, struct fib_node *n)
+{ i->prefix = n->prefix; i->pxlen = n->pxlen; }
+
+#define FIB_ORDERED_INIT(it, fib, px, len) fot_init(it, fib, px, len)
+
+#define FIB_ORDERED_START(fib, it, z) do {			\
+	struct fib_node *z;					\
+	for(z = fot_get(fib, it); z; z = fot_next(fib, it)) {
+
+#define FIB_ORDERED_END } } while(0)
+
+#define FIB_ORDERED_PUT(it, z) fot_put(it, z)
+
 
 /*
  *	Master Routing Tables. Generally speaking, each of them contains a FIB
@@ -129,6 +176,10 @@ struct rtable_config {
   int gc_max_ops;			/* Maximum number of operations before GC is run */
   int gc_min_time;			/* Minimum time between two consecutive GC runs */
   byte sorted;				/* Routes of network are sorted according to rte_better() */
+  byte trie;				/* Keep prefix trie for longest-match lookups */
+  byte arrays;				/* Keep route arrays for networks with many routes */
+  byte deferred;			/* Exports of optimal routes are deferred and coalesced */
+  uint export_delay;			/* Delay of deferred exports (in seconds) */
 };
 
 typedef struct rtable {
@@ -153,17 +204,30 @@ typedef struct rtable {
   byte nhu_state;			/* Next Hop Update state */
   struct fib_iterator prune_fit;	/* Rtable prune FIB iterator */
   struct fib_iterator nhu_fit;		/* Next Hop Update FIB iterator */
+  list pending_exports;			/* Networks with deferred exports (struct rt_pending_export) */
+  struct timer *export_timer;		/* Timer for the delay of deferred exports */
+  byte export_scheduled;		/* Deferred exports are being processed */
 } rtable;
 
 #define RPS_NONE	0
 #define RPS_SCHEDULED	1
 #define RPS_RUNNING	2
 
+/* Flags stored in net->n.x0 */
+#define NXF_EXPORT_PENDING 1		/* Network has a deferred export */
+
 typedef struct network {
   struct fib_node n;			/* FIB flags reserved for kernel syncer */
   struct rte *routes;			/* Available routes for this network */
+  struct rte_array *array;		/* The same routes in an array, see rt-table.c */
 } net;
 
+struct rte_array {
+  uint count, size;
+  struct rte_src **src;			/* Sources of the routes, for quick lookups */
+  struct rte *routes[0];		/* Routes in the same order as in net->routes */
+};
+
 struct hostcache {
   slab *slab;				/* Slab holding all hostentries */
   struct hostentry **hash_table;	/* Hash table for hostentries */
@@ -274,6 +338,7 @@ rte *rte_find(net *net, struct rte_src *src);
 rte *rte_get_temp(struct rta *);
 void rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src);
 static inline void rte_update(struct proto *p, net *net, rte *new) { rte_update2(p->main_ahook, net, new, p->main_source); }
+void rte_update_batch(struct announce_hook *ah, net **nets, uint count, rte *new, struct rte_src *src);
 void rte_discard(rtable *tab, rte *old);
 int rt_examine(rtable *t, ip_addr prefix, int pxlen, struct proto *p, struct filter *filter);
 rte *rt_export_merged(struct announce_hook *ah, net *net, rte **rt_free, struct ea_list **tmpa, int silent);
@@ -307,12 +372,14 @@ struct rt_show_data {
   struct filter *filter;
   int verbose;
   struct fib_iterator fit;
+  struct fib_ordered_iterator fot;	/* Used instead of fit for tables with trie */
+  int ordered;
   struct proto *show_protocol;
   struct proto *export_protocol;
   int export_mode, primary_only, filtered;
   struct config *running_on_config;
   int net_counter, rt_counter, show_counter;
-  int stats, show_for;
+  int stats, show_for, show_in;
 };
 void rt_show(struct rt_show_data *);
 
@@ -357,7 +424,7 @@ typedef struct rta {
   byte dest;				/* Route destination type (RTD_...) */
   byte flags;				/* Route flags (RTF_...), now unused */
   byte aflags;				/* Attribute cache flags (RTAF_...) */
-  u16 hash_key;				/* Hash over important fields */
+  u32 hash_key;				/* Hash over important fields */
   u32 igp_metric;			/* IGP metric to next hop (for iBGP routes) */
   ip_addr gw;				/* Next hop */
   ip_addr from;				/* Advertising router */
@@ -498,7 +565,7 @@ void ea_sort(ea_list *);		/* Sort entries in all sub-lists */
 unsigned ea_scan(ea_list *);		/* How many bytes do we need for merged ea_list */
 void ea_merge(ea_list *from, ea_list *to); /* Merge sub-lists to allocated buffer */
 int ea_same(ea_list *x, ea_list *y);	/* Test whether two ea_lists are identical */
-uint ea_hash(ea_list *e);	/* Calculate 16-bit hash value */
+uint ea_hash(ea_list *e);	/* Calculate 32-bit hash value */
 ea_list *ea_append(ea_list *to, ea_list *what);
 void ea_format_bitfield(struct eattr *a, byte *buf, int bufsize, const char **names, int min, int max);
 
@@ -517,6 +584,7 @@ rta *rta_do_cow(rta *o, linpool *lp);
 static inline rta * rta_cow(rta *r, linpool *lp) { return rta_is_cached(r) ? rta_do_cow(r, lp) : r; }
 void rta_dump(rta *);
 void rta_dump_all(void);
+void rta_show_stats(void);
 void rta_show(struct cli *, rta *, ea_list *);
 void rta_set_recursive_next_hop(rtable *dep, rta *a, rtable *tab, ip_addr *gw, ip_addr *ll);
 
@@ -606,7 +674,7 @@ struct roa_table_config {
 };
 
 struct roa_show_data {
-  struct fib_iterator fit;
+  struct fib_ordered_iterator fot;
   struct roa_table *table;
   ip_addr prefix;
   byte pxlen;
@@ -42,6 +42,12 @@
  * and they are provided with a use count to allow sharing.
  *
  * Routing tables always contain only cached &rta's.
+ *
+ * The &adata values referenced from cached &ea_list's (AS paths, community
+ * lists etc.) are interned as well: each distinct value is stored just once
+ * with a use count, so routes with different &rta's but the same AS path
+ * share it. Attribute values of two cached &ea_list's are therefore equal
+ * exactly when their pointers are.
  */
 
 #include "nest/bird.h"
@@ -56,6 +62,8 @@
 #include "lib/string.h"
 
 pool *rta_pool;
+static pool *ea_pool;			/* Cached ea_lists */
+static pool *adata_pool;		/* Interned attribute data */
 
 static slab *rta_slab;
 static slab *mpnh_slab;
@@ -81,11 +89,35 @@ static HASH(struct rte_src) src_hash;
 
 struct protocol *attr_class_to_protocol[EAP_MAX];
 
+/* Interned attribute data */
+
+struct adata_intern {
+  struct adata_intern *next;		/* Hash chain */
+  u32 hash_key;				/* Hash over the data */
+  uint uc;				/* Use count */
+  struct adata ad;			/* The data itself, must be last */
+};
+
+#define ADATA_INTERN(d)		SKIP_BACK(struct adata_intern, ad, d)
+
+#define ADH_KEY(n)		n->hash_key, &n->ad
+#define ADH_NEXT(n)		n->next
+#define ADH_EQ(h1,d1,h2,d2)	h1 == h2 && adata_same(d1, d2)
+#define ADH_FN(h,d)		h
+
+#define ADH_REHASH		adata_rehash
+#define ADH_PARAMS		/2, *2, 1, 1, 8, 24
+#define ADH_INIT_ORDER		8
+
+static HASH(struct adata_intern) adata_hash;
+static uint adata_refs;
+
 
 static void
 rte_src_init(void)
 {
   rte_src_slab = sl_new(rta_pool, sizeof(struct rte_src));
+  sl_set_name(rte_src_slab, "Route sources");
 
   src_id_pos = 0;
   src_id_size = SRC_ID_INIT_SIZE;
@@ -638,24 +670,105 @@ ea_merge(ea_list *e, ea_list *t)
     }
 }
 
+/**
+ * adata_hash_data - calculate an &adata hash key
+ * @d: attribute data
+ *
+ * This function calculates a 32-bit hash value of the contents of @d.
+ * For interned data, the value is also kept in &adata_intern.
+ */
+static u32
+adata_hash_data(struct adata *d)
+{
+  u32 h = d->length;
+  uint size = d->length;
+  byte *z = d->data;
+
+  while (size >= 4)
+    {
+      h = u32_hash(h ^ *(u32 *)z);
+      z += 4;
+      size -= 4;
+    }
+  while (size--)
+    h = u32_hash(h ^ *z++);
+
+  return h ^ (h >> 16);
+}
+
+HASH_DEFINE_REHASH_FN(ADH, struct adata_intern)
+
+/**
+ * adata_lookup - find or create interned attribute data
+ * @d: attribute data
+ *
+ * adata_lookup() returns the interned copy of attribute data equal to @d
+ * with its use count incremented, creating it if it does not exist yet.
+ */
+static struct adata *
+adata_lookup(struct adata *d)
+{
+  u32 h = adata_hash_data(d);
+  struct adata_intern *n = HASH_FIND(adata_hash, ADH, h, d);
+
+  adata_refs++;
+  if (n)
+    {
+      n->uc++;
+      return &n->ad;
+    }
+
+  n = mb_alloc(adata_pool, sizeof(struct adata_intern) + d->length);
+  n->hash_key = h;
+  n->uc = 1;
+  n->ad.length = d->length;
+  memcpy(n->ad.data, d->data, d->length);
+  HASH_INSERT2(adata_hash, ADH, adata_pool, n);
+
+  return &n->ad;
+}
+
+static inline struct adata *
+adata_clone(struct adata *d)
+{
+  adata_refs++;
+  ADATA_INTERN(d)->uc++;
+  return d;
+}
+
+static void
+adata_free(struct adata *d)
+{
+  struct adata_intern *n = ADATA_INTERN(d);
+
+  adata_refs--;
+  if (--n->uc)
+    return;
+
+  HASH_REMOVE2(adata_hash, ADH, adata_pool, n);
+  mb_free(n);
+}
+
 /**
  * ea_same - compare two &ea_list's
  * @x: attribute list
  * @y: attribute list
  *
  * ea_same() compares two normalized attribute lists @x and @y and returns
- * 1 if they contain the same attributes, 0 otherwise.
+ * 1 if they contain the same attributes, 0 otherwise. Attribute data of two
+ * cached lists are interned, so they are compared just by pointers.
  */
 int
 ea_same(ea_list *x, ea_list *y)
 {
-  int c;
+  int c, cached;
 
   if (!x || !y)
     return x == y;
   ASSERT(!x->next && !y->next);
   if (x->count != y->count)
     return 0;
+  cached = x->flags & y->flags & EALF_CACHED;
   for(c=0; c<x->count; c++)
     {
       eattr *a = &x->attrs[c];
@@ -664,7 +777,8 @@ ea_same(ea_list *x, ea_list *y)
       if (a->id != b->id ||
 	  a->flags != b->flags ||
 	  a->type != b->type ||
-	  ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data : !adata_same(a->u.ptr, b->u.ptr)))
+	  ((a->type & EAF_EMBEDDED) ? a->u.data != b->u.data :
+	   (a->u.ptr != b->u.ptr) && (cached || !adata_same(a->u.ptr, b->u.ptr))))
 	return 0;
     }
   return 1;
@@ -680,19 +794,14 @@ ea_list_copy(ea_list *o)
     return NULL;
   ASSERT(!o->next);
   len = sizeof(ea_list) + sizeof(eattr) * o->count;
-  n = mb_alloc(rta_pool, len);
+  n = mb_alloc(ea_pool, len);
   memcpy(n, o, len);
   n->flags |= EALF_CACHED;
   for(i=0; i<o->count; i++)
     {
       eattr *a = &n->attrs[i];
       if (!(a->type & EAF_EMBEDDED))
-	{
-	  unsigned size = sizeof(struct adata) + a->u.ptr->length;
-	  struct adata *d = mb_alloc(rta_pool, size);
-	  memcpy(d, a->u.ptr, size);
-	  a->u.ptr = d;
-	}
+	a->u.ptr = (o->flags & EALF_CACHED) ? adata_clone(a->u.ptr) : adata_lookup(a->u.ptr);
     }
   return n;
 }
@@ -709,7 +818,7 @@ ea_free(ea_list *o)
 	{
 	  eattr *a = &o->attrs[i];
 	  if (!(a->type & EAF_EMBEDDED))
-	    mb_free(a->u.ptr);
+	    adata_free(a->u.ptr);
 	}
       mb_free(o);
     }
@@ -924,7 +1033,8 @@ ea_dump(ea_list *e)
  * @e: attribute list
  *
  * ea_hash() takes an extended attribute list and calculated a hopefully
- * uniformly distributed hash value from its contents.
+ * uniformly distributed 32-bit hash value from its contents. Hashes of
+ * interned attribute data of cached lists are not recalculated.
  */
 inline uint
 ea_hash(ea_list *e)
@@ -937,27 +1047,15 @@ ea_hash(ea_list *e)
       for(i=0; i<e->count; i++)
 	{
 	  struct eattr *a = &e->attrs[i];
-	  h ^= a->id;
+	  h = u32_hash(h ^ a->id);
 	  if (a->type & EAF_EMBEDDED)
-	    h ^= a->u.data;
+	    h = u32_hash(h ^ a->u.data);
+	  else if (e->flags & EALF_CACHED)
+	    h = u32_hash(h ^ ADATA_INTERN(a->u.ptr)->hash_key);
 	  else
-	    {
-	      struct adata *d = a->u.ptr;
-	      int size = d->length;
-	      byte *z = d->data;
-	      while (size >= 4)
-		{
-		  h ^= *(u32 *)z;
-		  z += 4;
-		  size -= 4;
-		}
-	      while (size--)
-		h = (h >> 24) ^ (h << 8) ^ *z++;
-	    }
+	    h = u32_hash(h ^ adata_hash_data(a->u.ptr));
 	}
       h ^= h >> 16;
-      h ^= h >> 6;
-      h &= 0xffff;
     }
   return h;
 }
@@ -993,23 +1091,35 @@ static uint rta_cache_size = 32;
 static uint rta_cache_limit;
 static uint rta_cache_mask;
 static rta **rta_hash_table;
+static rta **rta_old_table;		/* Hash table being re-hashed from, NULL if none */
+static uint rta_old_mask;
+static uint rta_rehash_pos;		/* Buckets of rta_old_table below are already moved */
+static u64 rta_cache_lookups, rta_cache_hits;
+
+#define RTA_MOVE_STEP 4			/* Buckets moved per lookup during re-hashing */
+#define RTA_CHAIN_HIST 8		/* Chain length histogram size in rta_show_stats() */
 
 static void
 rta_alloc_hash(void)
 {
-  rta_hash_table = mb_allocz(rta_pool, sizeof(rta *) * rta_cache_size);
-  if (rta_cache_size < 32768)
+  rta_hash_table = mb_alloc(rta_pool, sizeof(rta *) * rta_cache_size);
+  if (rta_cache_size < (1U << 30))
     rta_cache_limit = rta_cache_size * 2;
   else
     rta_cache_limit = ~0;
   rta_cache_mask = rta_cache_size - 1;
 }
 
-static inline uint
+static inline u32
 rta_hash(rta *a)
 {
-  return (((uint) (uintptr_t) a->src) ^ ipa_hash(a->gw) ^
-	  mpnh_hash(a->nexthops) ^ ea_hash(a->eattrs)) & 0xffff;
+  u32 h = u32_hash((u32) (uintptr_t) a->src);
+  h = u32_hash(h ^ ipa_hash32(a->gw));
+  h = u32_hash(h ^ mpnh_hash(a->nexthops));
+  h = u32_hash(h ^ ea_hash(a->eattrs));
+
+  /* Multiplication mixes only upwards, fold it down to the bucket index bits */
+  return h ^ (h >> 16);
 }
 
 static inline int
@@ -1042,35 +1152,79 @@ rta_copy(rta *o)
   return r;
 }
 
+static inline rta **
+rta_bucket(u32 h)
+{
+  if (rta_old_table && ((h & rta_old_mask) >= rta_rehash_pos))
+    return rta_old_table + (h & rta_old_mask);
+  else
+    return rta_hash_table + (h & rta_cache_mask);
+}
+
 static inline void
-rta_insert(rta *r)
+rta_link(rta *r, rta **b)
 {
-  uint h = r->hash_key & rta_cache_mask;
-  r->next = rta_hash_table[h];
+  r->next = *b;
   if (r->next)
     r->next->pprev = &r->next;
-  r->pprev = &rta_hash_table[h];
-  rta_hash_table[h] = r;
+  r->pprev = b;
+  *b = r;
+}
+
+static inline void
+rta_insert(rta *r)
+{
+  rta_link(r, rta_bucket(r->hash_key));
 }
 
+/*
+ * The cache grows by doubling its hash table. To avoid long pauses with
+ * large caches, the old table is kept and its buckets are moved to the new
+ * one a few at a time during subsequent lookups. Buckets of the old table
+ * below rta_rehash_pos have already been moved. Each old bucket splits into
+ * two new ones, which are cleared just before they are used, so even
+ * allocation of the new table does not have to touch all of it at once.
+ */
 static void
-rta_rehash(void)
+rta_rehash_step(uint max)
 {
-  uint ohs = rta_cache_size;
-  uint h;
   rta *r, *n;
-  rta **oht = rta_hash_table;
+
+  while (max-- && (rta_rehash_pos <= rta_old_mask))
+    {
+      rta_hash_table[rta_rehash_pos] = NULL;
+      rta_hash_table[rta_rehash_pos + rta_old_mask + 1] = NULL;
+
+      for (r = rta_old_table[rta_rehash_pos]; r; r = n)
+	{
+	  n = r->next;
+	  rta_link(r, rta_hash_table + (r->hash_key & rta_cache_mask));
+	}
+      rta_rehash_pos++;
+    }
+
+  if (rta_rehash_pos > rta_old_mask)
+    {
+      DBG("Rehashing rta cache to %d entries finished.\n", rta_cache_size);
+      mb_free(rta_old_table);
+      rta_old_table = NULL;
+    }
+}
+
+static void
+rta_rehash(void)
+{
+  /* Previous re-hashing must be finished before we start a new one */
+  if (rta_old_table)
+    rta_rehash_step(~0);
+
+  DBG("Rehashing rta cache from %d to %d entries.\n", rta_cache_size, 2*rta_cache_size);
+  rta_old_table = rta_hash_table;
+  rta_old_mask = rta_cache_mask;
+  rta_rehash_pos = 0;
 
   rta_cache_size = 2*rta_cache_size;
-  DBG("Rehashing rta cache from %d to %d entries.\n", ohs, rta_cache_size);
   rta_alloc_hash();
-  for(h=0; h<ohs; h++)
-    for(r=oht[h]; r; r=n)
-      {
-	n = r->next;
-	rta_insert(r);
-      }
-  mb_free(oht);
 }
 
 /**
@@ -1090,7 +1244,7 @@ rta *
 rta_lookup(rta *o)
 {
   rta *r;
-  uint h;
+  u32 h;
 
   ASSERT(!(o->aflags & RTAF_CACHED));
   if (o->eattrs)
@@ -1104,10 +1258,17 @@ rta_lookup(rta *o)
       ea_sort(o->eattrs);
     }
 
+  if (rta_old_table)
+    rta_rehash_step(RTA_MOVE_STEP);
+
+  rta_cache_lookups++;
   h = rta_hash(o);
-  for(r=rta_hash_table[h & rta_cache_mask]; r; r=r->next)
+  for(r=*rta_bucket(h); r; r=r->next)
     if (r->hash_key == h && rta_same(r, o))
-      return rta_clone(r);
+      {
+	rta_cache_hits++;
+	return rta_clone(r);
+      }
 
   r = rta_copy(o);
   r->hash_key = h;
@@ -1164,7 +1325,7 @@ rta_dump(rta *a)
   static char *rtc[] = { "", " BC", " MC", " AC" };
   static char *rtd[] = { "", " DEV", " HOLE", " UNREACH", " PROHIBIT" };
 
-  debug("p=%s uc=%d %s %s%s%s h=%04x",
+  debug("p=%s uc=%d %s %s%s%s h=%08x",
 	a->src->proto->name, a->uc, rts[a->source], ip_scope_text(a->scope), rtc[a->cast],
 	rtd[a->dest], a->hash_key);
   if (!(a->aflags & RTAF_CACHED))
@@ -1181,6 +1342,21 @@ rta_dump(rta *a)
     }
 }
 
+static void
+rta_dump_chains(rta **tab, uint lo, uint hi)
+{
+  rta *a;
+  uint h;
+
+  for(h=lo; h<hi; h++)
+    for(a=tab[h]; a; a=a->next)
+      {
+	debug("%p ", a);
+	rta_dump(a);
+	debug("\n");
+      }
+}
+
 /**
  * rta_dump_all - dump attribute cache
  *
@@ -1190,20 +1366,87 @@ rta_dump(rta *a)
 void
 rta_dump_all(void)
 {
-  rta *a;
-  uint h;
-
   debug("Route attribute cache (%d entries, rehash at %d):\n", rta_cache_count, rta_cache_limit);
-  for(h=0; h<rta_cache_size; h++)
-    for(a=rta_hash_table[h]; a; a=a->next)
-      {
-	debug("%p ", a);
-	rta_dump(a);
-	debug("\n");
-      }
+
+  /* While re-hashing, only new buckets split from the moved old ones are valid */
+  if (rta_old_table)
+    {
+      uint osize = rta_old_mask + 1;
+      rta_dump_chains(rta_old_table, rta_rehash_pos, osize);
+      rta_dump_chains(rta_hash_table, 0, rta_rehash_pos);
+      rta_dump_chains(rta_hash_table, osize, osize + rta_rehash_pos);
+    }
+  else
+    rta_dump_chains(rta_hash_table, 0, rta_cache_size);
   debug("\n");
 }
 
+static inline uint
+rta_chain_length(rta *a)
+{
+  uint n = 0;
+  for (; a; a=a->next)
+    n++;
+  return n;
+}
+
+static void
+rta_count_chains(rta **tab, uint lo, uint hi, uint *hist, uint *max)
+{
+  uint h, n;
+
+  for (h=lo; h<hi; h++)
+    {
+      n = rta_chain_length(tab[h]);
+      hist[MIN(n, RTA_CHAIN_HIST)]++;
+      *max = MAX(*max, n);
+    }
+}
+
+/**
+ * rta_show_stats - show attribute cache statistics
+ *
+ * This function prints the size of the route attribute cache, its hit rate
+ * and a histogram of hash chain lengths to the CLI. Buckets which have not
+ * been moved yet by a running re-hash are counted from the old table.
+ */
+void
+rta_show_stats(void)
+{
+  uint hist[RTA_CHAIN_HIST + 1] = {};
+  uint max = 0;
+  uint i;
+  u64 hits;
+
+  if (rta_old_table)
+    {
+      uint osize = rta_old_mask + 1;
+      rta_count_chains(rta_old_table, rta_rehash_pos, osize, hist, &max);
+      rta_count_chains(rta_hash_table, 0, rta_rehash_pos, hist, &max);
+      rta_count_chains(rta_hash_table, osize, osize + rta_rehash_pos, hist, &max);
+    }
+  else
+    rta_count_chains(rta_hash_table, 0, rta_cache_size, hist, &max);
+
+  hits = rta_cache_lookups ? rta_cache_hits * 10000 / rta_cache_lookups : 0;
+
+  cli_msg(-1026, "Route attribute cache:");
+  cli_msg(-1026, "  Entries:         %u", rta_cache_count);
+  cli_msg(-1026, "  Buckets:         %u (rehash at %u entries)", rta_cache_size, rta_cache_limit);
+  if (rta_old_table)
+    cli_msg(-1026, "  Rehashing:       %u of %u buckets moved", rta_rehash_pos, rta_old_mask + 1);
+  cli_msg(-1026, "  Lookups:         %lu", (unsigned long) rta_cache_lookups);
+  cli_msg(-1026, "  Hits:            %lu (%u.%02u%%)", (unsigned long) rta_cache_hits,
+	  (uint) (hits / 100), (uint) (hits % 100));
+  cli_msg(-1026, "  Shared values:   %u (%u references)", adata_hash.count, adata_refs);
+  cli_msg(-1026, "  Longest chain:   %u", max);
+  cli_msg(-1026, "  Chain lengths:");
+  for (i = 0; i < RTA_CHAIN_HIST; i++)
+    cli_msg(-1026, "    %2u:           %u", i, hist[i]);
+  cli_msg(-1026, "    %2u+:          %u", RTA_CHAIN_HIST, hist[RTA_CHAIN_HIST]);
+  cli_msg(0, "");
+}
+
 void
 rta_show(struct cli *c, rta *a, ea_list *eal)
 {
@@ -1230,9 +1473,15 @@ void
 rta_init(void)
 {
   rta_pool = rp_new(&root_pool, "Attributes");
+  ea_pool = rp_new(rta_pool, "Attribute lists");
+  adata_pool = rp_new(rta_pool, "Attribute values");
   rta_slab = sl_new(rta_pool, sizeof(rta));
+  sl_set_name(rta_slab, "Route attributes");
   mpnh_slab = sl_new(rta_pool, sizeof(struct mpnh));
+  sl_set_name(mpnh_slab, "Next hops");
   rta_alloc_hash();
+  bzero(rta_hash_table, sizeof(rta *) * rta_cache_size);
+  HASH_INIT(adata_hash, adata_pool, ADH_INIT_ORDER);
   rte_src_init();
 }
 
@@ -25,10 +25,36 @@
  * key, hence if we keep the total number of buckets to be a power of two,
  * re-hashing of the structure keeps the relative order of the nodes.
  *
+ * Re-hashing of a big table would stall the whole daemon, so it is done
+ * incrementally: a new hash table is allocated and each following fib_get()
+ * or fib_delete() moves a few buckets from the old table to the new one in
+ * the order of primary keys. Nodes with primary keys below &rehash_pos are
+ * already in the new table, the rest is still in the old one. As the order
+ * of nodes is given just by primary keys, both asynchronous readers (which
+ * remember their position as a primary key) and FIB_WALK() see all nodes
+ * in the same order regardless of the migration state.
+ *
  * To get the asynchronous reading consistent over node deletions, we need to
  * keep a list of readers for each node. When a node gets deleted, its readers
  * are automatically moved to the next node in the table.
  *
+ * Longest-prefix matching by probing the hash table for each prefix length
+ * is expensive when the address is not covered by a long prefix, so a FIB can
+ * optionally maintain a compressed binary trie of its prefixes alongside the
+ * hash (see fib_init_trie()). Each trie node either corresponds to a FIB node
+ * or is a branching node with two children; fib_get() and fib_delete() keep
+ * the trie in sync and fib_route() then needs just one walk from the root
+ * bounded by the address length.
+ *
+ * The trie also allows to enumerate the FIB in prefix order (a prefix is
+ * followed by its more specifics) using FIB_ORDERED_START(), optionally just
+ * a subtree of prefixes inside a given network, which answers queries for
+ * all more specifics of a prefix in time proportional to the size of the
+ * answer. Less specifics covering a prefix are enumerated by
+ * FIB_WALK_COVERING(), which is built on fib_route(). The ordered iterator does
+ * not need to be linked to FIB nodes, it just remembers the prefix to
+ * continue from and looks up its successor in the trie when resumed.
+ *
  * Basic FIB operations are performed by functions defined by this module,
  * enumerating of FIB contents is accomplished by using the FIB_WALK() macro
  * or FIB_ITERATE_START() if you want to do it asynchronously.
@@ -47,6 +73,8 @@
 #define HASH_LO_MARK /5
 #define HASH_LO_STEP 2
 #define HASH_LO_MIN 10
+#define HASH_MOVE_STEP 4		/* Buckets moved per operation during re-hashing */
+#define HASH_KEYS (1 << 16)		/* Number of primary hash keys */
 
 static void
 fib_ht_alloc(struct fib *f)
@@ -72,10 +100,59 @@ fib_ht_free(struct fib_node **h)
   mb_free(h);
 }
 
-static inline unsigned
-fib_hash(struct fib *f, ip_addr *a)
+static inline struct fib_node **
+fib_bucket(struct fib *f, uint h)
+{
+  if (f->old_table && (h >= f->rehash_pos))
+    return f->old_table + (h >> f->old_shift);
+  else
+    return f->hash_table + (h >> f->hash_shift);
+}
+
+static inline uint
+fib_bucket_shift(struct fib *f, uint h)
 {
-  return ipa_hash(*a) >> f->hash_shift;
+  return (f->old_table && (h >= f->rehash_pos)) ? f->old_shift : f->hash_shift;
+}
+
+/**
+ * fib_chain - find a hash chain by primary key
+ * @f: FIB to work with
+ * @pos: pointer to primary hash key
+ * @next: skip the chain containing *@pos
+ *
+ * This is an internal function used by FIB_WALK() and FIB_ITERATE_START().
+ * It returns the first node of the first nonempty hash chain whose primary
+ * keys start at *@pos or later (or after the chain of *@pos if @next is
+ * set) and updates *@pos to the first primary key of that chain. It returns
+ * %NULL if there are no more chains.
+ */
+struct fib_node *
+fib_chain(struct fib *f, uint *pos, int next)
+{
+  uint h = *pos;
+
+  if (next && (h < HASH_KEYS))
+    {
+      uint shift = fib_bucket_shift(f, h);
+      h = ((h >> shift) + 1) << shift;
+    }
+
+  while (h < HASH_KEYS)
+    {
+      struct fib_node *n = *fib_bucket(f, h);
+      if (n)
+	{
+	  *pos = h;
+	  return n;
+	}
+
+      uint shift = fib_bucket_shift(f, h);
+      h = ((h >> shift) + 1) << shift;
+    }
+
+  *pos = h;
+  return NULL;
 }
 
 static void
@@ -102,55 +179,88 @@ fib_init(struct fib *f, pool *p, unsigned node_size, unsigned hash_order, fib_in
     hash_order = HASH_DEF_ORDER;
   f->fib_pool = p;
   f->fib_slab = sl_new(p, node_size);
+  sl_set_name(f->fib_slab, "FIB nodes");
   f->hash_order = hash_order;
   fib_ht_alloc(f);
   bzero(f->hash_table, f->hash_size * sizeof(struct fib_node *));
+  f->old_table = NULL;
   f->entries = 0;
   f->entries_min = 0;
   f->init = init ? : fib_dummy_init;
+  f->trie_slab = NULL;
+  f->trie_root = NULL;
 }
 
 static void
-fib_rehash(struct fib *f, int step)
+fib_rehash_step(struct fib *f, uint max)
 {
-  unsigned old, new, oldn, newn, ni, nh;
-  struct fib_node **n, *e, *x, **t, **m, **h;
+  uint step = 1 << MAX(f->old_shift, f->hash_shift);
 
-  old = f->hash_order;
-  oldn = f->hash_size;
-  new = old + step;
-  m = h = f->hash_table;
-  DBG("Re-hashing FIB from order %d to %d\n", old, new);
-  f->hash_order = new;
-  fib_ht_alloc(f);
-  t = n = f->hash_table;
-  newn = f->hash_size;
-  ni = 0;
-
-  while (oldn--)
+  while (max-- && (f->rehash_pos < HASH_KEYS))
     {
-      x = *h++;
-      while (e = x)
-	{
-	  x = e->next;
-	  nh = fib_hash(f, &e->prefix);
-	  while (nh > ni)
-	    {
-	      *t = NULL;
-	      ni++;
-	      t = ++n;
-	    }
-	  *t = e;
-	  t = &e->next;
-	}
+      uint lo = f->rehash_pos >> f->old_shift;
+      uint hi = (f->rehash_pos + step) >> f->old_shift;
+      struct fib_node **t = NULL, *e, *x;
+      uint nh, ni = ~0;
+
+      /*
+       * Both the old buckets and the new buckets cover the same range of
+       * primary keys and the new ones are empty, so we just append nodes
+       * in their original order.
+       */
+      for (; lo < hi; lo++)
+	for (x = f->old_table[lo]; e = x; )
+	  {
+	    x = e->next;
+	    nh = ipa_hash(e->prefix) >> f->hash_shift;
+	    if (nh != ni)
+	      {
+		if (t)
+		  *t = NULL;
+		ni = nh;
+		t = f->hash_table + nh;
+		while (*t)
+		  t = &((*t)->next);
+	      }
+	    *t = e;
+	    t = &e->next;
+	  }
+      if (t)
+	*t = NULL;
+
+      f->rehash_pos += step;
     }
-  while (ni < newn)
+
+  if (f->rehash_pos >= HASH_KEYS)
     {
-      *t = NULL;
-      ni++;
-      t = ++n;
+      DBG("Re-hashing FIB to order %d finished\n", f->hash_order);
+      fib_ht_free(f->old_table);
+      f->old_table = NULL;
     }
-  fib_ht_free(m);
+}
+
+static inline void
+fib_rehash_finish(struct fib *f)
+{
+  if (f->old_table)
+    fib_rehash_step(f, ~0);
+}
+
+static void
+fib_rehash(struct fib *f, int step)
+{
+  /* Previous re-hashing must be finished before we start a new one */
+  fib_rehash_finish(f);
+
+  DBG("Re-hashing FIB from order %d to %d\n", f->hash_order, f->hash_order + step);
+  f->old_table = f->hash_table;
+  f->old_order = f->hash_order;
+  f->old_shift = f->hash_shift;
+  f->rehash_pos = 0;
+
+  f->hash_order += step;
+  fib_ht_alloc(f);
+  bzero(f->hash_table, f->hash_size * sizeof(struct fib_node *));
 }
 
 /**
@@ -165,7 +275,7 @@ fib_rehash(struct fib *f, int step)
 void *
 fib_find(struct fib *f, ip_addr *a, int len)
 {
-  struct fib_node *e = f->hash_table[fib_hash(f, a)];
+  struct fib_node *e = *fib_bucket(f, ipa_hash(*a));
 
   while (e && (e->pxlen != len || !ipa_equal(*a, e->prefix)))
     e = e->next;
@@ -194,6 +304,240 @@ fib_histogram(struct fib *f)
 }
 */
 
+/*
+ *	Prefix trie
+ */
+
+static inline uint
+fib_trie_cplen(ip_addr a, ip_addr b, uint max)
+{
+  return ipa_equal(a, b) ? max : MIN(ipa_pxlen(a, b), max);
+}
+
+static inline int
+fib_trie_bit(ip_addr a, uint pos)
+{
+  return ipa_getbit(a, pos) ? 1 : 0;
+}
+
+static struct fib_trie_node *
+fib_trie_new_node(struct fib *f, ip_addr a, uint plen, struct fib_trie_node *parent)
+{
+  struct fib_trie_node *n = sl_alloc(f->trie_slab);
+
+  n->c[0] = n->c[1] = NULL;
+  n->parent = parent;
+  n->node = NULL;
+  n->addr = ipa_and(a, ipa_mkmask(plen));
+  n->plen = plen;
+  return n;
+}
+
+static struct fib_trie_node *
+fib_trie_find(struct fib *f, ip_addr a, uint len)
+{
+  struct fib_trie_node *n = f->trie_root;
+
+  while (n && (n->plen < len) && ipa_in_net(a, n->addr, n->plen))
+    n = n->c[fib_trie_bit(a, n->plen)];
+
+  return (n && (n->plen == len) && ipa_equal(a, n->addr)) ? n : NULL;
+}
+
+static void
+fib_trie_insert(struct fib *f, struct fib_node *e)
+{
+  struct fib_trie_node **np = &f->trie_root;
+  struct fib_trie_node *n, *x, *parent = NULL;
+  ip_addr a = e->prefix;
+  uint len = e->pxlen;
+
+  while (n = *np)
+    {
+      uint cl = fib_trie_cplen(a, n->addr, MIN(len, n->plen));
+
+      if (cl < n->plen)
+	{
+	  /* Node n is out of path or below the new prefix, put a new node above it */
+	  x = fib_trie_new_node(f, a, cl, parent);
+	  x->c[fib_trie_bit(n->addr, cl)] = n;
+	  n->parent = x;
+	  *np = x;
+
+	  if (cl == len)
+	    {
+	      x->node = e;
+	      return;
+	    }
+
+	  /* The other branch of x is still empty */
+	  parent = x;
+	  np = &x->c[fib_trie_bit(a, cl)];
+	  break;
+	}
+
+      if (n->plen == len)
+	{
+	  n->node = e;
+	  return;
+	}
+
+      parent = n;
+      np = &n->c[fib_trie_bit(a, n->plen)];
+    }
+
+  x = fib_trie_new_node(f, a, len, parent);
+  x->node = e;
+  *np = x;
+}
+
+static void
+fib_trie_remove(struct fib *f, struct fib_node *e)
+{
+  struct fib_trie_node *n = fib_trie_find(f, e->prefix, e->pxlen);
+
+  if (!n || (n->node != e))
+    bug("fib_trie_remove() called for node not in trie");
+
+  n->node = NULL;
+
+  /* Remove nodes that are neither prefixes nor branching points */
+  while (n && !n->node && !(n->c[0] && n->c[1]))
+    {
+      struct fib_trie_node *c = n->c[0] ? : n->c[1];
+      struct fib_trie_node *p = n->parent;
+
+      if (p)
+	p->c[p->c[1] == n] = c;
+      else
+	f->trie_root = c;
+
+      if (c)
+	c->parent = p;
+
+      sl_free(f->trie_slab, n);
+
+      /* If we spliced n out, the parent keeps the number of children */
+      n = c ? NULL : p;
+    }
+}
+
+static struct fib_node *
+fib_trie_route(struct fib *f, ip_addr a, int len)
+{
+  struct fib_trie_node *n = f->trie_root;
+  struct fib_node *best = NULL;
+
+  while (n && (n->plen <= len) && ipa_in_net(a, n->addr, n->plen))
+    {
+      if (n->node)
+	best = n->node;
+
+      if (n->plen == len)
+	break;
+
+      n = n->c[fib_trie_bit(a, n->plen)];
+    }
+
+  return best;
+}
+
+static inline struct fib_trie_node *
+fib_trie_first(struct fib_trie_node *n)
+{
+  /* Branching nodes always have both children */
+  if (n)
+    while (!n->node)
+      n = n->c[0];
+
+  return n;
+}
+
+static struct fib_trie_node *
+fib_trie_next(struct fib_trie_node *n)
+{
+  if (n->c[0] || n->c[1])
+    return n->c[0] ? : n->c[1];
+
+  for (; n->parent; n = n->parent)
+    if ((n->parent->c[0] == n) && n->parent->c[1])
+      return n->parent->c[1];
+
+  return NULL;
+}
+
+/* Find the first trie node not preceding prefix a/len in prefix order */
+static struct fib_trie_node *
+fib_trie_seek(struct fib *f, ip_addr a, uint len)
+{
+  struct fib_trie_node *n = f->trie_root, *succ = NULL;
+
+  while (n)
+    {
+      uint ml = MIN(len, n->plen);
+      uint cl = fib_trie_cplen(a, n->addr, ml);
+
+      /* Out of path, the subtree of n is either completely before or after a/len */
+      if (cl < ml)
+	return fib_trie_bit(n->addr, cl) ? n : succ;
+
+      /* Node n is a/len itself or it is inside a/len */
+      if (n->plen >= len)
+	return n;
+
+      if (!fib_trie_bit(a, n->plen) && n->c[1])
+	succ = n->c[1];
+
+      n = n->c[fib_trie_bit(a, n->plen)];
+    }
+
+  return succ;
+}
+
+/**
+ * fib_init_trie - enable prefix trie for a FIB
+ * @f: FIB to work with
+ *
+ * This function builds a compressed binary trie of all prefixes stored
+ * in the FIB and keeps it up to date during further updates. The trie
+ * is then used by fib_route() instead of probing the hash table once per
+ * prefix length. Calling it for a FIB which already has a trie is a no-op.
+ */
+void
+fib_init_trie(struct fib *f)
+{
+  if (f->trie_slab)
+    return;
+
+  f->trie_slab = sl_new(f->fib_pool, sizeof(struct fib_trie_node));
+  sl_set_name(f->trie_slab, "FIB tries");
+  f->trie_root = NULL;
+
+  FIB_WALK(f, n)
+    {
+      fib_trie_insert(f, n);
+    }
+  FIB_WALK_END;
+}
+
+/**
+ * fib_free_trie - disable prefix trie for a FIB
+ * @f: FIB to work with
+ *
+ * This function frees the prefix trie built by fib_init_trie(), fib_route()
+ * falls back to hash probing afterwards.
+ */
+void
+fib_free_trie(struct fib *f)
+{
+  if (!f->trie_slab)
+    return;
+
+  rfree(f->trie_slab);
+  f->trie_slab = NULL;
+  f->trie_root = NULL;
+}
+
 /**
  * fib_get - find or create a FIB node
  * @f: FIB to work with
@@ -207,7 +551,7 @@ void *
 fib_get(struct fib *f, ip_addr *a, int len)
 {
   uint h = ipa_hash(*a);
-  struct fib_node **ee = f->hash_table + (h >> f->hash_shift);
+  struct fib_node **ee = fib_bucket(f, h);
   struct fib_node *g, *e = *ee;
   u32 uid = h << 16;
 
@@ -241,24 +585,18 @@ fib_get(struct fib *f, ip_addr *a, int len)
   *ee = e;
   e->readers = NULL;
   f->init(e);
+  if (f->trie_slab)
+    fib_trie_insert(f, e);
+  if (f->old_table)
+    fib_rehash_step(f, HASH_MOVE_STEP);
   if (f->entries++ > f->entries_max)
     fib_rehash(f, HASH_HI_STEP);
 
   return e;
 }
 
-/**
- * fib_route - CIDR routing lookup
- * @f: FIB to search in
- * @a: pointer to IP address of the prefix
- * @len: prefix length
- *
- * Search for a FIB node with longest prefix matching the given
- * network, that is a node which a CIDR router would use for routing
- * that network.
- */
-void *
-fib_route(struct fib *f, ip_addr a, int len)
+static void *
+fib_route_hash(struct fib *f, ip_addr a, int len)
 {
   ip_addr a0;
   void *t;
@@ -274,6 +612,26 @@ fib_route(struct fib *f, ip_addr a, int len)
   return NULL;
 }
 
+/**
+ * fib_route - CIDR routing lookup
+ * @f: FIB to search in
+ * @a: pointer to IP address of the prefix
+ * @len: prefix length
+ *
+ * Search for a FIB node with longest prefix matching the given
+ * network, that is a node which a CIDR router would use for routing
+ * that network. The prefix trie is used if enabled for the FIB,
+ * otherwise the hash table is probed for each prefix length.
+ */
+void *
+fib_route(struct fib *f, ip_addr a, int len)
+{
+  if (f->trie_slab)
+    return fib_trie_route(f, a, len);
+
+  return fib_route_hash(f, a, len);
+}
+
 static inline void
 fib_merge_readers(struct fib_iterator *i, struct fib_node *to)
 {
@@ -321,8 +679,8 @@ void
 fib_delete(struct fib *f, void *E)
 {
   struct fib_node *e = E;
-  uint h = fib_hash(f, &e->prefix);
-  struct fib_node **ee = f->hash_table + h;
+  uint h = ipa_hash(e->prefix);
+  struct fib_node **ee = fib_bucket(f, h);
   struct fib_iterator *it;
 
   while (*ee)
@@ -330,20 +688,16 @@ fib_delete(struct fib *f, void *E)
       if (*ee == e)
 	{
 	  *ee = e->next;
+	  if (f->trie_slab)
+	    fib_trie_remove(f, e);
 	  if (it = e->readers)
 	    {
-	      struct fib_node *l = e->next;
-	      while (!l)
-		{
-		  h++;
-		  if (h >= f->hash_size)
-		    break;
-		  else
-		    l = f->hash_table[h];
-		}
+	      struct fib_node *l = e->next ? : fib_chain(f, &h, 1);
 	      fib_merge_readers(it, l);
 	    }
 	  sl_free(f->fib_slab, e);
+	  if (f->old_table)
+	    fib_rehash_step(f, HASH_MOVE_STEP);
 	  if (f->entries-- < f->entries_min)
 	    fib_rehash(f, -HASH_LO_STEP);
 	  return;
@@ -364,26 +718,28 @@ void
 fib_free(struct fib *f)
 {
   fib_ht_free(f->hash_table);
+  if (f->old_table)
+    fib_ht_free(f->old_table);
   rfree(f->fib_slab);
+  fib_free_trie(f);
 }
 
 void
 fit_init(struct fib_iterator *i, struct fib *f)
 {
-  unsigned h;
+  uint h = 0;
   struct fib_node *n;
 
   i->efef = 0xff;
-  for(h=0; h<f->hash_size; h++)
-    if (n = f->hash_table[h])
-      {
-	i->prev = (struct fib_iterator *) n;
-	if (i->next = n->readers)
-	  i->next->prev = i;
-	n->readers = i;
-	i->node = n;
-	return;
-      }
+  if (n = fib_chain(f, &h, 0))
+    {
+      i->prev = (struct fib_iterator *) n;
+      if (i->next = n->readers)
+	i->next->prev = i;
+      n->readers = i;
+      i->node = n;
+      return;
+    }
   /* The fib is empty, nothing to do */
   i->prev = i->next = NULL;
   i->node = NULL;
@@ -398,7 +754,7 @@ fit_get(struct fib *f, struct fib_iterator *i)
   if (!i->prev)
     {
       /* We are at the end */
-      i->hash = ~0 - 1;
+      i->hash = ~0;
       return NULL;
     }
   if (!(n = i->node))
@@ -413,7 +769,7 @@ fit_get(struct fib *f, struct fib_iterator *i)
   if (k = i->next)
     k->prev = j;
   j->next = k;
-  i->hash = fib_hash(f, &n->prefix);
+  i->hash = ipa_hash(n->prefix);
   return n;
 }
 
@@ -436,9 +792,8 @@ fit_put_next(struct fib *f, struct fib_iterator *i, struct fib_node *n, uint hpo
   if (n = n->next)
     goto found;
 
-  while (++hpos < f->hash_size)
-    if (n = f->hash_table[hpos])
-      goto found;
+  if (n = fib_chain(f, &hpos, 1))
+    goto found;
 
   /* We are at the end */
   i->prev = i->next = NULL;
@@ -449,6 +804,63 @@ found:
   fit_put(i, n);
 }
 
+static struct fib_node *
+fot_found(struct fib_ordered_iterator *i, struct fib_trie_node *n)
+{
+  n = fib_trie_first(n);
+
+  if (!n || !net_in_net(n->addr, n->plen, i->limit, i->limit_len))
+    {
+      i->node = NULL;
+      i->state = FOT_END;
+      return NULL;
+    }
+
+  i->node = n;
+  return n->node;
+}
+
+/**
+ * fot_init - initialize ordered FIB iterator
+ * @i: iterator to be initialized
+ * @f: FIB to walk, it must have the prefix trie enabled
+ * @px: network prefix
+ * @len: network prefix length
+ *
+ * This function prepares the iterator @i for FIB_ORDERED_START(), which
+ * walks FIB nodes in prefix order, each prefix followed by its more
+ * specifics. Only prefixes inside @px/@len are visited, use zero
+ * @len to walk the whole FIB. The walk can be paused by FIB_ORDERED_PUT()
+ * and resumed later even if the FIB was modified in the meantime; there is
+ * no need to unlink the iterator if the walk is abandoned.
+ */
+void
+fot_init(struct fib_ordered_iterator *i, struct fib *f, ip_addr px, int len)
+{
+  if (!f->trie_slab)
+    bug("fot_init() called for FIB without trie");
+
+  i->node = NULL;
+  i->prefix = i->limit = ipa_and(px, ipa_mkmask(len));
+  i->pxlen = i->limit_len = len;
+  i->state = FOT_RUNNING;
+}
+
+struct fib_node *
+fot_get(struct fib *f, struct fib_ordered_iterator *i)
+{
+  if (i->state == FOT_END)
+    return NULL;
+
+  return fot_found(i, fib_trie_seek(f, i->prefix, i->pxlen));
+}
+
+struct fib_node *
+fot_next(struct fib *f UNUSED, struct fib_ordered_iterator *i)
+{
+  return fot_found(i, fib_trie_next(i->node));
+}
+
 #ifdef DEBUGGING
 
 /**
@@ -462,20 +874,21 @@ void
 fib_check(struct fib *f)
 {
   uint i, ec, lo, nulls;
+  struct fib_node *c;
 
   ec = 0;
-  for(i=0; i<f->hash_size; i++)
+  lo = 0;
+  for(i=0; c=fib_chain(f, &i, !!ec); )
     {
       struct fib_node *n;
-      lo = 0;
-      for(n=f->hash_table[i]; n; n=n->next)
+      for(n=c; n; n=n->next)
 	{
 	  struct fib_iterator *j, *j0;
 	  uint h0 = ipa_hash(n->prefix);
 	  if (h0 < lo)
 	    bug("fib_check: discord in hash chains");
 	  lo = h0;
-	  if ((h0 >> f->hash_shift) != i)
+	  if (*fib_bucket(f, h0) != c)
 	    bug("fib_check: mishashed %x->%x (order %d)", h0, i, f->hash_order);
 	  j0 = (struct fib_iterator *) n;
 	  nulls = 0;
@@ -491,6 +904,12 @@ fib_check(struct fib *f)
 	      else if (j->node != n)
 		bug("fib_check: iterator->node mismatch");
 	    }
+	  if (f->trie_slab)
+	    {
+	      struct fib_trie_node *t = fib_trie_find(f, n->prefix, n->pxlen);
+	      if (!t || (t->node != n))
+		bug("fib_check: node %I/%d missing in trie", n->prefix, n->pxlen);
+	    }
 	  ec++;
 	}
     }
@@ -502,6 +921,8 @@ fib_check(struct fib *f)
 
 #ifdef TEST
 
+#include <stdlib.h>
+#include <time.h>
 #include "lib/resource.h"
 
 struct fib f;
@@ -509,13 +930,15 @@ struct fib f;
 void dump(char *m)
 {
   uint i;
+  struct fib_node *c = NULL;
 
-  debug("%s ... order=%d, size=%d, entries=%d\n", m, f.hash_order, f.hash_size, f.hash_size);
-  for(i=0; i<f.hash_size; i++)
+  debug("%s ... order=%d, size=%d, entries=%d, moved=%x\n", m, f.hash_order, f.hash_size, f.entries,
+	f.old_table ? f.rehash_pos : HASH_KEYS);
+  for(i=0; c=fib_chain(&f, &i, c != NULL); )
     {
       struct fib_node *n;
       struct fib_iterator *j;
-      for(n=f.hash_table[i]; n; n=n->next)
+      for(n=c; n; n=n->next)
 	{
 	  debug("%04x %04x %p %I/%2d", i, ipa_hash(n->prefix), n, n->prefix, n->pxlen);
 	  for(j=n->readers; j; j=j->next)
@@ -531,6 +954,81 @@ void init(struct fib_node *n)
 {
 }
 
+/*
+ * Compare trie-based fib_route() against probing of the hash table.
+ * Prefixes and lookup addresses are random, so most lookups miss long
+ * prefixes, which is the expensive case for the probing loop.
+ */
+
+static ip_addr
+random_addr(void)
+{
+#ifdef IPV6
+  return ipa_build6(random() ^ (random() << 16), random() ^ (random() << 16),
+		    random() ^ (random() << 16), random() ^ (random() << 16));
+#else
+  return ipa_from_u32(random() ^ (random() << 16));
+#endif
+}
+
+static int
+bench_lookups(struct fib *b, ip_addr *keys, int num, int trie)
+{
+  clock_t t0 = clock();
+  int i, hits = 0;
+
+  for (i = 0; i < num; i++)
+    hits += !!(trie ? fib_trie_route(b, keys[i], MAX_PREFIX_LENGTH)
+	       : fib_route_hash(b, keys[i], MAX_PREFIX_LENGTH));
+
+  int ms = (clock() - t0) * 1000 / CLOCKS_PER_SEC;
+  debug("  %s: %d hits in %d ms\n", trie ? "trie" : "hash probing", hits, ms);
+  return ms;
+}
+
+void bench(int prefixes, int lookups)
+{
+  struct fib b;
+  ip_addr *keys = xmalloc(lookups * sizeof(ip_addr));
+  int i;
+
+  fib_init(&b, &root_pool, sizeof(struct fib_node), 0, NULL);
+  fib_init_trie(&b);
+
+  for (i = 0; i < prefixes; i++)
+    {
+      int len = 16 + random() % (MAX_PREFIX_LENGTH - 15);
+      ip_addr a = ipa_and(random_addr(), ipa_mkmask(len));
+      fib_get(&b, &a, len);
+    }
+
+  for (i = 0; i < lookups; i++)
+    keys[i] = random_addr();
+
+  fib_check(&b);
+  for (i = 0; i < lookups; i++)
+    if (fib_trie_route(&b, keys[i], MAX_PREFIX_LENGTH) !=
+	fib_route_hash(&b, keys[i], MAX_PREFIX_LENGTH))
+      bug("bench: trie and hash lookups differ for %I", keys[i]);
+
+  debug("bench: %d prefixes, %d lookups\n", b.entries, lookups);
+  bench_lookups(&b, keys, lookups, 0);
+  bench_lookups(&b, keys, lookups, 1);
+
+  /* Deleting nodes must keep the trie consistent */
+  for (i = 0; i < lookups; i++)
+    {
+      struct fib_node *n = fib_trie_route(&b, keys[i], MAX_PREFIX_LENGTH);
+      if (n)
+	fib_delete(&b, n);
+    }
+  fib_check(&b);
+  debug("bench: %d prefixes left after deletes\n", b.entries);
+
+  xfree(keys);
+  fib_free(&b);
+}
+
 int main(void)
 {
   struct fib_node *n;
@@ -538,7 +1036,7 @@ int main(void)
   ip_addr a;
   int c;
 
-  log_init_debug(NULL);
+  log_init_debug("");
   resource_init();
   fib_init(&f, &root_pool, sizeof(struct fib_node), 4, init);
   dump("init");
@@ -555,9 +1053,17 @@ int main(void)
   dump("iter init");
 
   fib_rehash(&f, 1);
+  fib_rehash_step(&f, 1);
+  dump("rehash up started");
+
+  fib_rehash_finish(&f);
   dump("rehash up");
 
   fib_rehash(&f, -1);
+  fib_rehash_step(&f, 1);
+  dump("rehash down started");
+
+  fib_rehash_finish(&f);
   dump("rehash down");
 
 next:
@@ -590,6 +1096,8 @@ next:
   fib_delete(&f, n);
   dump("iter step 3");
 
+  bench(500000, 1000000);
+
   return 0;
 }
 
@@ -183,20 +183,13 @@ roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 byte
 roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 {
-  struct roa_node *n;
-  ip_addr px;
   byte anything = 0;
 
-  int len;
-  for (len = pxlen; len >= 0; len--)
+  FIB_WALK_COVERING(&t->fib, prefix, pxlen, fn)
     {
-      px = ipa_and(prefix, ipa_mkmask(len));
-      n = fib_find(&t->fib, &px, len);
-
-      if (!n)
-	continue;
-
+      struct roa_node *n = (struct roa_node *) fn;
       struct roa_item *it;
+
       for (it = n->items; it; it = it->next)
 	{
 	  anything = 1;
@@ -204,6 +197,7 @@ roa_check(struct roa_table *t, ip_addr prefix, byte pxlen, u32 asn)
 	    return ROA_VALID;
 	}
     }
+  FIB_WALK_COVERING_END;
 
   return anything ? ROA_INVALID : ROA_UNKNOWN;
 }
@@ -230,6 +224,7 @@ roa_new_table(struct roa_table_config *cf)
 
   t = mb_allocz(roa_pool, sizeof(struct roa_table));
   fib_init(&t->fib, roa_pool, sizeof(struct roa_node), 0, roa_node_init);
+  fib_init_trie(&t->fib);
   t->name = cf->name;
   t->cf = cf;
 
@@ -280,6 +275,7 @@ roa_init(void)
 {
   roa_pool = rp_new(&root_pool, "ROA tables");
   roa_slab = sl_new(roa_pool, sizeof(struct roa_item));
+  sl_set_name(roa_slab, "ROA items");
   init_list(&roa_table_list);
 }
 
@@ -362,53 +358,40 @@ roa_show_cont(struct cli *c)
 {
   struct roa_show_data *d = c->rover;
   struct fib *fib = &d->table->fib;
-  struct fib_iterator *it = &d->fit;
+  struct fib_ordered_iterator *it = &d->fot;
   struct roa_node *rn;
   unsigned max = 32;
 
-  FIB_ITERATE_START(fib, it, f)
+  FIB_ORDERED_START(fib, it, f)
     {
       rn = (struct roa_node *) f;
 
       if (!max--)
 	{
-	  FIB_ITERATE_PUT(it, f);
+	  FIB_ORDERED_PUT(it, f);
 	  return;
 	}
 
-      if ((d->mode == ROA_SHOW_ALL) ||
-	  net_in_net(rn->n.prefix, rn->n.pxlen, d->prefix, d->pxlen))
-	roa_show_node(c, rn, 0, d->asn);
+      roa_show_node(c, rn, 0, d->asn);
     }
-  FIB_ITERATE_END(f);
+  FIB_ORDERED_END;
 
   cli_printf(c, 0, "");
-  c->cont = c->cleanup = NULL;
-}
-
-static void
-roa_show_cleanup(struct cli *c)
-{
-  struct roa_show_data *d = c->rover;
-
-  /* Unlink the iterator */
-  fit_get(&d->table->fib, &d->fit);
+  c->cont = NULL;
 }
 
 void
 roa_show(struct roa_show_data *d)
 {
   struct roa_node *rn;
-  ip_addr px;
-  int len;
 
   switch (d->mode)
     {
     case ROA_SHOW_ALL:
     case ROA_SHOW_IN:
-      FIB_ITERATE_INIT(&d->fit, &d->table->fib);
+      /* Prefix is zero (i.e. all networks) for ROA_SHOW_ALL */
+      FIB_ORDERED_INIT(&d->fot, &d->table->fib, d->prefix, d->pxlen);
       this_cli->cont = roa_show_cont;
-      this_cli->cleanup = roa_show_cleanup;
       this_cli->rover = d;
       break;
 
@@ -424,16 +407,11 @@ roa_show(struct roa_show_data *d)
       break;
 
     case ROA_SHOW_FOR:
-      for (len = d->pxlen; len >= 0; len--)
+      FIB_WALK_COVERING(&d->table->fib, d->prefix, d->pxlen, fn)
 	{
-	  px = ipa_and(d->prefix, ipa_mkmask(len));
-	  rn = fib_find(&d->table->fib, &px, len);
-
-	  if (!rn)
-	    continue;
-
-	  roa_show_node(this_cli, rn, 0, d->asn);
+	  roa_show_node(this_cli, (struct roa_node *) fn, 0, d->asn);
 	}
+      FIB_WALK_COVERING_END;
       cli_msg(0, "");
       break;
     }
@@ -21,6 +21,25 @@
  * on the list being the best one (i.e., the one we currently use
  * for routing), the order of the other ones is undetermined.
  *
+ * Route servers and similar setups may have hundreds of routes per network.
+ * Tables configured with the <cf/arrays/ option therefore keep an array of
+ * pointers to the routes (&rte_array) in the same order as in the list
+ * for networks with many routes. It also holds the route sources, so the
+ * route being replaced by an update can be found by a scan of contiguous
+ * memory instead of chasing pointers through the routes and their
+ * attributes, and loops over all routes of a network do not have to wait
+ * for each route to be loaded before getting to the next one. All changes
+ * of the route lists in this module are done by rte_link() and
+ * rte_unlink(), which keep the array in sync.
+ *
+ * Tables configured with the <cf/deferred/ option do not announce changes
+ * of the best route to protocols immediately. The network is queued on the
+ * @pending_exports list together with a copy of the best route before the
+ * change, further changes of the network just update the table, and the
+ * table event later announces the difference between the original and the
+ * current best route in batches (see rt_export_pending()). Changes of other
+ * kinds are always announced immediately.
+ *
  * The &rte contains information specific to the route (preference, protocol
  * metrics, time of last modification etc.) and a pointer to a &rta structure
  * (see the route attribute module for a precise explanation) holding the
@@ -42,11 +61,14 @@
 #include "filter/filter.h"
 #include "lib/string.h"
 #include "lib/alloca.h"
+#include "lib/workers.h"
 
 pool *rt_table_pool;
 
 static slab *rte_slab;
 static linpool *rte_update_pool;
+static pool *rte_array_pool;
+static slab *rt_export_slab;
 
 static list routing_tables;
 
@@ -58,6 +80,8 @@ static void rt_next_hop_update(rtable *tab);
 static inline int rt_prune_table(rtable *tab);
 static inline void rt_schedule_gc(rtable *tab);
 static inline void rt_schedule_prune(rtable *tab);
+static void rt_schedule_export(rtable *tab);
+static int rte_better(rte *new, rte *old);
 
 
 static inline struct ea_list *
@@ -72,16 +96,14 @@ make_tmp_attrs(struct rte *rt, struct linpool *pool)
 static net *
 net_route(rtable *tab, ip_addr a, int len)
 {
-  ip_addr a0;
   net *n;
 
   while (len >= 0)
     {
-      a0 = ipa_and(a, ipa_mkmask(len));
-      n = fib_find(&tab->fib, &a0, len);
-      if (n && rte_is_valid(n->routes))
+      n = fib_route(&tab->fib, a, len);
+      if (!n || rte_is_valid(n->routes))
 	return n;
-      len--;
+      len = n->n.pxlen - 1;
     }
   return NULL;
 }
@@ -92,7 +114,190 @@ rte_init(struct fib_node *N)
   net *n = (net *) N;
 
   N->flags = 0;
+  N->x0 = 0;
   n->routes = NULL;
+  n->array = NULL;
+}
+
+/*
+ *	Route arrays
+ */
+
+#define RTE_ARRAY_MIN	8		/* Networks with that many routes get an array */
+
+static struct rte_array *
+rte_array_alloc(uint size)
+{
+  struct rte_array *a = mb_alloc(rte_array_pool, sizeof(struct rte_array) + 2 * size * sizeof(void *));
+  a->count = 0;
+  a->size = size;
+  a->src = (struct rte_src **) (a->routes + size);
+  return a;
+}
+
+static void
+rte_array_build(net *n, uint count)
+{
+  struct rte_array *a = rte_array_alloc(2 * count);
+  rte *e;
+
+  for (e = n->routes; e; e = e->next)
+    {
+      a->routes[a->count] = e;
+      a->src[a->count] = e->attrs->src;
+      a->count++;
+    }
+  n->array = a;
+}
+
+static inline uint
+rte_array_find(struct rte_array *a, rte *e)
+{
+  uint i;
+
+  for (i = 0; i < a->count; i++)
+    if (a->routes[i] == e)
+      return i;
+
+  bug("Route not found in route array");
+}
+
+static void
+rte_array_insert(net *n, uint pos, rte *e)
+{
+  struct rte_array *a = n->array;
+
+  if (a->count == a->size)
+    {
+      struct rte_array *b = rte_array_alloc(2 * a->size);
+      memcpy(b->routes, a->routes, a->count * sizeof(rte *));
+      memcpy(b->src, a->src, a->count * sizeof(struct rte_src *));
+      b->count = a->count;
+      mb_free(a);
+      n->array = a = b;
+    }
+
+  memmove(a->routes + pos + 1, a->routes + pos, (a->count - pos) * sizeof(rte *));
+  memmove(a->src + pos + 1, a->src + pos, (a->count - pos) * sizeof(struct rte_src *));
+  a->routes[pos] = e;
+  a->src[pos] = e->attrs->src;
+  a->count++;
+}
+
+static void
+rte_array_remove(net *n, uint pos)
+{
+  struct rte_array *a = n->array;
+
+  a->count--;
+  memmove(a->routes + pos, a->routes + pos + 1, (a->count - pos) * sizeof(rte *));
+  memmove(a->src + pos, a->src + pos + 1, (a->count - pos) * sizeof(struct rte_src *));
+
+  /* Hysteresis, so that a network around the limit does not flap */
+  if (a->count < RTE_ARRAY_MIN / 2)
+    {
+      mb_free(a);
+      n->array = NULL;
+    }
+}
+
+/* Link route @e to the list of network @n after route @after, or first if NULL */
+static void
+rte_link(rtable *tab, net *n, rte *e, rte *after)
+{
+  if (after)
+    {
+      e->next = after->next;
+      after->next = e;
+    }
+  else
+    {
+      e->next = n->routes;
+      n->routes = e;
+    }
+
+  if (n->array)
+    rte_array_insert(n, after ? rte_array_find(n->array, after) + 1 : 0, e);
+  else if (tab->config && tab->config->arrays)
+    {
+      uint count = 0;
+      for (e = n->routes; e && (count < RTE_ARRAY_MIN); e = e->next)
+	count++;
+
+      if (count == RTE_ARRAY_MIN)
+	rte_array_build(n, count);
+    }
+}
+
+/* Unlink route @e from the list of network @n, @before is the previous route or NULL */
+static void
+rte_unlink(net *n, rte *e, rte *before)
+{
+  if (before)
+    before->next = e->next;
+  else
+    n->routes = e->next;
+
+  if (n->array)
+    rte_array_remove(n, before ? rte_array_find(n->array, before) + 1 : 0);
+}
+
+/* Find the best route of network @n and move it to the first position */
+static void
+rte_relink_best(net *n)
+{
+  struct rte_array *a = n->array;
+  rte *best, *before;
+
+  if (!n->routes)
+    return;
+
+  if (a)
+    {
+      uint i, b = 0;
+      for (i = 1; i < a->count; i++)
+	if (rte_better(a->routes[i], a->routes[b]))
+	  b = i;
+
+      if (!b)
+	return;
+
+      best = a->routes[b];
+      before = a->routes[b-1];
+      memmove(a->routes + 1, a->routes, b * sizeof(rte *));
+      memmove(a->src + 1, a->src, b * sizeof(struct rte_src *));
+      a->routes[0] = best;
+      a->src[0] = best->attrs->src;
+    }
+  else
+    {
+      rte *e;
+      best = n->routes;
+      before = NULL;
+      for (e = n->routes; e->next; e = e->next)
+	if (rte_better(e->next, best))
+	  {
+	    best = e->next;
+	    before = e;
+	  }
+
+      if (!before)
+	return;
+    }
+
+  before->next = best->next;
+  best->next = n->routes;
+  n->routes = best;
+}
+
+/* Get the route following @r, which is at position @i in network @n */
+static inline rte *
+rte_next(net *n, rte *r, uint *i)
+{
+  if (!n->array)
+    return r->next;
+
+  return (++*i < n->array->count) ? n->array->routes[*i] : NULL;
 }
 
 /**
@@ -247,45 +452,65 @@ rte_trace_out(uint flag, struct proto *p, rte *e, char *msg)
     rte_trace(p, e, '<', msg);
 }
 
+/*
+ * Export filtering is split to three steps, so the filters without side
+ * effects may be run by worker threads for many announce hooks at once.
+ */
+struct export_filter_job {
+  rte *rt0;				/* Route to be filtered, NULL if none */
+  rte *rt;				/* The route as modified by import_control() */
+  ea_list *tmpa;			/* Temporary attributes */
+  int ic;				/* Result of import_control() */
+  int fv;				/* Result of the filter */
+};
+
+static void
+export_filter_start(struct announce_hook *ah, rte *rt0, struct export_filter_job *j)
+{
+  struct proto *p = ah->proto;
+
+  j->rt0 = j->rt = rt0;
+  j->tmpa = make_tmp_attrs(rt0, rte_update_pool);
+  j->ic = p->import_control ? p->import_control(p, &j->rt, &j->tmpa, rte_update_pool) : 0;
+  j->fv = F_ACCEPT;
+}
+
+static inline void
+export_filter_run(struct announce_hook *ah, struct export_filter_job *j, linpool *lp)
+{
+  if (j->rt0 && !j->ic && ah->out_filter)
+    j->fv = f_run(ah->out_filter, &j->rt, &j->tmpa, lp, FF_FORCE_TMPATTR);
+}
+
 static rte *
-export_filter(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa, int silent)
+export_filter_finish(struct announce_hook *ah, struct export_filter_job *j, rte **rt_free, ea_list **tmpa, int silent)
 {
   struct proto *p = ah->proto;
-  struct filter *filter = ah->out_filter;
   struct proto_stats *stats = ah->stats;
-  ea_list *tmpb = NULL;
-  rte *rt;
-  int v;
+  rte *rt = j->rt;
 
-  rt = rt0;
   *rt_free = NULL;
+  if (tmpa)
+    *tmpa = j->tmpa;
 
-  if (!tmpa)
-    tmpa = &tmpb;
-
-  *tmpa = make_tmp_attrs(rt, rte_update_pool);
-
-  v = p->import_control ? p->import_control(p, &rt, tmpa, rte_update_pool) : 0;
-  if (v < 0)
+  if (j->ic < 0)
     {
       if (silent)
 	goto reject;
 
       stats->exp_updates_rejected++;
-      if (v == RIC_REJECT)
+      if (j->ic == RIC_REJECT)
 	rte_trace_out(D_FILTERS, p, rt, "rejected by protocol");
       goto reject;
     }
-  if (v > 0)
+  if (j->ic > 0)
     {
       if (!silent)
 	rte_trace_out(D_FILTERS, p, rt, "forced accept by protocol");
       goto accept;
     }
 
-  v = filter && ((filter == FILTER_REJECT) ||
-		 (f_run(filter, &rt, tmpa, rte_update_pool, FF_FORCE_TMPATTR) > F_ACCEPT));
-  if (v)
+  if (j->fv > F_ACCEPT)
     {
       if (silent)
 	goto reject;
@@ -296,17 +521,27 @@ export_filter(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa,
     }
 
  accept:
-  if (rt != rt0)
+  if (rt != j->rt0)
     *rt_free = rt;
   return rt;
 
  reject:
   /* Discard temporary rte */
-  if (rt != rt0)
+  if (rt != j->rt0)
     rte_free(rt);
   return NULL;
 }
 
+static rte *
+export_filter(struct announce_hook *ah, rte *rt0, rte **rt_free, ea_list **tmpa, int silent)
+{
+  struct export_filter_job j;
+
+  export_filter_start(ah, rt0, &j);
+  export_filter_run(ah, &j, rte_update_pool);
+  return export_filter_finish(ah, &j, rt_free, tmpa, silent);
+}
+
 static void
 do_rt_notify(struct announce_hook *ah, net *net, rte *new, rte *old, ea_list *tmpa, int refeed)
 {
@@ -396,19 +631,20 @@ do_rt_notify(struct announce_hook *ah, net *net, rte *new, rte *old, ea_list *tm
     p->rt_notify(p, ah->table, net, new, old, new->attrs->eattrs);
 }
 
+#define RT_PARALLEL_MIN	16		/* Hooks with pure filters to use worker threads */
+
+struct export_job {
+  struct announce_hook *ah;
+  struct export_filter_job new, old;
+};
+
 static void
-rt_notify_basic(struct announce_hook *ah, net *net, rte *new0, rte *old0, int refeed)
+rt_notify_basic_start(struct export_job *j, rte *new0, rte *old0, int refeed)
 {
-  struct proto *p = ah->proto;
+  struct announce_hook *ah = j->ah;
   struct proto_stats *stats = ah->stats;
 
-  rte *new = new0;
-  rte *old = old0;
-  rte *new_free = NULL;
-  rte *old_free = NULL;
-  ea_list *tmpa = NULL;
-
-  if (new)
+  if (new0)
     stats->exp_updates_received++;
   else
     stats->exp_withdraws_received++;
@@ -433,11 +669,39 @@ rt_notify_basic(struct announce_hook *ah, net *net, rte *new0, rte *old0, int re
    * not refeeded (because it disappeared before that).
    */
 
+  j->new.rt0 = j->old.rt0 = NULL;
+
+  if (new0)
+    export_filter_start(ah, new0, &j->new);
+
+  if (old0 && !refeed)
+    export_filter_start(ah, old0, &j->old);
+}
+
+static inline void
+rt_notify_basic_run(struct export_job *j, linpool *lp)
+{
+  export_filter_run(j->ah, &j->new, lp);
+  export_filter_run(j->ah, &j->old, lp);
+}
+
+static void
+rt_notify_basic_finish(struct export_job *j, net *net, rte *new0, rte *old0, int refeed)
+{
+  struct announce_hook *ah = j->ah;
+  struct proto *p = ah->proto;
+
+  rte *new = new0;
+  rte *old = old0;
+  rte *new_free = NULL;
+  rte *old_free = NULL;
+  ea_list *tmpa = NULL;
+
   if (new)
-    new = export_filter(ah, new, &new_free, &tmpa, 0);
+    new = export_filter_finish(ah, &j->new, &new_free, &tmpa, 0);
 
   if (old && !refeed)
-    old = export_filter(ah, old, &old_free, NULL, 1);
+    old = export_filter_finish(ah, &j->old, &old_free, NULL, 1);
 
   if (!new && !old)
   {
@@ -469,6 +733,88 @@ rt_notify_basic(struct announce_hook *ah, net *net, rte *new0, rte *old0, int re
     rte_free(old_free);
 }
 
+static void
+rt_notify_basic(struct announce_hook *ah, net *net, rte *new0, rte *old0, int refeed)
+{
+  struct export_job j = { .ah = ah };
+
+  rt_notify_basic_start(&j, new0, old0, refeed);
+  rt_notify_basic_run(&j, rte_update_pool);
+  rt_notify_basic_finish(&j, net, new0, old0, refeed);
+}
+
+static inline int
+export_filter_parallel(struct announce_hook *ah)
+{
+  struct filter *f = ah->out_filter;
+  return (f != FILTER_ACCEPT) && (f != FILTER_REJECT) && filter_pure(f);
+}
+
+static void
+rt_export_job_hook(void *data, uint i, linpool *lp)
+{
+  struct export_job *j = ((struct export_job *) data) + i;
+
+  if (export_filter_parallel(j->ah))
+    rt_notify_basic_run(j, lp);
+}
+
+/*
+ * rt_notify_basic_all - announce a change to all hooks of given type, which
+ * is either RA_OPTIMAL or RA_ANY. When there are enough hooks with filters
+ * without side effects and worker threads are enabled, the changes are
+ * prepared for all the hooks first, then their filters are run by the worker
+ * threads and then the results are announced in the original order.
+ */
+static void
+rt_notify_basic_all(rtable *tab, unsigned type, net *net, rte *new, rte *old)
+{
+  struct announce_hook *a;
+  struct export_job *jobs;
+  uint count = 0, parallel = 0, i;
+
+  if (workers_count())
+    WALK_LIST(a, tab->hooks)
+      if (a->proto->accept_ra_types == type)
+	{
+	  count++;
+	  parallel += export_filter_parallel(a);
+	}
+
+  if (parallel < RT_PARALLEL_MIN)
+    {
+      WALK_LIST(a, tab->hooks)
+	{
+	  ASSERT(a->proto->export_state != ES_DOWN);
+	  if (a->proto->accept_ra_types == type)
+	    rt_notify_basic(a, net, new, old, 0);
+	}
+      return;
+    }
+
+  jobs = lp_alloc(rte_update_pool, count * sizeof(struct export_job));
+  i = 0;
+  WALK_LIST(a, tab->hooks)
+    {
+      ASSERT(a->proto->export_state != ES_DOWN);
+      if (a->proto->accept_ra_types == type)
+	{
+	  struct export_job *j = &jobs[i++];
+	  j->ah = a;
+	  rt_notify_basic_start(j, new, old, 0);
+
+	  /* Other filters may have side effects, so they are run here in order */
+	  if (!export_filter_parallel(a))
+	    rt_notify_basic_run(j, rte_update_pool);
+	}
+    }
+
+  workers_run(rt_export_job_hook, jobs, count);
+
+  for (i = 0; i < count; i++)
+    rt_notify_basic_finish(&jobs[i], net, new, old, 0);
+}
+
 static void
 rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *old_changed, rte *before_old, int feed)
 {
@@ -481,6 +827,7 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
   rte *new_free = NULL;
   rte *old_free = NULL;
   ea_list *tmpa = NULL;
+  uint pos = 0;
 
   /* Used to track whether we met old_changed position. If before_old is NULL
      old_changed was the first and we met it implicitly before current best route. */
@@ -496,7 +843,7 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
     stats->exp_withdraws_received++;
 
   /* First, find the new_best route - first accepted by filters */
-  for (r=net->routes; rte_is_valid(r); r=r->next)
+  for (r=net->routes; rte_is_valid(r); r=rte_next(net, r, &pos))
     {
       if (new_best = export_filter(ah, r, &new_free, &tmpa, 0))
 	break;
@@ -565,7 +912,7 @@ rt_notify_accepted(struct announce_hook *ah, net *net, rte *new_changed, rte *ol
     }
 
   /* Fourth case */
-  for (r=r->next; rte_is_valid(r); r=r->next)
+  for (r=rte_next(net, r, &pos); rte_is_valid(r); r=rte_next(net, r, &pos))
     {
       if (old_best = export_filter(ah, r, &old_free, NULL, 1))
 	goto found;
@@ -602,6 +949,7 @@ rt_export_merged(struct announce_hook *ah, net *net, rte **rt_free, ea_list **tm
   // struct proto *p = ah->proto;
   struct mpnh *nhs = NULL;
   rte *best0, *best, *rt0, *rt, *tmp;
+  uint pos = 0;
 
   best0 = net->routes;
   *rt_free = NULL;
@@ -614,7 +962,7 @@ rt_export_merged(struct announce_hook *ah, net *net, rte **rt_free, ea_list **tm
   if (!best || !rte_is_reachable(best))
     return best;
 
-  for (rt0 = best0->next; rt0; rt0 = rt0->next)
+  for (rt0 = rte_next(net, best0, &pos); rt0; rt0 = rte_next(net, rt0, &pos))
   {
     if (!rte_mergable(best0, rt0))
       continue;
@@ -710,6 +1058,43 @@ rt_notify_merged(struct announce_hook *ah, net *net, rte *new_changed, rte *old_
 }
 
 
+/*
+ *	Deferred exports
+ */
+
+struct rt_pending_export {
+  node n;				/* In rtable->pending_exports */
+  net *net;
+  rte *old;				/* Copy of the best route before the first change */
+};
+
+static void
+rt_export_defer(rtable *tab, net *net, rte *old)
+{
+  struct rt_pending_export *pe;
+
+  /* Later changes are coalesced with the first one */
+  if (net->n.x0 & NXF_EXPORT_PENDING)
+    return;
+
+  pe = sl_alloc(rt_export_slab);
+  pe->net = net;
+  pe->old = NULL;
+
+  /* The original route will be freed by the caller */
+  if (old)
+    {
+      pe->old = sl_alloc(rte_slab);
+      memcpy(pe->old, old, sizeof(rte));
+      pe->old->next = NULL;
+      pe->old->attrs = rta_clone(old->attrs);
+    }
+
+  net->n.x0 |= NXF_EXPORT_PENDING;
+  add_tail(&tab->pending_exports, &pe->n);
+  rt_schedule_export(tab);
+}
+
 /**
  * rte_announce - announce a routing table change
  * @tab: table the route has been added to
@@ -770,6 +1155,18 @@ rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old,
 
       if (tab->hostcache)
 	rt_notify_hostcache(tab, net);
+
+      if (tab->config->deferred || (net->n.x0 & NXF_EXPORT_PENDING))
+	{
+	  rt_export_defer(tab, net, old);
+	  return;
+	}
+    }
+
+  if ((type == RA_OPTIMAL) || (type == RA_ANY))
+    {
+      rt_notify_basic_all(tab, type, net, new, old);
+      return;
     }
 
   struct announce_hook *a;
@@ -779,10 +1176,8 @@ rte_announce(rtable *tab, unsigned type, net *net, rte *new, rte *old,
       if (a->proto->accept_ra_types == type)
 	if (type == RA_ACCEPTED)
 	  rt_notify_accepted(a, net, new, old, before_old, 0);
-	else if (type == RA_MERGED)
-	  rt_notify_merged(a, net, new, old, new_best, old_best, 0);
 	else
-	  rt_notify_basic(a, net, new, old, 0);
+	  rt_notify_merged(a, net, new, old, new_best, old_best, 0);
     }
 }
 
@@ -854,54 +1249,68 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
   rte *before_old = NULL;
   rte *old_best = net->routes;
   rte *old = NULL;
-  rte **k;
 
-  k = &net->routes;			/* Find and remove original route from the same protocol */
-  while (old = *k)
+  /* Find the original route from the same protocol */
+  if (net->array)
     {
-      if (old->attrs->src == src)
+      struct rte_array *a = net->array;
+      uint i;
+
+      for (i = 0; i < a->count; i++)
+	if (a->src[i] == src)
+	  {
+	    old = a->routes[i];
+	    before_old = i ? a->routes[i-1] : NULL;
+	    break;
+	  }
+    }
+  else
+    {
+      for (old = net->routes; old; before_old = old, old = old->next)
+	if (old->attrs->src == src)
+	  break;
+    }
+
+  if (old)
+    {
+      /* If there is the same route in the routing table but from
+       * a different sender, then there are two paths from the
+       * source protocol to this routing table through transparent
+       * pipes, which is not allowed.
+       *
+       * We log that and ignore the route. If it is withdraw, we
+       * ignore it completely (there might be 'spurious withdraws',
+       * see FIXME in do_rte_announce())
+       */
+      if (old->sender->proto != p)
 	{
-	  /* If there is the same route in the routing table but from
-	   * a different sender, then there are two paths from the
-	   * source protocol to this routing table through transparent
-	   * pipes, which is not allowed.
-	   *
-	   * We log that and ignore the route. If it is withdraw, we
-	   * ignore it completely (there might be 'spurious withdraws',
-	   * see FIXME in do_rte_announce())
-	   */
-	  if (old->sender->proto != p)
+	  if (new)
 	    {
-	      if (new)
-		{
-		  log_rl(&rl_pipe, L_ERR "Pipe collision detected when sending %I/%d to table %s",
-		      net->n.prefix, net->n.pxlen, table->name);
-		  rte_free_quick(new);
-		}
-	      return;
+	      log_rl(&rl_pipe, L_ERR "Pipe collision detected when sending %I/%d to table %s",
+		  net->n.prefix, net->n.pxlen, table->name);
+	      rte_free_quick(new);
 	    }
+	  return;
+	}
 
-	  if (new && rte_same(old, new))
-	    {
-	      /* No changes, ignore the new route */
-
-	      if (!rte_is_filtered(new))
-		{
-		  stats->imp_updates_ignored++;
-		  rte_trace_in(D_ROUTES, p, new, "ignored");
-		}
+      if (new && rte_same(old, new))
+	{
+	  /* No changes, ignore the new route */
 
-	      rte_free_quick(new);
-	      return;
+	  if (!rte_is_filtered(new))
+	    {
+	      stats->imp_updates_ignored++;
+	      rte_trace_in(D_ROUTES, p, new, "ignored");
 	    }
-	  *k = old->next;
-	  break;
+
+	  rte_free_quick(new);
+	  return;
 	}
-      k = &old->next;
-      before_old = old;
-    }
 
-  if (!old)
+      /* And remove it */
+      rte_unlink(net, old, before_old);
+    }
+  else
     before_old = NULL;
 
   if (!old && !new)
@@ -986,17 +1395,18 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
       /* If routes are sorted, just insert new route to appropriate position */
       if (new)
 	{
+	  rte *after, *e;
+
 	  if (before_old && !rte_better(new, before_old))
-	    k = &before_old->next;
+	    after = before_old;
 	  else
-	    k = &net->routes;
+	    after = NULL;
 
-	  for (; *k; k=&(*k)->next)
-	    if (rte_better(new, *k))
+	  for (e = after ? after->next : net->routes; e; after = e, e = e->next)
+	    if (rte_better(new, e))
 	      break;
 
-	  new->next = *k;
-	  *k = new;
+	  rte_link(table, net, new, after);
 	}
     }
   else
@@ -1012,8 +1422,7 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
 	  /* The first case - the new route is cleary optimal,
 	     we link it at the first position */
 
-	  new->next = net->routes;
-	  net->routes = new;
+	  rte_link(table, net, new, NULL);
 	}
       else if (old == old_best)
 	{
@@ -1026,25 +1435,10 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
 	do_recalculate:
 	  /* Add the new route to the list */
 	  if (new)
-	    {
-	      new->next = net->routes;
-	      net->routes = new;
-	    }
+	    rte_link(table, net, new, NULL);
 
-	  /* Find a new optimal route (if there is any) */
-	  if (net->routes)
-	    {
-	      rte **bp = &net->routes;
-	      for (k=&(*bp)->next; *k; k=&(*k)->next)
-		if (rte_better(*k, *bp))
-		  bp = k;
-
-	      /* And relink it */
-	      rte *best = *bp;
-	      *bp = best->next;
-	      best->next = net->routes;
-	      net->routes = best;
-	    }
+	  /* Find a new optimal route (if there is any) and relink it */
+	  rte_relink_best(net);
 	}
       else if (new)
 	{
@@ -1054,8 +1448,7 @@ rte_recalculate(struct announce_hook *ah, net *net, rte *new, struct rte_src *sr
 	     We just link the new route after the old best route. */
 
 	  ASSERT(net->routes != NULL);
-	  new->next = net->routes->next;
-	  net->routes->next = new;
+	  rte_link(table, net, new, net->routes);
 	}
       /* The fourth (empty) case - suboptimal route was removed, nothing to do */
     }
@@ -1122,18 +1515,15 @@ rte_hide_dummy_routes(net *net, rte **dummy)
   if (net->routes && net->routes->attrs->source == RTS_DUMMY)
   {
     *dummy = net->routes;
-    net->routes = (*dummy)->next;
+    rte_unlink(net, *dummy, NULL);
   }
 }
 
 static inline void
-rte_unhide_dummy_routes(net *net, rte **dummy)
+rte_unhide_dummy_routes(rtable *tab, net *net, rte **dummy)
 {
   if (*dummy)
-  {
-    (*dummy)->next = net->routes;
-    net->routes = *dummy;
-  }
+    rte_link(tab, net, *dummy, NULL);
 }
 
 /**
@@ -1251,7 +1641,7 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
  recalc:
   rte_hide_dummy_routes(net, &dummy);
   rte_recalculate(ah, net, new, src);
-  rte_unhide_dummy_routes(net, &dummy);
+  rte_unhide_dummy_routes(ah->table, net, &dummy);
   rte_update_unlock();
   return;
 
@@ -1261,6 +1651,128 @@ rte_update2(struct announce_hook *ah, net *net, rte *new, struct rte_src *src)
   goto recalc;
 }
 
+/**
+ * rte_update_batch - enter many updates sharing attributes to a routing table
+ * @ah: pointer to table announce hook
+ * @nets: networks to be updated
+ * @count: number of networks
+ * @new: a temporary &rte used as a template for all the networks, or %NULL
+ * for removal
+ * @src: protocol originating the updates
+ *
+ * This function has the same effect as calling rte_update2() for each of
+ * @nets with a copy of @new (whose @net field is ignored), in the given
+ * order. But when the import filter does not depend on the network (see
+ * filter_net_independent()), it is run only once, the resulting attributes
+ * are looked up in the attribute cache only once and the routes for all
+ * the networks share them. All the updates are processed under a single
+ * update lock, so the temporary memory is flushed only once. Networks may
+ * be %NULL for removals, which are then ignored. @new is always consumed.
+ */
+void
+rte_update_batch(struct announce_hook *ah, net **nets, uint count, rte *new, struct rte_src *src)
+{
+  struct proto *p = ah->proto;
+  struct proto_stats *stats = ah->stats;
+  struct filter *filter = ah->in_filter;
+  ea_list *tmpa = NULL;
+  int filtered = 0;
+  uint i;
+
+  rte_update_lock();
+
+  if (!new || (count < 2) || !filter_net_independent(filter))
+    {
+      /* Filters may modify uncached attributes in place, so the copies cannot share them */
+      if (new && !rta_is_cached(new->attrs))
+	new->attrs = rta_lookup(new->attrs);
+
+      /* Nothing else to share, just do the updates one by one */
+      for (i = 0; i < count; i++)
+	{
+	  rte *e = NULL;
+
+	  if (new)
+	    {
+	      e = sl_alloc(rte_slab);
+	      memcpy(e, new, sizeof(rte));
+	      e->attrs = rta_clone(new->attrs);
+	      e->net = nets[i];
+	    }
+
+	  rte_update2(ah, nets[i], e, src);
+	}
+
+      if (new)
+	rte_free(new);
+      rte_update_unlock();
+      return;
+    }
+
+  /* Run the import filter on the template */
+  new->sender = ah;
+  new->net = nets[0];
+
+  if (filter == FILTER_REJECT)
+    filtered = 1;
+  else
+    {
+      tmpa = make_tmp_attrs(new, rte_update_pool);
+      if (filter)
+	{
+	  ea_list *old_tmpa = tmpa;
+	  filtered = f_run(filter, &new, &tmpa, rte_update_pool, 0) > F_ACCEPT;
+	  if (tmpa != old_tmpa && src->proto->store_tmp_attrs)
+	    src->proto->store_tmp_attrs(new, tmpa);
+	}
+    }
+
+  if (filtered && ah->in_keep_filtered)
+    new->flags |= REF_FILTERED;
+
+  if (!rta_is_cached(new->attrs))
+    new->attrs = rta_lookup(new->attrs);
+  new->flags |= REF_COW;
+
+  for (i = 0; i < count; i++)
+    {
+      net *n = nets[i];
+      rte *e = sl_alloc(rte_slab);
+      rte *dummy = NULL;
+
+      memcpy(e, new, sizeof(rte));
+      e->attrs = rta_clone(new->attrs);
+      e->net = n;
+
+      stats->imp_updates_received++;
+      if (!rte_validate(e))
+	{
+	  rte_trace_in(D_FILTERS, p, e, "invalid");
+	  stats->imp_updates_invalid++;
+	  rte_free(e);
+	  e = NULL;
+	}
+      else if (filtered)
+	{
+	  stats->imp_updates_filtered++;
+	  rte_trace_in(D_FILTERS, p, e, "filtered out");
+
+	  if (! ah->in_keep_filtered)
+	    {
+	      rte_free(e);
+	      e = NULL;
+	    }
+	}
+
+      rte_hide_dummy_routes(n, &dummy);
+      rte_recalculate(ah, n, e, src);
+      rte_unhide_dummy_routes(ah->table, n, &dummy);
+    }
+
+  rte_free(new);
+  rte_update_unlock();
+}
+
 /* Independent call to rte_announce(), used from next hop
    recalculation, outside of rte_update(). new must be non-NULL */
 static inline void 
@@ -1469,6 +1981,75 @@ rt_schedule_nhu(rtable *tab)
 }
 
 
+static void
+rt_export_timer(timer *t)
+{
+  rtable *tab = t->data;
+
+  tab->export_scheduled = 1;
+  ev_schedule(tab->rt_event);
+}
+
+static void
+rt_schedule_export(rtable *tab)
+{
+  if (tab->export_scheduled || tm_active(tab->export_timer))
+    return;
+
+  if (tab->config->export_delay)
+    tm_start(tab->export_timer, tab->config->export_delay);
+  else
+    {
+      tab->export_scheduled = 1;
+      ev_schedule(tab->rt_event);
+    }
+}
+
+static int
+rt_export_pending(rtable *tab, uint max)
+{
+  struct rt_pending_export *pe;
+
+  rte_update_lock();
+  while (max-- && !EMPTY_LIST(tab->pending_exports))
+    {
+      pe = HEAD(tab->pending_exports);
+      rem_node(&pe->n);
+
+      net *n = pe->net;
+      rte *new = rte_is_valid(n->routes) ? n->routes : NULL;
+      rte *old = pe->old;
+      n->n.x0 &= ~NXF_EXPORT_PENDING;
+
+      /* Changes which returned the network to its original state are dropped */
+      if ((new || old) && !(new && old && rte_same(new, old)))
+	rt_notify_basic_all(tab, RA_OPTIMAL, n, new, old);
+
+      if (old)
+	rte_free(old);
+      sl_free(rt_export_slab, pe);
+    }
+  rte_update_unlock();
+
+  return EMPTY_LIST(tab->pending_exports);
+}
+
+static void
+rt_free_pending_exports(rtable *tab)
+{
+  struct rt_pending_export *pe;
+  node *nxt;
+
+  WALK_LIST_DELSAFE(pe, nxt, tab->pending_exports)
+    {
+      pe->net->n.x0 &= ~NXF_EXPORT_PENDING;
+      if (pe->old)
+	rte_free(pe->old);
+      sl_free(rt_export_slab, pe);
+    }
+  init_list(&tab->pending_exports);
+}
+
 static void
 rt_prune_nets(rtable *tab)
 {
@@ -1485,7 +2066,7 @@ again:
     {
       net *n = (net *) f;
       ncnt++;
-      if (!n->routes)		/* Orphaned FIB entry */
+      if (!n->routes && !(n->n.x0 & NXF_EXPORT_PENDING))	/* Orphaned FIB entry */
 	{
 	  FIB_ITERATE_PUT(&fit, f);
 	  fib_delete(&tab->fib, f);
@@ -1512,6 +2093,14 @@ rt_event(void *ptr)
   if (tab->nhu_state)
     rt_next_hop_update(tab);
 
+  if (tab->export_scheduled)
+    {
+      if (rt_export_pending(tab, 512))
+	tab->export_scheduled = 0;
+      else
+	ev_schedule(tab->rt_event);
+    }
+
   if (tab->prune_state)
     if (!rt_prune_table(tab))
       {
@@ -1535,11 +2124,15 @@ rt_setup(pool *p, rtable *t, char *name, struct rtable_config *cf)
   t->name = name;
   t->config = cf;
   init_list(&t->hooks);
+  init_list(&t->pending_exports);
   if (cf)
     {
+      if (cf->trie)
+	fib_init_trie(&t->fib);
       t->rt_event = ev_new(p);
       t->rt_event->hook = rt_event;
       t->rt_event->data = t;
+      t->export_timer = tm_new_set(p, rt_export_timer, t, 0, 0);
       t->gc_time = now;
     }
 }
@@ -1556,7 +2149,12 @@ rt_init(void)
   rta_init();
   rt_table_pool = rp_new(&root_pool, "Routing tables");
   rte_update_pool = lp_new(rt_table_pool, 4080);
+  lp_set_name(rte_update_pool, "Route updates");
   rte_slab = sl_new(rt_table_pool, sizeof(rte));
+  sl_set_name(rte_slab, "Routes");
+  rte_array_pool = rp_new(rt_table_pool, "Route arrays");
+  rt_export_slab = sl_new(rt_table_pool, sizeof(struct rt_pending_export));
+  sl_set_name(rt_export_slab, "Deferred exports");
   init_list(&routing_tables);
 }
 
@@ -1601,7 +2199,7 @@ again:
 
 	    goto rescan;
 	  }
-      if (!n->routes)		/* Orphaned FIB entry */
+      if (!n->routes && !(n->n.x0 & NXF_EXPORT_PENDING))	/* Orphaned FIB entry */
 	{
 	  FIB_ITERATE_PUT(fit, fn);
 	  fib_delete(&tab->fib, fn);
@@ -1614,6 +2212,9 @@ again:
   fib_check(&tab->fib);
 #endif
 
+  /* Deferred exports may keep routes of flushed protocols */
+  rt_export_pending(tab, ~0U);
+
   tab->prune_state = RPS_NONE;
   return 1;
 }
@@ -1719,19 +2320,22 @@ rt_next_hop_update_rte(rtable *tab, rte *old)
 static inline int
 rt_next_hop_update_net(rtable *tab, net *n)
 {
-  rte **k, *e, *new, *old_best, **new_best;
+  rte **k, *e, *new, *old_best;
   int count = 0;
   int free_old_best = 0;
+  uint pos = 0;
 
   old_best = n->routes;
   if (!old_best)
     return 0;
 
-  for (k = &n->routes; e = *k; k = &e->next)
+  for (k = &n->routes; e = *k; k = &e->next, pos++)
     if (rta_next_hop_outdated(e->attrs))
       {
 	new = rt_next_hop_update_rte(tab, e);
 	*k = new;
+	if (n->array)
+	  n->array->routes[pos] = new;
 
 	rte_announce_i(tab, RA_ANY, n, new, e, NULL, NULL);
 	rte_trace_in(D_ROUTES, new->sender->proto, new, "updated");
@@ -1753,22 +2357,9 @@ rt_next_hop_update_net(rtable *tab, net *n)
   if (!count)
     return 0;
 
-  /* Find the new best route */
-  new_best = NULL;
-  for (k = &n->routes; e = *k; k = &e->next)
-    {
-      if (!new_best || rte_better(e, *new_best))
-	new_best = k;
-    }
-
-  /* Relink the new best route to the first position */
-  new = *new_best;
-  if (new != n->routes)
-    {
-      *new_best = new->next;
-      new->next = n->routes;
-      n->routes = new;
-    }
+  /* Find the new best route and relink it to the first position */
+  rte_relink_best(n);
+  new = n->routes;
 
   /* Announce the new best route */
   if (new != old_best)
@@ -1870,9 +2461,11 @@ rt_unlock_table(rtable *r)
       r->config->table = NULL;
       if (r->hostcache)
 	rt_free_hostcache(r);
+      rt_free_pending_exports(r);
       rem_node(&r->n);
       fib_free(&r->fib);
       rfree(r->rt_event);
+      rfree(r->export_timer);
       mb_free(r);
       config_del_obstacle(conf);
     }
@@ -1896,6 +2489,8 @@ rt_commit(struct config *new, struct config *old)
   struct rtable_config *o, *r;
 
   DBG("rt_commit:\n");
+  workers_set(new->export_threads);
+
   if (old)
     {
       WALK_LIST(o, old->tables)
@@ -1913,6 +2508,10 @@ rt_commit(struct config *new, struct config *old)
 		  ot->config = r;
 		  if (o->sorted != r->sorted)
 		    log(L_WARN "Reconfiguration of rtable sorted flag not implemented");
+		  if (r->trie)
+		    fib_init_trie(&ot->fib);
+		  else if (o->trie)
+		    log(L_WARN "Reconfiguration of rtable trie flag not implemented");
 		}
 	      else
 		{
@@ -1951,6 +2550,52 @@ do_feed_baby(struct proto *p, int type, struct announce_hook *h, net *n, rte *e)
   rte_update_unlock();
 }
 
+static int
+rt_feed_net(struct proto *p, struct announce_hook *h, net *n, int *max_feed)
+{
+  rte *e = n->routes;
+
+  /* XXXX perhaps we should change feed for RA_ACCEPTED to not use 'new' */
+
+  if ((p->accept_ra_types == RA_OPTIMAL) ||
+      (p->accept_ra_types == RA_ACCEPTED) ||
+      (p->accept_ra_types == RA_MERGED))
+    if (rte_is_valid(e))
+      {
+	if (p->export_state != ES_FEEDING)
+	  return 1;  /* In the meantime, the protocol fell down. */
+
+	do_feed_baby(p, p->accept_ra_types, h, n, e);
+	(*max_feed)--;
+      }
+
+  if (p->accept_ra_types == RA_ANY)
+    for(e = n->routes; e; e = e->next)
+      {
+	if (p->export_state != ES_FEEDING)
+	  return 1;  /* In the meantime, the protocol fell down. */
+
+	if (!rte_is_valid(e))
+	  continue;
+
+	do_feed_baby(p, RA_ANY, h, n, e);
+	(*max_feed)--;
+      }
+
+  return 0;
+}
+
+static void
+rt_feed_free_iterator(struct proto *p)
+{
+  if (p->feed_iterator)
+    mb_free(p->feed_iterator);
+  if (p->feed_ordered)
+    mb_free(p->feed_ordered);
+  p->feed_iterator = NULL;
+  p->feed_ordered = NULL;
+}
+
 /**
  * rt_feed_baby - advertise routes to a new protocol
  * @p: protocol to be fed
@@ -1958,13 +2603,13 @@ do_feed_baby(struct proto *p, int type, struct announce_hook *h, net *n, rte *e)
  * This function performs one pass of advertisement of routes to a newly
  * initialized protocol. It's called by the protocol code as long as it
  * has something to do. (We avoid transferring all the routes in single
- * pass in order not to monopolize CPU time.)
+ * pass in order not to monopolize CPU time.) Tables with prefix trie
+ * are fed in prefix order.
  */
 int
 rt_feed_baby(struct proto *p)
 {
   struct announce_hook *h;
-  struct fib_iterator *fit;
   int max_feed = 256;
 
   if (!p->feed_ahook)			/* Need to initialize first */
@@ -1973,62 +2618,58 @@ rt_feed_baby(struct proto *p)
 	return 1;
       DBG("Announcing routes to new protocol %s\n", p->name);
       p->feed_ahook = p->ahooks;
-      fit = p->feed_iterator = mb_alloc(p->pool, sizeof(struct fib_iterator));
       goto next_hook;
     }
-  fit = p->feed_iterator;
 
 again:
   h = p->feed_ahook;
-  FIB_ITERATE_START(&h->table->fib, fit, fn)
+  if (p->feed_ordered)
     {
-      net *n = (net *) fn;
-      rte *e = n->routes;
-      if (max_feed <= 0)
+      FIB_ORDERED_START(&h->table->fib, p->feed_ordered, fn)
 	{
-	  FIB_ITERATE_PUT(fit, fn);
-	  return 0;
-	}
-
-      /* XXXX perhaps we should change feed for RA_ACCEPTED to not use 'new' */
-
-      if ((p->accept_ra_types == RA_OPTIMAL) ||
-	  (p->accept_ra_types == RA_ACCEPTED) ||
-	  (p->accept_ra_types == RA_MERGED))
-	if (rte_is_valid(e))
-	  {
-	    if (p->export_state != ES_FEEDING)
-	      return 1;  /* In the meantime, the protocol fell down. */
-
-	    do_feed_baby(p, p->accept_ra_types, h, n, e);
-	    max_feed--;
-	  }
-
-      if (p->accept_ra_types == RA_ANY)
-	for(e = n->routes; e; e = e->next)
-	  {
-	    if (p->export_state != ES_FEEDING)
-	      return 1;  /* In the meantime, the protocol fell down. */
+	  if (max_feed <= 0)
+	    {
+	      FIB_ORDERED_PUT(p->feed_ordered, fn);
+	      return 0;
+	    }
 
-	    if (!rte_is_valid(e))
-	      continue;
+	  if (rt_feed_net(p, h, (net *) fn, &max_feed))
+	    return 1;
+	}
+      FIB_ORDERED_END;
+    }
+  else
+    {
+      FIB_ITERATE_START(&h->table->fib, p->feed_iterator, fn)
+	{
+	  if (max_feed <= 0)
+	    {
+	      FIB_ITERATE_PUT(p->feed_iterator, fn);
+	      return 0;
+	    }
 
-	    do_feed_baby(p, RA_ANY, h, n, e);
-	    max_feed--;
-	  }
+	  if (rt_feed_net(p, h, (net *) fn, &max_feed))
+	    return 1;
+	}
+      FIB_ITERATE_END(fn);
     }
-  FIB_ITERATE_END(fn);
+  rt_feed_free_iterator(p);
   p->feed_ahook = h->next;
   if (!p->feed_ahook)
-    {
-      mb_free(p->feed_iterator);
-      p->feed_iterator = NULL;
-      return 1;
-    }
+    return 1;
 
 next_hook:
   h = p->feed_ahook;
-  FIB_ITERATE_INIT(fit, &h->table->fib);
+  if (h->table->fib.trie_slab)
+    {
+      p->feed_ordered = mb_alloc(p->pool, sizeof(struct fib_ordered_iterator));
+      FIB_ORDERED_INIT(p->feed_ordered, &h->table->fib, IPA_NONE, 0);
+    }
+  else
+    {
+      p->feed_iterator = mb_alloc(p->pool, sizeof(struct fib_iterator));
+      FIB_ITERATE_INIT(p->feed_iterator, &h->table->fib);
+    }
   goto again;
 }
 
@@ -2046,7 +2687,9 @@ rt_feed_baby_abort(struct proto *p)
   if (p->feed_ahook)
     {
       /* Unlink the iterator and exit */
-      fit_get(&p->feed_ahook->table->fib, p->feed_iterator);
+      if (p->feed_iterator)
+	fit_get(&p->feed_ahook->table->fib, p->feed_iterator);
+      rt_feed_free_iterator(p);
       p->feed_ahook = NULL;
     }
 }
@@ -2166,8 +2809,10 @@ rt_init_hostcache(rtable *tab)
   hc->hash_items = 0;
   hc_alloc_table(hc, HC_DEF_ORDER);
   hc->slab = sl_new(rt_table_pool, sizeof(struct hostentry));
+  sl_set_name(hc->slab, "Hostentries");
 
   hc->lp = lp_new(rt_table_pool, 1008);
+  lp_set_name(hc->lp, "Hostentries");
   hc->trie = f_new_trie(hc->lp, sizeof(struct f_trie_node));
 
   tab->hostcache = hc;
@@ -2522,6 +3167,22 @@ rt_show_net(struct cli *c, net *n, struct rt_show_data *d)
     }
 }
 
+static int
+rt_show_stopped(struct cli *c, struct rt_show_data *d)
+{
+  if (d->running_on_config && d->running_on_config != config)
+    {
+      cli_printf(c, 8004, "Stopped due to reconfiguration");
+      return 1;
+    }
+  if (d->export_protocol && (d->export_protocol->export_state == ES_DOWN))
+    {
+      cli_printf(c, 8005, "Protocol is down");
+      return 1;
+    }
+  return 0;
+}
+
 static void
 rt_show_cont(struct cli *c)
 {
@@ -2533,28 +3194,39 @@ rt_show_cont(struct cli *c)
 #endif
   struct fib *fib = &d->table->fib;
   struct fib_iterator *it = &d->fit;
+  struct fib_ordered_iterator *ot = &d->fot;
 
-  FIB_ITERATE_START(fib, it, f)
+  if (d->ordered)
     {
-      net *n = (net *) f;
-      if (d->running_on_config && d->running_on_config != config)
-	{
-	  cli_printf(c, 8004, "Stopped due to reconfiguration");
-	  goto done;
-	}
-      if (d->export_protocol && (d->export_protocol->export_state == ES_DOWN))
+      FIB_ORDERED_START(fib, ot, f)
 	{
-	  cli_printf(c, 8005, "Protocol is down");
-	  goto done;
+	  if (rt_show_stopped(c, d))
+	    goto done;
+	  if (!max--)
+	    {
+	      FIB_ORDERED_PUT(ot, f);
+	      return;
+	    }
+	  rt_show_net(c, (net *) f, d);
 	}
-      if (!max--)
+      FIB_ORDERED_END;
+    }
+  else
+    {
+      FIB_ITERATE_START(fib, it, f)
 	{
-	  FIB_ITERATE_PUT(it, f);
-	  return;
+	  if (rt_show_stopped(c, d))
+	    goto done;
+	  if (!max--)
+	    {
+	      FIB_ITERATE_PUT(it, f);
+	      return;
+	    }
+	  if (!d->show_in || net_in_net(f->prefix, f->pxlen, d->prefix, d->pxlen))
+	    rt_show_net(c, (net *) f, d);
 	}
-      rt_show_net(c, n, d);
+      FIB_ITERATE_END(f);
     }
-  FIB_ITERATE_END(f);
   if (d->stats)
     cli_printf(c, 14, "%d of %d routes for %d networks", d->show_counter, d->rt_counter, d->net_counter);
   else
@@ -2569,7 +3241,8 @@ rt_show_cleanup(struct cli *c)
   struct rt_show_data *d = c->rover;
 
   /* Unlink the iterator */
-  fit_get(&d->table->fib, &d->fit);
+  if (!d->ordered)
+    fit_get(&d->table->fib, &d->fit);
 }
 
 void
@@ -2586,9 +3259,16 @@ rt_show(struct rt_show_data *d)
   if (d->filtered && (d->export_mode || d->primary_only))
     cli_msg(0, "");
 
-  if (d->pxlen == 256)
+  if ((d->pxlen == 256) || d->show_in)
     {
-      FIB_ITERATE_INIT(&d->fit, &d->table->fib);
+      /* Tables with prefix trie are shown in prefix order */
+      d->ordered = !!d->table->fib.trie_slab;
+      if (d->ordered && d->show_in)
+	FIB_ORDERED_INIT(&d->fot, &d->table->fib, d->prefix, d->pxlen);
+      else if (d->ordered)
+	FIB_ORDERED_INIT(&d->fot, &d->table->fib, IPA_NONE, 0);
+      else
+	FIB_ITERATE_INIT(&d->fit, &d->table->fib);
       this_cli->cont = rt_show_cont;
       this_cli->cleanup = rt_show_cleanup;
       this_cli->rover = d;
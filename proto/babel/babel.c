@@ -2012,7 +2012,9 @@ babel_start(struct proto *P)
   p->router_id = proto_get_router_id(&cf->c);
 
   p->route_slab = sl_new(P->pool, sizeof(struct babel_route));
+  sl_set_name(p->route_slab, "Babel routes");
   p->source_slab = sl_new(P->pool, sizeof(struct babel_source));
+  sl_set_name(p->source_slab, "Babel sources");
   p->msg_slab = sl_new(P->pool, sizeof(struct babel_msg_node));
   p->seqno_slab = sl_new(P->pool, sizeof(struct babel_seqno_request));
   init_list(&p->seqno_cache);
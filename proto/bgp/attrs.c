@@ -461,20 +461,8 @@ bgp_get_attr_len(eattr *a)
 
 #define ADVANCE(w, r, l) do { r -= l; w += l; } while (0)
 
-/**
- * bgp_encode_attrs - encode BGP attributes
- * @p: BGP instance
- * @w: buffer
- * @attrs: a list of extended attributes
- * @remains: remaining space in the buffer
- *
- * The bgp_encode_attrs() function takes a list of extended attributes
- * and converts it to its BGP representation (a part of an Update message).
- *
- * Result: Length of the attribute block generated or -1 if not enough space.
- */
-uint
-bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
+static uint
+bgp_encode_attr_list(byte *w, ea_list *attrs, int remains, int as4)
 {
   uint i, code, type, flags;
   byte *start = w;
@@ -496,7 +484,7 @@ bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
        * we have to convert our 4B AS_PATH to 2B AS_PATH and send our AS_PATH 
        * as optional AS4_PATH attribute.
        */
-      if ((code == BA_AS_PATH) && (! p->as4_session))
+      if ((code == BA_AS_PATH) && !as4)
 	{
 	  len = a->u.ptr->length;
 
@@ -538,7 +526,7 @@ bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
 	}
 
       /* The same issue with AGGREGATOR attribute */
-      if ((code == BA_AGGREGATOR) && (! p->as4_session))
+      if ((code == BA_AGGREGATOR) && !as4)
 	{
 	  int new_used;
 
@@ -622,6 +610,86 @@ bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
   return -1;
 }
 
+/**
+ * bgp_encode_attrs - encode BGP attributes
+ * @p: BGP instance
+ * @w: buffer
+ * @attrs: a list of extended attributes
+ * @remains: remaining space in the buffer
+ *
+ * The bgp_encode_attrs() function takes a list of extended attributes
+ * and converts it to its BGP representation (a part of an Update message).
+ *
+ * Result: Length of the attribute block generated or -1 if not enough space.
+ */
+uint
+bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains)
+{
+  return bgp_encode_attr_list(w, attrs, remains, p->as4_session);
+}
+
+/**
+ * bgp_encode_mrt_attrs - encode BGP attributes for MRT dumps
+ * @w: buffer
+ * @attrs: extended attributes of a route
+ * @remains: remaining space in the buffer
+ *
+ * This function encodes BGP attributes of a route as they are stored in RIB
+ * entries of MRT TABLE_DUMP_V2 format [RFC6396]. Attributes of other
+ * protocols in @attrs are skipped, AS numbers are always 4 bytes long and
+ * the IPv6 next hop is stored in MP_REACH_NLRI attribute without NLRI.
+ *
+ * Result: Length of the attribute block generated or -1 if not enough space.
+ */
+int
+bgp_encode_mrt_attrs(byte *w, ea_list *attrs, int remains)
+{
+  ea_list *a;
+  uint i, n = 0;
+  int len;
+
+  if (!attrs)
+    return 0;
+
+  a = alloca(ea_scan(attrs));
+  ea_merge(attrs, a);
+  ea_sort(a);
+
+  for (i = 0; i < a->count; i++)
+    if (EA_PROTO(a->attrs[i].id) == EAP_BGP)
+      a->attrs[n++] = a->attrs[i];
+  a->count = n;
+
+  len = bgp_encode_attr_list(w, a, remains, 1);
+  if (len < 0)
+    return -1;
+
+#ifdef IPV6
+  eattr *nh = ea_find(a, EA_CODE(EAP_BGP, BA_NEXT_HOP));
+  if (nh)
+    {
+      ip_addr *ips = (ip_addr *) nh->u.ptr->data;
+      uint nl = nh->u.ptr->length;
+      byte *z = w + len;
+
+      /* Link-local address is not known */
+      if ((nl == 2 * sizeof(ip_addr)) && ipa_zero(ips[1]))
+	nl = sizeof(ip_addr);
+
+      if (remains - len < (int) nl + 4)
+	return -1;
+
+      z += bgp_encode_attr_hdr(z, BAF_OPTIONAL, BA_MP_REACH_NLRI, nl + 1);
+      *z++ = nl;
+      for (i = 0; i < nl / sizeof(ip_addr); i++)
+	z = put_ipa(z, ips[i]);
+      len = z - w;
+    }
+#endif
+
+  return len;
+}
+
 /*
 static void
 bgp_init_prefix(struct fib_node *N)
@@ -682,21 +750,21 @@ bgp_normalize_ec_set(struct adata *ad, u32 *src, int internal)
 }
 
 static void
-bgp_rehash_buckets(struct bgp_proto *p)
+bgp_rehash_buckets(struct bgp_pending_tx *ptx)
 {
-  struct bgp_bucket **old = p->bucket_hash;
+  struct bgp_bucket **old = ptx->bucket_hash;
   struct bgp_bucket **new;
-  unsigned oldn = p->hash_size;
+  unsigned oldn = ptx->hash_size;
   unsigned i, e, mask;
   struct bgp_bucket *b;
 
-  p->hash_size = p->hash_limit;
-  DBG("BGP: Rehashing bucket table from %d to %d\n", oldn, p->hash_size);
-  p->hash_limit *= 4;
-  if (p->hash_limit >= 65536)
-    p->hash_limit = ~0;
-  new = p->bucket_hash = mb_allocz(p->p.pool, p->hash_size * sizeof(struct bgp_bucket *));
-  mask = p->hash_size - 1;
+  ptx->hash_size = ptx->hash_limit;
+  DBG("BGP: Rehashing bucket table from %d to %d\n", oldn, ptx->hash_size);
+  ptx->hash_limit *= 4;
+  if (ptx->hash_limit >= 65536)
+    ptx->hash_limit = ~0;
+  new = ptx->bucket_hash = mb_allocz(ptx->pool, ptx->hash_size * sizeof(struct bgp_bucket *));
+  mask = ptx->hash_size - 1;
   for (i=0; i<oldn; i++)
     while (b = old[i])
       {
@@ -712,7 +780,7 @@ bgp_rehash_buckets(struct bgp_proto *p)
 }
 
 static struct bgp_bucket *
-bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
+bgp_new_bucket(struct bgp_pending_tx *ptx, ea_list *new, unsigned hash)
 {
   struct bgp_bucket *b;
   unsigned ea_size = sizeof(ea_list) + new->count * sizeof(eattr);
@@ -720,7 +788,7 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
   unsigned size = sizeof(struct bgp_bucket) + ea_size_aligned;
   unsigned i;
   byte *dest;
-  unsigned index = hash & (p->hash_size - 1);
+  unsigned index = hash & (ptx->hash_size - 1);
 
   /* Gather total size of non-inline attributes */
   for (i=0; i<new->count; i++)
@@ -731,14 +799,14 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
     }
 
   /* Create the bucket and hash it */
-  b = mb_alloc(p->p.pool, size);
-  b->hash_next = p->bucket_hash[index];
+  b = mb_alloc(ptx->pool, size);
+  b->hash_next = ptx->bucket_hash[index];
   if (b->hash_next)
     b->hash_next->hash_prev = b;
-  p->bucket_hash[index] = b;
+  ptx->bucket_hash[index] = b;
   b->hash_prev = NULL;
   b->hash = hash;
-  add_tail(&p->bucket_queue, &b->send_node);
+  add_tail(&ptx->bucket_queue, &b->send_node);
   init_list(&b->prefixes);
   memcpy(b->eattrs, new, ea_size);
   dest = ((byte *)b->eattrs) + ea_size_aligned;
@@ -758,9 +826,9 @@ bgp_new_bucket(struct bgp_proto *p, ea_list *new, unsigned hash)
     }
 
   /* If needed, rehash */
-  p->hash_count++;
-  if (p->hash_count > p->hash_limit)
-    bgp_rehash_buckets(p);
+  ptx->hash_count++;
+  if (ptx->hash_count > ptx->hash_limit)
+    bgp_rehash_buckets(ptx);
 
   return b;
 }
@@ -833,7 +901,7 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 
   /* Hash */
   hash = ea_hash(new);
-  for(b=p->bucket_hash[hash & (p->hash_size - 1)]; b; b=b->hash_next)
+  for(b=p->ptx->bucket_hash[hash & (p->ptx->hash_size - 1)]; b; b=b->hash_next)
     if (b->hash == hash && ea_same(b->eattrs, new))
       {
 	DBG("Found bucket.\n");
@@ -848,9 +916,9 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 	return NULL;
       }
 
-  /* Check if next hop is valid */
+  /* Check if next hop is valid, the neighbor is not checked in shared groups */
   a = ea_find(new, EA_CODE(EAP_BGP, BA_NEXT_HOP));
-  if (!a || ipa_equal(p->cf->remote_ip, *(ip_addr *)a->u.ptr->data))
+  if (!a || (!bgp_group_shared(p) && ipa_equal(p->cf->remote_ip, *(ip_addr *)a->u.ptr->data)))
     {
       log(L_ERR "%s: Invalid NEXT_HOP attribute in route %I/%d", p->p.name, n->n.prefix, n->n.pxlen);
       return NULL;
@@ -858,18 +926,32 @@ bgp_get_bucket(struct bgp_proto *p, net *n, ea_list *attrs, int originate)
 
   /* Create new bucket */
   DBG("Creating bucket.\n");
-  return bgp_new_bucket(p, new, hash);
+  return bgp_new_bucket(p->ptx, new, hash);
+}
+
+static struct bgp_bucket *
+bgp_get_withdraw_bucket(struct bgp_pending_tx *ptx)
+{
+  struct bgp_bucket *buck = ptx->withdraw_bucket;
+
+  if (!buck)
+    {
+      buck = ptx->withdraw_bucket = mb_alloc(ptx->pool, sizeof(struct bgp_bucket));
+      init_list(&buck->prefixes);
+    }
+
+  return buck;
 }
 
 void
-bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck)
+bgp_free_bucket(struct bgp_pending_tx *ptx, struct bgp_bucket *buck)
 {
   if (buck->hash_next)
     buck->hash_next->hash_prev = buck->hash_prev;
   if (buck->hash_prev)
     buck->hash_prev->hash_next = buck->hash_next;
   else
-    p->bucket_hash[buck->hash & (p->hash_size-1)] = buck->hash_next;
+    ptx->bucket_hash[buck->hash & (ptx->hash_size-1)] = buck->hash_next;
   mb_free(buck);
 }
 
@@ -887,38 +969,94 @@ bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck)
 
 HASH_DEFINE_REHASH_FN(PXH, struct bgp_prefix)
 
-void
-bgp_init_prefix_table(struct bgp_proto *p, u32 order)
-{
-  HASH_INIT(p->prefix_hash, p->p.pool, order);
-
-  p->prefix_slab = sl_new(p->p.pool, sizeof(struct bgp_prefix));
-}
-
 static struct bgp_prefix *
-bgp_get_prefix(struct bgp_proto *p, ip_addr prefix, int pxlen, u32 path_id)
+bgp_get_prefix(struct bgp_pending_tx *ptx, ip_addr prefix, int pxlen, u32 path_id)
 {
-  struct bgp_prefix *bp = HASH_FIND(p->prefix_hash, PXH, prefix, pxlen, path_id);
+  struct bgp_prefix *bp = HASH_FIND(ptx->prefix_hash, PXH, prefix, pxlen, path_id);
 
   if (bp)
     return bp;
 
-  bp = sl_alloc(p->prefix_slab);
+  bp = sl_alloc(ptx->prefix_slab);
   bp->n.prefix = prefix;
   bp->n.pxlen = pxlen;
   bp->path_id = path_id;
   bp->bucket_node.next = NULL;
 
-  HASH_INSERT2(p->prefix_hash, PXH, p->p.pool, bp);
+  HASH_INSERT2(ptx->prefix_hash, PXH, ptx->pool, bp);
 
   return bp;
 }
 
 void
-bgp_free_prefix(struct bgp_proto *p, struct bgp_prefix *bp)
+bgp_free_prefix(struct bgp_pending_tx *ptx, struct bgp_prefix *bp)
 {
-  HASH_REMOVE2(p->prefix_hash, PXH, p->p.pool, bp);
-  sl_free(p->prefix_slab, bp);
+  HASH_REMOVE2(ptx->prefix_hash, PXH, ptx->pool, bp);
+  sl_free(ptx->prefix_slab, bp);
+}
+
+/**
+ * bgp_new_pending_tx - create a set of prefixes to be sent
+ * @pp: parent pool
+ *
+ * The buckets with attributes and the prefixes waiting in them form the
+ * routes to be sent to the neighbor. They are kept in their own pool, so the
+ * whole set may be shared by an update group and outlive its members.
+ */
+struct bgp_pending_tx *
+bgp_new_pending_tx(pool *pp)
+{
+  pool *pool = rp_new(pp, "BGP buckets");
+  struct bgp_pending_tx *ptx = mb_allocz(pool, sizeof(struct bgp_pending_tx));
+
+  ptx->pool = pool;
+  ptx->hash_size = 256;
+  ptx->hash_limit = ptx->hash_size * 4;
+  ptx->bucket_hash = mb_allocz(pool, ptx->hash_size * sizeof(struct bgp_bucket *));
+  init_list(&ptx->bucket_queue);
+  ptx->withdraw_bucket = NULL;
+
+  HASH_INIT(ptx->prefix_hash, pool, 8);
+  ptx->prefix_slab = sl_new(pool, sizeof(struct bgp_prefix));
+  sl_set_name(ptx->prefix_slab, "BGP prefixes");
+
+  return ptx;
+}
+
+static void
+bgp_copy_prefixes(struct bgp_pending_tx *dst, struct bgp_bucket *to, struct bgp_bucket *from)
+{
+  struct bgp_prefix *px, *npx;
+  node *n;
+
+  WALK_LIST(n, from->prefixes)
+    {
+      px = SKIP_BACK(struct bgp_prefix, bucket_node, n);
+      npx = bgp_get_prefix(dst, px->n.prefix, px->n.pxlen, px->path_id);
+      add_tail(&to->prefixes, &npx->bucket_node);
+    }
+}
+
+/**
+ * bgp_copy_pending_tx - copy prefixes to be sent
+ * @dst: empty set of prefixes
+ * @src: set of prefixes to copy
+ *
+ * This function copies all buckets with waiting prefixes, keeping the order
+ * in which they will be sent. It is used when a member leaves its update
+ * group and continues on its own.
+ */
+void
+bgp_copy_pending_tx(struct bgp_pending_tx *dst, struct bgp_pending_tx *src)
+{
+  struct bgp_bucket *b;
+
+  if (src->withdraw_bucket)
+    bgp_copy_prefixes(dst, bgp_get_withdraw_bucket(dst), src->withdraw_bucket);
+
+  WALK_LIST(b, src->bucket_queue)
+    if (!EMPTY_LIST(b->prefixes))
+      bgp_copy_prefixes(dst, bgp_new_bucket(dst, b->eattrs, b->hash), b);
 }
 
 
@@ -943,21 +1081,21 @@ bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UN
   else
     {
       key = old;
-      if (!(buck = p->withdraw_bucket))
-	{
-	  buck = p->withdraw_bucket = mb_alloc(P->pool, sizeof(struct bgp_bucket));
-	  init_list(&buck->prefixes);
-	}
+      buck = bgp_get_withdraw_bucket(p->ptx);
     }
   path_id = p->add_path_tx ? key->attrs->src->global_id : 0;
-  px = bgp_get_prefix(p, n->n.prefix, n->n.pxlen, path_id);
+  px = bgp_get_prefix(p->ptx, n->n.prefix, n->n.pxlen, path_id);
   if (px->bucket_node.next)
     {
       DBG("\tRemoving old entry.\n");
       rem_node(&px->bucket_node);
     }
   add_tail(&buck->prefixes, &px->bucket_node);
-  bgp_schedule_packet(p->conn, PKT_UPDATE);
+
+  if (p->group)
+    bgp_group_schedule(p->group);
+  else
+    bgp_schedule_packet(p->conn, PKT_UPDATE);
 }
 
 static int
@@ -1136,7 +1274,7 @@ bgp_import_control(struct proto *P, rte **new, ea_list **attrs, struct linpool *
   struct bgp_proto *new_bgp = (e->attrs->src->proto->proto == &proto_bgp) ?
     (struct bgp_proto *) e->attrs->src->proto : NULL;
 
-  if (p == new_bgp)			/* Poison reverse updates */
+  if ((p == new_bgp) && !bgp_group_shared(p))	/* Poison reverse updates */
     return -1;
   if (new_bgp)
     {
@@ -1889,17 +2027,6 @@ bgp_get_attr(eattr *a, byte *buf, int buflen)
   return GA_NAME;
 }
 
-void
-bgp_init_bucket_table(struct bgp_proto *p)
-{
-  p->hash_size = 256;
-  p->hash_limit = p->hash_size * 4;
-  p->bucket_hash = mb_allocz(p->p.pool, p->hash_size * sizeof(struct bgp_bucket *));
-  init_list(&p->bucket_queue);
-  p->withdraw_bucket = NULL;
-  // fib_init(&p->prefix_fib, p->p.pool, sizeof(struct bgp_prefix), 0, bgp_init_prefix);
-}
-
 void
 bgp_get_route_info(rte *e, byte *buf, ea_list *attrs)
 {
@@ -44,7 +44,9 @@
  * bit field in &bgp_conn and as soon as the transmit socket buffer becomes empty,
  * we call bgp_fire_tx(). It inspects state of all the packet type bits and calls
  * the corresponding bgp_create_xx() functions, eventually rescheduling the same packet
- * type if we have more data of the same type to send.
+ * type if we have more data of the same type to send. The messages are packed one
+ * after another into the transmit buffer while there is room for another one, and
+ * the whole batch is then passed to the socket at once.
  *
  * The processing of attributes consists of two functions: bgp_decode_attrs() for checking
  * of the attribute blocks and translating them to the language of BIRD's extended attributes
@@ -75,6 +77,7 @@
 #include "lib/socket.h"
 #include "lib/resource.h"
 #include "lib/string.h"
+#include "filter/filter.h"
 
 #include "bgp.h"
 
@@ -88,6 +91,8 @@ static void bgp_connect(struct bgp_proto *p);
 static void bgp_active(struct bgp_proto *p);
 static sock *bgp_setup_listen_sk(ip_addr addr, unsigned port, u32 flags);
 static void bgp_update_bfd(struct bgp_proto *p, int use_bfd);
+static struct bgp_group *bgp_group_new(struct bgp_proto *p);
+static void bgp_group_leave(struct bgp_proto *p);
 
 
 /**
@@ -251,6 +256,8 @@ bgp_close_conn(struct bgp_conn *conn)
   conn->sk = NULL;
   rfree(conn->tx_ev);
   conn->tx_ev = NULL;
+  rfree(conn->rx_ev);
+  conn->rx_ev = NULL;
 }
 
 
@@ -342,6 +349,7 @@ bgp_decision(void *vp)
 void
 bgp_stop(struct bgp_proto *p, unsigned subcode)
 {
+  bgp_group_leave(p);
   proto_notify_state(&p->p, PS_STOP);
   bgp_graceful_close_conn(&p->outgoing_conn, subcode);
   bgp_graceful_close_conn(&p->incoming_conn, subcode);
@@ -383,8 +391,11 @@ bgp_conn_enter_established_state(struct bgp_conn *conn)
   p->last_error_code = 0;
   p->feed_state = BFS_NONE;
   p->load_state = BFS_NONE;
-  bgp_init_bucket_table(p);
-  bgp_init_prefix_table(p, 8);
+
+  if (p->cf->update_group)
+    bgp_group_new(p);
+  else
+    p->ptx = bgp_new_pending_tx(p->p.pool);
 
   int peer_gr_ready = conn->peer_gr_aware && !(conn->peer_gr_flags & BGP_GRF_RESTART);
 
@@ -469,6 +480,7 @@ bgp_handle_graceful_restart(struct bgp_proto *p)
 
   BGP_TRACE(D_EVENTS, "Neighbor graceful restart detected%s",
 	    p->gr_active ? " - already pending" : "");
+  bgp_group_leave(p);
   proto_notify_state(&p->p, PS_START);
 
   if (p->gr_active)
@@ -557,6 +569,426 @@ bgp_refresh_end(struct bgp_proto *p)
 }
 
 
+/*
+ *	Update groups
+ */
+
+static list bgp_groups;			/* All update groups */
+static int bgp_groups_initialized;
+
+static u32
+bgp_group_hash(struct bgp_proto *p)
+{
+  return ipa_hash32(p->source_addr) ^ u32_hash(p->local_as) ^
+    (p->is_internal | (p->rr_client << 1) | (p->rs_client << 2) |
+     (p->as4_session << 3) | (p->add_path_tx << 4) | (p->ext_messages << 5));
+}
+
+static inline struct iface *
+bgp_neigh_iface(struct bgp_proto *p)
+{ return p->neigh ? p->neigh->iface : NULL; }
+
+/*
+ * Two neighbors may share exports if they see the same routes through the
+ * same filter and everything bgp_import_control() and bgp_create_update() do
+ * with the routes depends only on the compared parameters. Export limits are
+ * counted per neighbor, so neighbors having them are never grouped.
+ *
+ * Routes are not suppressed towards their source in shared groups, so the
+ * neighbor has to drop them by AS path loop detection (other IBGP neighbors
+ * never get routes of each other). That cannot be relied on for route
+ * reflector clients, which get their own routes back with just ORIGINATOR_ID,
+ * nor with allow local as, which is usually set on both sides of the session.
+ * Such neighbors are never grouped either.
+ */
+static int
+bgp_group_compatible(struct bgp_proto *a, struct bgp_proto *b)
+{
+  struct announce_hook *ah = a->p.main_ahook, *bh = b->p.main_ahook;
+
+  return (ah->table == bh->table) &&
+    !ah->out_limit && !bh->out_limit &&
+    !a->rr_client && !b->rr_client &&
+    !a->cf->allow_local_as && !b->cf->allow_local_as &&
+    (a->p.accept_ra_types == b->p.accept_ra_types) &&
+    (a->local_as == b->local_as) &&
+    (a->local_id == b->local_id) &&
+    (a->is_internal == b->is_internal) &&
+    (a->rr_client == b->rr_client) &&
+    (a->rr_cluster_id == b->rr_cluster_id) &&
+    (a->rs_client == b->rs_client) &&
+    (a->as4_session == b->as4_session) &&
+    (a->add_path_tx == b->add_path_tx) &&
+    (a->ext_messages == b->ext_messages) &&
+    ipa_equal(a->source_addr, b->source_addr) &&
+#ifdef IPV6
+    ipa_equal(a->local_link, b->local_link) &&
+#endif
+    (bgp_neigh_iface(a) == bgp_neigh_iface(b)) &&
+    (a->cf->next_hop_self == b->cf->next_hop_self) &&
+    (a->cf->next_hop_keep == b->cf->next_hop_keep) &&
+    (a->cf->missing_lladdr == b->cf->missing_lladdr) &&
+    (a->cf->interpret_communities == b->cf->interpret_communities) &&
+    (a->cf->default_local_pref == b->cf->default_local_pref) &&
+    filter_same(ah->out_filter, bh->out_filter);
+}
+
+static inline void
+bgp_link_ahook(struct bgp_proto *p)
+{
+  struct announce_hook *ah = p->p.main_ahook;
+  add_tail(&ah->table->hooks, &ah->n);
+}
+
+static inline void
+bgp_unlink_ahook(struct bgp_proto *p)
+{
+  rem_node(&p->p.main_ahook->n);
+}
+
+static void
+bgp_group_add(struct bgp_group *g, struct bgp_proto *p)
+{
+  add_tail(&g->members, &p->group_node);
+  g->count++;
+
+  p->group = g;
+  p->ptx = g->ptx;
+  p->group_next = NULL;
+}
+
+static struct bgp_group *
+bgp_group_new(struct bgp_proto *p)
+{
+  pool *pool = rp_new(&root_pool, "BGP update group");
+  struct bgp_group *g = mb_allocz(pool, sizeof(struct bgp_group));
+
+  if (!bgp_groups_initialized)
+    {
+      init_list(&bgp_groups);
+      bgp_groups_initialized = 1;
+    }
+
+  g->pool = pool;
+  init_list(&g->members);
+  init_list(&g->msgs);
+  g->hash = bgp_group_hash(p);
+  g->ptx = bgp_new_pending_tx(pool);
+  g->leader = p;
+  g->want_merge = 1;
+  add_tail(&bgp_groups, &g->n);
+
+  bgp_group_add(g, p);
+  return g;
+}
+
+static void
+bgp_group_free(struct bgp_group *g)
+{
+  rem_node(&g->n);
+  rfree(g->pool);
+}
+
+/**
+ * bgp_group_add_msg - queue an encoded UPDATE for an update group
+ * @g: update group
+ * @data: message body
+ * @len: length of the message body
+ *
+ * The message is queued for all members which have sent all previous
+ * messages and they are scheduled to send it. Members still sending older
+ * messages reach it in their turn.
+ */
+struct bgp_group_msg *
+bgp_group_add_msg(struct bgp_group *g, byte *data, uint len)
+{
+  struct bgp_group_msg *m = mb_alloc(g->pool, sizeof(struct bgp_group_msg) + len);
+  node *n;
+
+  m->refs = g->count;
+  m->length = len;
+  memcpy(m->data, data, len);
+  add_tail(&g->msgs, &m->n);
+  g->msg_count++;
+
+  WALK_LIST(n, g->members)
+    {
+      struct bgp_proto *q = SKIP_BACK(struct bgp_proto, group_node, n);
+      if (!q->group_next)
+	{
+	  q->group_next = m;
+	  bgp_schedule_packet(q->conn, PKT_UPDATE);
+	}
+    }
+
+  return m;
+}
+
+/* Kick members which have sent everything and may encode more */
+static void
+bgp_group_kick(struct bgp_group *g)
+{
+  node *n;
+
+  WALK_LIST(n, g->members)
+    {
+      struct bgp_proto *q = SKIP_BACK(struct bgp_proto, group_node, n);
+      if (!q->group_next)
+	bgp_schedule_packet(q->conn, PKT_UPDATE);
+    }
+}
+
+/**
+ * bgp_group_msg_sent - release a queued message
+ * @g: update group
+ * @m: message sent (or skipped) by one member
+ *
+ * The message is freed when all members have sent it. When the queue gets
+ * shorter than its limit, members blocked by it may encode again.
+ */
+void
+bgp_group_msg_sent(struct bgp_group *g, struct bgp_group_msg *m)
+{
+  if (--m->refs)
+    return;
+
+  rem_node(&m->n);
+  mb_free(m);
+
+  if (g->msg_count-- == BGP_GROUP_MAX_MSGS)
+    bgp_group_kick(g);
+}
+
+static void
+bgp_group_skip_msgs(struct bgp_group *g, struct bgp_proto *p)
+{
+  struct bgp_group_msg *m, *next;
+
+  for (m = p->group_next; m; m = next)
+    {
+      next = bgp_group_next_msg(m);
+      bgp_group_msg_sent(g, m);
+    }
+
+  p->group_next = NULL;
+}
+
+/**
+ * bgp_group_schedule - schedule sending of group updates
+ * @g: update group
+ *
+ * This function is called by the group leader when a route is queued to
+ * the shared buckets. Just the first one after the buckets were drained
+ * kicks the members, the others find it already scheduled.
+ */
+void
+bgp_group_schedule(struct bgp_group *g)
+{
+  if (g->tx_scheduled)
+    return;
+
+  g->tx_scheduled = 1;
+  bgp_group_kick(g);
+}
+
+static inline int
+bgp_group_idle(struct bgp_group *g)
+{
+  struct bgp_proto *p = g->leader;
+
+  /* Members of shared groups are all exporting, see bgp_group_split() */
+  return EMPTY_LIST(g->msgs) && !g->ptx->prefix_hash.count &&
+    ((g->count > 1) ||
+     ((p->p.export_state == ES_READY) && (p->feed_state == BFS_NONE)));
+}
+
+static void
+bgp_group_merge(struct bgp_group *dst, struct bgp_group *src)
+{
+  node *n, *nxt;
+
+  /* The leader of dst exports routes for the members of src from now on */
+  bgp_unlink_ahook(src->leader);
+
+  WALK_LIST_DELSAFE(n, nxt, src->members)
+    {
+      struct bgp_proto *q = SKIP_BACK(struct bgp_proto, group_node, n);
+      rem_node(n);
+      bgp_group_add(dst, q);
+    }
+
+  bgp_group_free(src);
+}
+
+/**
+ * bgp_group_tx_done - handle update group with nothing more to send
+ * @p: member which found nothing to send
+ *
+ * When all members of a group have sent everything, their neighbors got the
+ * same routes. The group may be merged with another group of equivalent
+ * neighbors in the same state, as the routes exported to its members from
+ * now on will be the same as well. The group looks for one after it was
+ * formed, until no equivalent group exists.
+ */
+void
+bgp_group_tx_done(struct bgp_proto *p)
+{
+  struct bgp_group *g = p->group;
+  struct bgp_group *h, *found = NULL;
+  int busy = 0;
+
+  if (!g->ptx->prefix_hash.count)
+    g->tx_scheduled = 0;
+
+  if (!g->want_merge || !bgp_group_idle(g))
+    return;
+
+  WALK_LIST(h, bgp_groups)
+    if ((h != g) && (h->hash == g->hash) &&
+	bgp_group_compatible(h->leader, g->leader))
+      {
+	if (bgp_group_idle(h))
+	  {
+	    found = h;
+	    break;
+	  }
+
+	busy = 1;
+      }
+
+  if (!found)
+    {
+      g->want_merge = busy;
+      return;
+    }
+
+  BGP_TRACE(D_EVENTS, "Merging with update group of %s", found->leader->p.name);
+
+  if (found->count >= g->count)
+    bgp_group_merge(found, g);
+  else
+    bgp_group_merge(g, found);
+}
+
+/**
+ * bgp_group_split - leave update group and continue alone
+ * @p: member of an update group
+ *
+ * The member gets a new group with copies of all messages and prefixes it has
+ * yet to send, so its neighbor does not miss any of them. This is used when
+ * routes are fed to the member again, as the feed is just for its neighbor,
+ * and when the member holds up the others, see bgp_group_full().
+ */
+static void
+bgp_group_split(struct bgp_proto *p)
+{
+  struct bgp_group *g = p->group;
+  struct bgp_group_msg *m, *next;
+  struct bgp_group *n;
+
+  if (g->count == 1)
+    return;
+
+  BGP_TRACE(D_EVENTS, "Leaving update group");
+
+  m = p->group_next;
+  rem_node(&p->group_node);
+  g->count--;
+
+  n = bgp_group_new(p);
+  bgp_copy_pending_tx(n->ptx, g->ptx);
+
+  for (; m; m = next)
+    {
+      bgp_group_add_msg(n, m->data, m->length);
+      next = bgp_group_next_msg(m);
+      bgp_group_msg_sent(g, m);
+    }
+
+  if (g->leader == p)
+    {
+      g->leader = SKIP_BACK(struct bgp_proto, group_node, HEAD(g->members));
+      bgp_link_ahook(g->leader);
+    }
+  else
+    bgp_link_ahook(p);
+
+  if (n->ptx->prefix_hash.count)
+    bgp_group_schedule(n);
+}
+
+/**
+ * bgp_group_full - check whether an update group may not encode more
+ * @g: update group
+ *
+ * This function is called by a member which has sent all queued messages
+ * and wants to encode the next one. When the queue is at its limit and the
+ * oldest message is held by a single member only, that member is lagging
+ * behind the others (or its neighbor does not read at all), so it is split
+ * from the group to continue at its own pace and the queue gets shorter.
+ * It may join a group again when it catches up, see bgp_group_tx_done().
+ */
+int
+bgp_group_full(struct bgp_group *g)
+{
+  struct bgp_group_msg *m = HEAD(g->msgs);
+  node *n;
+
+  if (g->msg_count < BGP_GROUP_MAX_MSGS)
+    return 0;
+
+  if (m->refs > 1)
+    return 1;
+
+  WALK_LIST(n, g->members)
+    {
+      struct bgp_proto *p = SKIP_BACK(struct bgp_proto, group_node, n);
+      if (p->group_next == m)
+	{
+	  BGP_TRACE(D_EVENTS, "Lagging %u messages behind update group", g->msg_count);
+	  bgp_group_split(p);
+	  break;
+	}
+    }
+
+  return g->msg_count >= BGP_GROUP_MAX_MSGS;
+}
+
+/**
+ * bgp_group_leave - leave update group when export goes down
+ * @p: member of an update group
+ *
+ * The announce hook of the member is linked back to the table, so the core
+ * can unlink it as usual.
+ */
+static void
+bgp_group_leave(struct bgp_proto *p)
+{
+  struct bgp_group *g = p->group;
+
+  if (!g)
+    return;
+
+  bgp_group_skip_msgs(g, p);
+  rem_node(&p->group_node);
+  g->count--;
+
+  p->group = NULL;
+  p->ptx = NULL;
+
+  if (g->leader != p)
+    bgp_link_ahook(p);
+  else if (g->count)
+    {
+      g->leader = SKIP_BACK(struct bgp_proto, group_node, HEAD(g->members));
+      bgp_link_ahook(g->leader);
+    }
+
+  if (!g->count)
+    bgp_group_free(g);
+}
+
+
 static void
 bgp_send_open(struct bgp_conn *conn)
 {
@@ -697,6 +1129,9 @@ bgp_setup_conn(struct bgp_proto *p, struct bgp_conn *conn)
   conn->tx_ev = ev_new(p->p.pool);
   conn->tx_ev->hook = bgp_kick_tx;
   conn->tx_ev->data = conn;
+  conn->rx_ev = ev_new(p->p.pool);
+  conn->rx_ev->hook = bgp_kick_rx;
+  conn->rx_ev->data = conn;
 }
 
 static void
@@ -706,6 +1141,7 @@ bgp_setup_sk(struct bgp_conn *conn, sock *s)
   s->err_hook = bgp_sock_err;
   s->fast_rx = 1;
   conn->sk = s;
+  conn->rx_start = 0;
 }
 
 static void
@@ -743,7 +1179,7 @@ bgp_connect(struct bgp_proto *p)	/* Enter Connect state and start establishing c
   s->dport = p->cf->remote_port;
   s->iface = p->neigh ? p->neigh->iface : NULL;
   s->ttl = p->cf->ttl_security ? 255 : hops;
-  s->rbsize = p->cf->enable_extended_messages ? BGP_RX_BUFFER_EXT_SIZE : BGP_RX_BUFFER_SIZE;
+  s->rbsize = bgp_rx_buffer_size(p->cf);
   s->tbsize = p->cf->enable_extended_messages ? BGP_TX_BUFFER_EXT_SIZE : BGP_TX_BUFFER_SIZE;
   s->tos = IP_PREC_INTERNET_CONTROL;
   s->password = p->cf->password;
@@ -863,10 +1299,10 @@ bgp_incoming_connection(sock *sk, int dummy UNUSED)
     if (sk_set_min_ttl(sk, 256 - hops) < 0)
       goto err;
 
-  if (p->cf->enable_extended_messages)
+  if ((sk->rbsize != bgp_rx_buffer_size(p->cf)) || p->cf->enable_extended_messages)
     {
-      sk->rbsize = BGP_RX_BUFFER_EXT_SIZE;
-      sk->tbsize = BGP_TX_BUFFER_EXT_SIZE;
+      sk->rbsize = bgp_rx_buffer_size(p->cf);
+      sk->tbsize = p->cf->enable_extended_messages ? BGP_TX_BUFFER_EXT_SIZE : BGP_TX_BUFFER_SIZE;
       sk_reallocate(sk);
     }
 
@@ -1044,6 +1480,10 @@ bgp_feed_begin(struct proto *P, int initial)
   if (!p->conn)
     return;
 
+  /* The feed is just for our neighbor */
+  if (!initial && p->group)
+    bgp_group_split(p);
+
   if (initial && p->cf->gr_mode)
     p->feed_state = BFS_LOADING;
 
@@ -1357,6 +1797,11 @@ bgp_check_config(struct bgp_config *c)
 
   if (c->secondary && !c->c.table->sorted)
     cf_error("BGP with secondary option requires sorted table");
+
+  /* The buffer must hold an incomplete message after a complete one */
+  uint rx_min = 2 * (c->enable_extended_messages ? BGP_MAX_EXT_MSG_LENGTH : BGP_MAX_MESSAGE_LENGTH);
+  if (c->rx_buffer && ((c->rx_buffer < rx_min) || (c->rx_buffer > BGP_RX_BUFFER_MAX)))
+    cf_error("RX buffer size must be in range %u-%u", rx_min, BGP_RX_BUFFER_MAX);
 }
 
 static int
@@ -1380,6 +1825,11 @@ bgp_reconfigure(struct proto *P, struct proto_config *C)
   if (same && (p->start_state > BSS_PREPARE))
     bgp_update_bfd(p, new->bfd);
 
+  /* Neighbors in update group must have the same export */
+  if (same && p->group &&
+      (C->out_limit || !filter_same(C->out_filter, P->cf->out_filter)))
+    bgp_group_split(p);
+
   /* We should update our copy of configuration ptr as old configuration will be freed */
   if (same)
     p->cf = new;
@@ -1563,6 +2013,9 @@ bgp_show_proto_info(struct proto *P)
 	      p->add_path_tx ? " add-path-tx" : "",
 	      p->ext_messages ? " ext-messages" : "");
       cli_msg(-1006, "    Source address:   %I", p->source_addr);
+      if (p->group)
+	cli_msg(-1006, "    Update group:     %s (%u members)",
+		p->group->leader->p.name, p->group->count);
       if (P->cf->in_limit)
 	cli_msg(-1006, "    Route limit:      %d/%d",
 		p->p.stats.imp_routes + p->p.stats.filt_routes, P->cf->in_limit->limit);
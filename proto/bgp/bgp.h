@@ -61,6 +61,8 @@ struct bgp_config {
   unsigned error_delay_time_min;	/* Time to wait after an error is detected */
   unsigned error_delay_time_max;
   unsigned disable_after_error;		/* Disable the protocol when error is detected */
+  int update_group;			/* Share exports with equivalent neighbors */
+  unsigned rx_buffer;			/* Size of receive buffer, 0 for default */
 
   char *password;			/* Password used for MD5 authentication */
   struct rtable_config *igp_table;	/* Table used for recursive next hop lookups */
@@ -97,6 +99,8 @@ struct bgp_conn {
   struct timer *hold_timer;
   struct timer *keepalive_timer;
   struct event *tx_ev;
+  struct event *rx_ev;			/* Continue with received packets after a pause */
+  uint rx_start;			/* Offset of the first unprocessed byte in sk->rbuf */
   int packets_to_send;			/* Bitmap of packet types to be sent */
   int notify_code, notify_subcode, notify_size;
   byte *notify_data;
@@ -145,12 +149,10 @@ struct bgp_proto {
   struct event *event;			/* Event for respawning and shutting process */
   struct timer *startup_timer;		/* Timer used to delay protocol startup due to previous errors (startup_delay) */
   struct timer *gr_timer;		/* Timer waiting for reestablishment after graceful restart */
-  struct bgp_bucket **bucket_hash;	/* Hash table of attribute buckets */
-  uint hash_size, hash_count, hash_limit;
-  HASH(struct bgp_prefix) prefix_hash;	/* Prefixes to be sent */
-  slab *prefix_slab;			/* Slab holding prefix nodes */
-  list bucket_queue;			/* Queue of buckets to send */
-  struct bgp_bucket *withdraw_bucket;	/* Withdrawn routes */
+  struct bgp_pending_tx *ptx;		/* Buckets and prefixes to be sent */
+  struct bgp_group *group;		/* Update group we are member of */
+  node group_node;			/* Node in group->members */
+  struct bgp_group_msg *group_next;	/* Next group message to send, NULL if caught up */
   unsigned startup_delay;		/* Time to delay protocol startup by due to errors */
   bird_clock_t last_proto_error;	/* Time of last error that leads to protocol stop */
   u8 last_error_class; 			/* Error class of last error */
@@ -163,6 +165,39 @@ struct bgp_proto {
 #endif
 };
 
+struct bgp_pending_tx {
+  pool *pool;				/* Pool holding buckets and prefixes */
+  struct bgp_bucket **bucket_hash;	/* Hash table of attribute buckets */
+  uint hash_size, hash_count, hash_limit;
+  HASH(struct bgp_prefix) prefix_hash;	/* Prefixes to be sent */
+  slab *prefix_slab;			/* Slab holding prefix nodes */
+  list bucket_queue;			/* Queue of buckets to send */
+  struct bgp_bucket *withdraw_bucket;	/* Withdrawn routes */
+};
+
+struct bgp_group {
+  node n;				/* Node in bgp_groups */
+  pool *pool;				/* Pool holding the group and its messages */
+  list members;				/* Member BGP instances (via group_node) */
+  uint count;				/* Number of members */
+  u32 hash;				/* Hash of export parameters of members */
+  struct bgp_proto *leader;		/* Member whose announce hook exports to the group */
+  struct bgp_pending_tx *ptx;		/* Shared buckets and prefixes */
+  list msgs;				/* Encoded UPDATEs not yet sent by all members */
+  uint msg_count;
+  u8 tx_scheduled;			/* Members were kicked to encode pending prefixes */
+  u8 want_merge;			/* Look for an equivalent group when idle */
+};
+
+struct bgp_group_msg {
+  node n;				/* Node in group->msgs */
+  uint refs;				/* Number of members yet to send it */
+  uint length;
+  byte data[0];				/* UPDATE message without header */
+};
+
+#define BGP_GROUP_MAX_MSGS	64	/* Encoded UPDATEs queued for lagging members */
+
 struct bgp_prefix {
   struct {
     ip_addr prefix;
@@ -186,14 +221,20 @@ struct bgp_bucket {
 #define BGP_HEADER_LENGTH	19
 #define BGP_MAX_MESSAGE_LENGTH	4096
 #define BGP_MAX_EXT_MSG_LENGTH	65535
-#define BGP_RX_BUFFER_SIZE	4096
-#define BGP_TX_BUFFER_SIZE	4096
-#define BGP_RX_BUFFER_EXT_SIZE	65535
-#define BGP_TX_BUFFER_EXT_SIZE	65535
+#define BGP_RX_BUFFER_SIZE	65536
+#define BGP_TX_BUFFER_SIZE	65536	/* Room for a batch of messages */
+#define BGP_RX_BUFFER_EXT_SIZE	262144
+#define BGP_TX_BUFFER_EXT_SIZE	262144
+
+#define BGP_RX_BUFFER_MAX	(16 << 20)
+#define BGP_RX_MAX_PACKETS	64	/* Packets processed before giving way to others */
 
 static inline int bgp_max_packet_length(struct bgp_proto *p)
 { return p->ext_messages ? BGP_MAX_EXT_MSG_LENGTH : BGP_MAX_MESSAGE_LENGTH; }
 
+static inline uint bgp_rx_buffer_size(struct bgp_config *cf)
+{ return cf->rx_buffer ?: (cf->enable_extended_messages ? BGP_RX_BUFFER_EXT_SIZE : BGP_RX_BUFFER_SIZE); }
+
 extern struct linpool *bgp_linpool;
 
 
@@ -212,6 +253,19 @@ void bgp_refresh_begin(struct bgp_proto *p);
 void bgp_refresh_end(struct bgp_proto *p);
 void bgp_store_error(struct bgp_proto *p, struct bgp_conn *c, u8 class, u32 code);
 void bgp_stop(struct bgp_proto *p, unsigned subcode);
+void bgp_group_schedule(struct bgp_group *g);
+void bgp_group_tx_done(struct bgp_proto *p);
+struct bgp_group_msg *bgp_group_add_msg(struct bgp_group *g, byte *data, uint len);
+void bgp_group_msg_sent(struct bgp_group *g, struct bgp_group_msg *m);
+int bgp_group_full(struct bgp_group *g);
+
+static inline struct bgp_group_msg *
+bgp_group_next_msg(struct bgp_group_msg *m)
+{ return m->n.next->next ? SKIP_BACK(struct bgp_group_msg, n, m->n.next) : NULL; }
+
+/* Routes are reflected back to their source within shared groups */
+static inline int bgp_group_shared(struct bgp_proto *p)
+{ return p->group && (p->group->count > 1); }
 
 struct rte_source *bgp_find_source(struct bgp_proto *p, u32 path_id);
 struct rte_source *bgp_get_source(struct bgp_proto *p, u32 path_id);
@@ -252,11 +306,12 @@ int bgp_rte_mergable(rte *pri, rte *sec);
 int bgp_rte_recalculate(rtable *table, net *net, rte *new, rte *old, rte *old_best);
 void bgp_rt_notify(struct proto *P, rtable *tbl UNUSED, net *n, rte *new, rte *old UNUSED, ea_list *attrs);
 int bgp_import_control(struct proto *, struct rte **, struct ea_list **, struct linpool *);
-void bgp_init_bucket_table(struct bgp_proto *);
-void bgp_free_bucket(struct bgp_proto *p, struct bgp_bucket *buck);
-void bgp_init_prefix_table(struct bgp_proto *p, u32 order);
-void bgp_free_prefix(struct bgp_proto *p, struct bgp_prefix *bp);
+struct bgp_pending_tx *bgp_new_pending_tx(pool *pp);
+void bgp_copy_pending_tx(struct bgp_pending_tx *dst, struct bgp_pending_tx *src);
+void bgp_free_bucket(struct bgp_pending_tx *ptx, struct bgp_bucket *buck);
+void bgp_free_prefix(struct bgp_pending_tx *ptx, struct bgp_prefix *bp);
 uint bgp_encode_attrs(struct bgp_proto *p, byte *w, ea_list *attrs, int remains);
+int bgp_encode_mrt_attrs(byte *w, ea_list *attrs, int remains);
 void bgp_get_route_info(struct rte *, byte *buf, struct ea_list *attrs);
 
 inline static void bgp_attach_attr_ip(struct ea_list **to, struct linpool *pool, unsigned attr, ip_addr a)
@@ -269,6 +324,7 @@ void bgp_schedule_packet(struct bgp_conn *conn, int type);
 void bgp_kick_tx(void *vconn);
 void bgp_tx(struct birdsock *sk);
 int bgp_rx(struct birdsock *sk, int size);
+void bgp_kick_rx(void *vconn);
 const char * bgp_error_dsc(unsigned code, unsigned subcode);
 void bgp_log_error(struct bgp_proto *p, u8 class, char *msg, unsigned code, unsigned subcode, byte *data, unsigned len);
 
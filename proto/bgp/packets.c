@@ -327,7 +327,7 @@ bgp_encode_prefixes(struct bgp_proto *p, byte *w, struct bgp_bucket *buck, uint
       w += bytes;
       remains -= bytes + 1;
       rem_node(&px->bucket_node);
-      bgp_free_prefix(p, px);
+      bgp_free_prefix(p->ptx, px);
       // fib_delete(&p->prefix_fib, px);
     }
   return w - start;
@@ -341,7 +341,7 @@ bgp_flush_prefixes(struct bgp_proto *p, struct bgp_bucket *buck)
       struct bgp_prefix *px = SKIP_BACK(struct bgp_prefix, bucket_node, HEAD(buck->prefixes));
       log(L_ERR "%s: - route %I/%d skipped", p->p.name, px->n.prefix, px->n.pxlen);
       rem_node(&px->bucket_node);
-      bgp_free_prefix(p, px);
+      bgp_free_prefix(p->ptx, px);
       // fib_delete(&p->prefix_fib, px);
     }
 }
@@ -360,7 +360,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
   int a_size = 0;
 
   w = buf+2;
-  if ((buck = p->withdraw_bucket) && !EMPTY_LIST(buck->prefixes))
+  if ((buck = p->ptx->withdraw_bucket) && !EMPTY_LIST(buck->prefixes))
     {
       DBG("Withdrawn routes:\n");
       wd_size = bgp_encode_prefixes(p, w, buck, remains);
@@ -371,13 +371,13 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 
   if (remains >= 3072)
     {
-      while ((buck = (struct bgp_bucket *) HEAD(p->bucket_queue))->send_node.next)
+      while ((buck = (struct bgp_bucket *) HEAD(p->ptx->bucket_queue))->send_node.next)
 	{
 	  if (EMPTY_LIST(buck->prefixes))
 	    {
 	      DBG("Deleting empty bucket %p\n", buck);
 	      rem_node(&buck->send_node);
-	      bgp_free_bucket(p, buck);
+	      bgp_free_bucket(p->ptx, buck);
 	      continue;
 	    }
 
@@ -389,7 +389,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	      log(L_ERR "%s: Attribute list too long, skipping corresponding routes", p->p.name);
 	      bgp_flush_prefixes(p, buck);
 	      rem_node(&buck->send_node);
-	      bgp_free_bucket(p, buck);
+	      bgp_free_bucket(p->ptx, buck);
 	      continue;
 	    }
 
@@ -448,7 +448,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
   put_u16(buf, 0);
   w = buf+4;
 
-  if ((buck = p->withdraw_bucket) && !EMPTY_LIST(buck->prefixes))
+  if ((buck = p->ptx->withdraw_bucket) && !EMPTY_LIST(buck->prefixes))
     {
       DBG("Withdrawn routes:\n");
       tmp = bgp_attach_attr_wa(&ea, bgp_linpool, BA_MP_UNREACH_NLRI, remains-8);
@@ -464,13 +464,13 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 
   if (remains >= 3072)
     {
-      while ((buck = (struct bgp_bucket *) HEAD(p->bucket_queue))->send_node.next)
+      while ((buck = (struct bgp_bucket *) HEAD(p->ptx->bucket_queue))->send_node.next)
 	{
 	  if (EMPTY_LIST(buck->prefixes))
 	    {
 	      DBG("Deleting empty bucket %p\n", buck);
 	      rem_node(&buck->send_node);
-	      bgp_free_bucket(p, buck);
+	      bgp_free_bucket(p->ptx, buck);
 	      continue;
 	    }
 
@@ -484,7 +484,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 	      log(L_ERR "%s: Attribute list too long, skipping corresponding routes", p->p.name);
 	      bgp_flush_prefixes(p, buck);
 	      rem_node(&buck->send_node);
-	      bgp_free_bucket(p, buck);
+	      bgp_free_bucket(p->ptx, buck);
 	      continue;
 	    }
 	  w += size;
@@ -537,7 +537,7 @@ bgp_create_update(struct bgp_conn *conn, byte *buf)
 			  remains = rem_stored;
 			  bgp_flush_prefixes(p, buck);
 			  rem_node(&buck->send_node);
-			  bgp_free_bucket(p, buck);
+			  bgp_free_bucket(p->ptx, buck);
 			  continue;
 			case MLL_IGNORE:
 			  break;
@@ -657,6 +657,51 @@ bgp_create_end_refresh(struct bgp_conn *conn, byte *buf)
   return buf;
 }
 
+/*
+ * Members of an update group share the buckets and prefixes to be sent.
+ * Whichever member catches up with the group first encodes the next UPDATE,
+ * which is queued for the group and copied by the other members when their
+ * sockets become ready. The queue is bounded, members still sending the
+ * oldest message pace encoding for the others. A member left alone with it
+ * is split from the group, see bgp_group_full().
+ */
+static byte *
+bgp_create_group_update(struct bgp_conn *conn, byte *buf)
+{
+  struct bgp_proto *p = conn->bgp;
+  struct bgp_group *g = p->group;
+  struct bgp_group_msg *m = p->group_next;
+  byte *end;
+
+  if (!m)
+    {
+      if (bgp_group_full(g))
+	return NULL;
+
+      end = bgp_create_update(conn, buf);
+      if (!end)
+	{
+	  bgp_group_tx_done(p);
+	  return NULL;
+	}
+
+      /* Nobody to share it with */
+      if (g->count == 1)
+	return end;
+
+      m = bgp_group_add_msg(g, buf, end - buf);
+    }
+  else
+    {
+      memcpy(buf, m->data, m->length);
+      end = buf + m->length;
+      BGP_TRACE_RL(&rl_snd_update, D_PACKETS, "Sending UPDATE");
+    }
+
+  p->group_next = bgp_group_next_msg(m);
+  bgp_group_msg_sent(g, m);
+  return end;
+}
 
 static void
 bgp_create_header(byte *buf, uint len, uint type)
@@ -667,38 +712,24 @@ bgp_create_header(byte *buf, uint len, uint type)
 }
 
 /**
- * bgp_fire_tx - transmit packets
+ * bgp_create_packet - assemble next packet
  * @conn: connection
+ * @buf: where to put the packet
  *
- * Whenever the transmit buffers of the underlying TCP connection
- * are free and we have any packets queued for sending, the socket functions
- * call bgp_fire_tx() which takes care of selecting the highest priority packet
- * queued (Notification > Keepalive > Open > Update), assembling its header
- * and body and sending it to the connection.
+ * This function selects the highest priority packet queued
+ * (Notification > Keepalive > Open > Update), assembles its header
+ * and body into @buf and returns a pointer after its end, or NULL
+ * if there is nothing to send.
  */
-static int
-bgp_fire_tx(struct bgp_conn *conn)
+static byte *
+bgp_create_packet(struct bgp_conn *conn, byte *buf)
 {
   struct bgp_proto *p = conn->bgp;
   uint s = conn->packets_to_send;
-  sock *sk = conn->sk;
-  byte *buf, *pkt, *end;
+  byte *pkt = buf + BGP_HEADER_LENGTH;
+  byte *end;
   int type;
 
-  if (!sk)
-    {
-      conn->packets_to_send = 0;
-      return 0;
-    }
-  buf = sk->tbuf;
-  pkt = buf + BGP_HEADER_LENGTH;
-
-  if (s & (1 << PKT_SCHEDULE_CLOSE))
-    {
-      /* We can finally close connection and enter idle state */
-      bgp_conn_enter_idle_state(conn);
-      return 0;
-    }
   if (s & (1 << PKT_NOTIFICATION))
     {
       s = 1 << PKT_SCHEDULE_CLOSE;
@@ -734,7 +765,9 @@ bgp_fire_tx(struct bgp_conn *conn)
   else if (s & (1 << PKT_UPDATE))
     {
       type = PKT_UPDATE;
-      end = bgp_create_update(conn, pkt);
+      end = !p->ptx ? NULL :
+	p->group ? bgp_create_group_update(conn, pkt) :
+	bgp_create_update(conn, pkt);
 
       if (!end)
         {
@@ -755,17 +788,65 @@ bgp_fire_tx(struct bgp_conn *conn)
 	  }
 
 	  else /* Really nothing to send */
-	    return 0;
+	    return NULL;
 
 	  p->feed_state = BFS_NONE;
+
+	  if (p->group)
+	    bgp_group_tx_done(p);
 	}
     }
   else
-    return 0;
+    return NULL;
 
   conn->packets_to_send = s;
   bgp_create_header(buf, end - buf, type);
-  return sk_send(sk, end - buf);
+  return end;
+}
+
+/**
+ * bgp_fire_tx - transmit packets
+ * @conn: connection
+ *
+ * Whenever the transmit buffers of the underlying TCP connection
+ * are free and we have any packets queued for sending, the socket functions
+ * call bgp_fire_tx() which assembles queued packets by bgp_create_packet()
+ * one after another into the transmit buffer as long as there is room for
+ * a packet of maximal length, and sends the whole batch to the connection.
+ * The next batch is assembled when the previous one has been written
+ * completely, so the amount of queued data stays bounded.
+ */
+static int
+bgp_fire_tx(struct bgp_conn *conn)
+{
+  struct bgp_proto *p = conn->bgp;
+  sock *sk = conn->sk;
+  byte *pos, *end;
+
+  if (!sk)
+    {
+      conn->packets_to_send = 0;
+      return 0;
+    }
+
+  if (conn->packets_to_send & (1 << PKT_SCHEDULE_CLOSE))
+    {
+      /* We can finally close connection and enter idle state */
+      bgp_conn_enter_idle_state(conn);
+      return 0;
+    }
+
+  /* Nothing may follow a notification, which schedules the close */
+  pos = sk->tbuf;
+  while ((pos + bgp_max_packet_length(p) <= sk->tbuf + sk->tbsize) &&
+	 !(conn->packets_to_send & (1 << PKT_SCHEDULE_CLOSE)) &&
+	 (end = bgp_create_packet(conn, pos)))
+    pos = end;
+
+  if (pos == sk->tbuf)
+    return 0;
+
+  return sk_send(sk, pos - sk->tbuf);
 }
 
 /**
@@ -1088,8 +1169,53 @@ bgp_rx_end_mark(struct bgp_proto *p)
 } while (0)
 
 
+/*
+ * Consecutive NLRI of an UPDATE with the same path ID share their route
+ * attributes, so they are collected and passed to the routing table
+ * together by rte_update_batch().
+ */
+
+#define BGP_RX_BATCH 256
+
+struct bgp_rx_batch {
+  struct rte_src *src;
+  rta *a;				/* Attributes, NULL for withdraws */
+  uint count;
+  net *nets[BGP_RX_BATCH];
+};
+
+static void
+bgp_rx_batch_flush(struct bgp_proto *p, struct bgp_rx_batch *b)
+{
+  rte *e = NULL;
+
+  if (!b->count)
+    return;
+
+  if (b->a)
+    {
+      e = rte_get_temp(rta_clone(b->a));
+      e->pflags = 0;
+      e->u.bgp.suppressed = 0;
+    }
+
+  rte_update_batch(p->p.main_ahook, b->nets, b->count, e, b->src);
+  b->count = 0;
+}
+
 static inline void
-bgp_rte_update(struct bgp_proto *p, ip_addr prefix, int pxlen,
+bgp_rx_batch_add(struct bgp_proto *p, struct bgp_rx_batch *b, net *n, rta *a, struct rte_src *src)
+{
+  if (b->count && ((b->a != a) || (b->src != src) || (b->count == BGP_RX_BATCH)))
+    bgp_rx_batch_flush(p, b);
+
+  b->a = a;
+  b->src = src;
+  b->nets[b->count++] = n;
+}
+
+static inline void
+bgp_rte_update(struct bgp_proto *p, struct bgp_rx_batch *b, ip_addr prefix, int pxlen,
 	       u32 path_id, u32 *last_id, struct rte_src **src,
 	       rta *a0, rta **a)
 {
@@ -1100,6 +1226,8 @@ bgp_rte_update(struct bgp_proto *p, ip_addr prefix, int pxlen,
 
       if (*a)
 	{
+	  /* The batch may still refer to the old attributes */
+	  bgp_rx_batch_flush(p, b);
 	  rta_free(*a);
 	  *a = NULL;
 	}
@@ -1117,15 +1245,11 @@ bgp_rte_update(struct bgp_proto *p, ip_addr prefix, int pxlen,
     }
 
   net *n = net_get(p->p.table, prefix, pxlen);
-  rte *e = rte_get_temp(rta_clone(*a));
-  e->net = n;
-  e->pflags = 0;
-  e->u.bgp.suppressed = 0;
-  rte_update2(p->p.main_ahook, n, e, *src);
+  bgp_rx_batch_add(p, b, n, *a, *src);
 }
 
 static inline void
-bgp_rte_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen,
+bgp_rte_withdraw(struct bgp_proto *p, struct bgp_rx_batch *b, ip_addr prefix, int pxlen,
 		 u32 path_id, u32 *last_id, struct rte_src **src)
 {
   if (path_id != *last_id)
@@ -1135,7 +1259,7 @@ bgp_rte_withdraw(struct bgp_proto *p, ip_addr prefix, int pxlen,
     }
 
   net *n = net_find(p->p.table, prefix, pxlen);
-  rte_update2( p->p.main_ahook, n, NULL, *src);
+  bgp_rx_batch_add(p, b, n, NULL, *src);
 }
 
 static inline int
@@ -1202,6 +1326,7 @@ bgp_do_rx_update(struct bgp_conn *conn,
   int pxlen, err = 0;
   u32 path_id = 0;
   u32 last_id = 0;
+  struct bgp_rx_batch batch = { .count = 0 };
 
   /* Check for End-of-RIB marker */
   if (!withdrawn_len && !attr_len && !nlri_len)
@@ -1216,8 +1341,9 @@ bgp_do_rx_update(struct bgp_conn *conn,
       DECODE_PREFIX(withdrawn, withdrawn_len);
       DBG("Withdraw %I/%d\n", prefix, pxlen);
 
-      bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+      bgp_rte_withdraw(p, &batch, prefix, pxlen, path_id, &last_id, &src);
     }
+  bgp_rx_batch_flush(p, &batch);
 
   if (!attr_len && !nlri_len)		/* shortcut */
     return;
@@ -1239,12 +1365,13 @@ bgp_do_rx_update(struct bgp_conn *conn,
       DBG("Add %I/%d\n", prefix, pxlen);
 
       if (a0)
-	bgp_rte_update(p, prefix, pxlen, path_id, &last_id, &src, a0, &a);
+	bgp_rte_update(p, &batch, prefix, pxlen, path_id, &last_id, &src, a0, &a);
       else /* Forced withdraw as a result of soft error */
-	bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+	bgp_rte_withdraw(p, &batch, prefix, pxlen, path_id, &last_id, &src);
     }
 
  done:
+  bgp_rx_batch_flush(p, &batch);
   if (a)
     rta_free(a);
 
@@ -1306,6 +1433,7 @@ bgp_do_rx_update(struct bgp_conn *conn,
   int pxlen, err = 0;
   u32 path_id = 0;
   u32 last_id = 0;
+  struct bgp_rx_batch batch = { .count = 0 };
 
   p->mp_reach_len = 0;
   p->mp_unreach_len = 0;
@@ -1328,7 +1456,7 @@ bgp_do_rx_update(struct bgp_conn *conn,
 	{
 	  DECODE_PREFIX(x, len);
 	  DBG("Withdraw %I/%d\n", prefix, pxlen);
-	  bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+	  bgp_rte_withdraw(p, &batch, prefix, pxlen, path_id, &last_id, &src);
 	}
     }
 
@@ -1357,13 +1485,14 @@ bgp_do_rx_update(struct bgp_conn *conn,
 	  DBG("Add %I/%d\n", prefix, pxlen);
 
 	  if (a0)
-	    bgp_rte_update(p, prefix, pxlen, path_id, &last_id, &src, a0, &a);
+	    bgp_rte_update(p, &batch, prefix, pxlen, path_id, &last_id, &src, a0, &a);
 	  else /* Forced withdraw as a result of soft error */
-	    bgp_rte_withdraw(p, prefix, pxlen, path_id, &last_id, &src);
+	    bgp_rte_withdraw(p, &batch, prefix, pxlen, path_id, &last_id, &src);
 	}
     }
 
  done:
+  bgp_rx_batch_flush(p, &batch);
   if (a)
     rta_free(a);
 
@@ -1671,29 +1800,37 @@ bgp_rx_packet(struct bgp_conn *conn, byte *pkt, unsigned len)
 }
 
 /**
- * bgp_rx - handle received data
- * @sk: socket
- * @size: amount of data received
+ * bgp_rx_packets - process received packets
+ * @conn: connection
  *
- * bgp_rx() is called by the socket layer whenever new data arrive from
- * the underlying TCP connection. It assembles the data fragments to packets,
- * checks their headers and framing and passes complete packets to
- * bgp_rx_packet().
+ * This function assembles data in the receive buffer to packets, checks
+ * their headers and framing and passes complete packets to bgp_rx_packet().
+ * The packets are processed in place, the incomplete one at the end is moved
+ * to the beginning of the buffer only when there would not be enough room
+ * left to receive the rest of it, so the data is copied at most once per
+ * buffer length. After %BGP_RX_MAX_PACKETS packets, receiving is paused and
+ * the rest is processed from an event, so that one busy neighbor does not
+ * starve other sockets and timers.
  */
-int
-bgp_rx(sock *sk, int size)
+static void
+bgp_rx_packets(struct bgp_conn *conn)
 {
-  struct bgp_conn *conn = sk->data;
   struct bgp_proto *p = conn->bgp;
-  byte *pkt_start = sk->rbuf;
-  byte *end = pkt_start + size;
-  unsigned i, len;
+  sock *sk = conn->sk;
+  byte *pkt_start = sk->rbuf + conn->rx_start;
+  byte *end = sk->rpos;
+  uint i, len, n = 0;
 
-  DBG("BGP: RX hook: Got %d bytes\n", size);
   while (end >= pkt_start + BGP_HEADER_LENGTH)
     {
       if ((conn->state == BS_CLOSE) || (conn->sk != sk))
-	return 0;
+	return;
+      if (n++ >= BGP_RX_MAX_PACKETS)
+	{
+	  sk->rx_hook = NULL;
+	  ev_schedule(conn->rx_ev);
+	  break;
+	}
       for(i=0; i<16; i++)
 	if (pkt_start[i] != 0xff)
 	  {
@@ -1711,10 +1848,692 @@ bgp_rx(sock *sk, int size)
       bgp_rx_packet(conn, pkt_start, len);
       pkt_start += len;
     }
-  if (pkt_start != sk->rbuf)
+
+  if ((conn->state == BS_CLOSE) || (conn->sk != sk))
+    return;
+
+  if (pkt_start == end)
+    {
+      sk->rpos = sk->rbuf;
+      conn->rx_start = 0;
+    }
+  else if (pkt_start + bgp_max_packet_length(p) > sk->rbuf + sk->rbsize)
     {
       memmove(sk->rbuf, pkt_start, end - pkt_start);
       sk->rpos = sk->rbuf + (end - pkt_start);
+      conn->rx_start = 0;
     }
+  else
+    conn->rx_start = pkt_start - sk->rbuf;
+}
+
+/**
+ * bgp_rx - handle received data
+ * @sk: socket
+ * @size: amount of data received
+ *
+ * bgp_rx() is called by the socket layer whenever new data arrive from
+ * the underlying TCP connection. The data are appended to the receive
+ * buffer and processed by bgp_rx_packets().
+ */
+int
+bgp_rx(sock *sk, int size UNUSED)
+{
+  struct bgp_conn *conn = sk->data;
+
+  DBG("BGP: RX hook: Got %d bytes\n", size);
+  bgp_rx_packets(conn);
   return 0;
 }
+
+void
+bgp_kick_rx(void *vconn)
+{
+  struct bgp_conn *conn = vconn;
+
+  DBG("BGP: kicking RX\n");
+  if (!conn->sk || (conn->state == BS_CLOSE))
+    return;
+
+  conn->sk->rx_hook = bgp_rx;
+  bgp_rx_packets(conn);
+}
+
+
+#ifdef TEST
+
+/*
+ * UPDATE processing benchmark: UPDATE messages are passed to bgp_rx_update()
+ * of a source BGP instance connected to a private routing table, which
+ * exports the routes to a number of peer instances. Their UPDATEs are built
+ * by bgp_create_packet() from the TX events, counted and dropped. All the
+ * instances are stubs with established sessions set up just enough for
+ * that, there are no sockets and no timers.
+ *
+ * Messages are read from a MRT file (BGP4MP messages and TABLE_DUMP_V2 RIB
+ * entries) given as an argument, otherwise IPv4 routes for @n prefixes are
+ * generated, announced and withdrawn. Import time includes filtering and
+ * queueing of the routes for the peers, export time is spent by building of
+ * UPDATEs for them. The program fails when the source session is closed
+ * due to an error, or when generated routes are not propagated to all the
+ * peers, so it may be used as a regression test as well.
+ *
+ * It is built by 'make tests' and run with the defaults by 'make check'.
+ *
+ * Usage: bgp-bench [-p <peers>] [-n <prefixes>] [<mrt-file>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "lib/unix.h"
+
+#define BB_LOCAL_AS	4200000000u
+#define BB_MAX_RECORD	(16 << 20)
+#define BB_BATCH	64		/* Messages received between runs of events */
+#define BB_PATHS	997		/* AS paths of generated routes */
+#define BB_PREFIXES	64		/* Prefixes in a generated UPDATE */
+
+struct bb_peer {
+  struct bgp_proto *p;
+  uint msgs;
+  u64 bytes;
+};
+
+static struct config bb_config;
+static struct rtable_config bb_table_config;
+static rtable bb_table;
+static list bb_protos;			/* Stubs are not in the protocol lists */
+static struct iface bb_iface;
+static neighbor bb_neigh;
+static byte bb_buf[BGP_MAX_EXT_MSG_LENGTH];
+static clock_t bb_rx_time, bb_tx_time;
+static uint bb_rx_msgs;
+
+static void
+bb_nop(void *data UNUSED)
+{
+}
+
+static void
+bb_tx(void *data)
+{
+  struct bb_peer *pr = data;
+  byte *end;
+
+  while (end = bgp_create_packet(pr->p->conn, bb_buf))
+    {
+      pr->msgs++;
+      pr->bytes += end - bb_buf;
+    }
+}
+
+static void
+bb_events(void)
+{
+  clock_t t0 = clock();
+
+  while (ev_run_list(&global_event_list))
+    ;
+  bb_tx_time += clock() - t0;
+}
+
+static ip_addr
+bb_addr(uint i)
+{
+#ifndef IPV6
+  return ipa_from_u32(0x0a000000 + i);
+#else
+  return ipa_build6(0x20010db8, 0, 0, i);
+#endif
+}
+
+/* Create instance @i with an established session, following bgp_init(),
+   proto_want_core_up() and bgp_conn_enter_established_state() */
+static struct bgp_proto *
+bb_new(uint i, void *tx_data)
+{
+  struct bgp_config *cf = mb_allocz(&root_pool, sizeof(struct bgp_config));
+  struct bgp_proto *p;
+  struct bgp_conn *conn;
+
+  /* Defaults of the grammar and bgp_check_config() */
+  cf->c.name = mb_alloc(&root_pool, 16);
+  bsprintf(cf->c.name, "bgp%u", i);
+  cf->c.protocol = &proto_bgp;
+  cf->c.table = &bb_table_config;
+  cf->c.preference = DEF_PREF_BGP;
+  cf->local_as = BB_LOCAL_AS;
+  cf->remote_as = BB_LOCAL_AS + 1 + i;
+  cf->remote_ip = bb_addr(2 + i);
+  cf->gw_mode = GW_DIRECT;
+  cf->missing_lladdr = MLL_SELF;
+  cf->compare_path_lengths = 1;
+  cf->igp_metric = 1;
+  cf->default_local_pref = 100;
+  cf->capabilities = 1;
+  cf->enable_as4 = 1;
+  cf->interpret_communities = 1;
+
+  p = (struct bgp_proto *) proto_bgp.init(&cf->c);
+  p->p.pool = rp_new(&root_pool, cf->c.name);
+  p->p.proto_state = PS_UP;
+  p->p.core_state = FS_HAPPY;
+  p->p.export_state = ES_READY;
+  add_tail(&bb_protos, &p->p.n);
+
+  p->p.main_source = rt_get_source(&p->p, 0);
+  rt_lock_source(p->p.main_source);
+  p->p.main_ahook = proto_add_announce_hook(&p->p, p->p.table, &p->p.stats);
+
+  p->local_id = 1;
+  p->remote_id = 2 + i;
+  p->source_addr = bb_addr(1);
+  p->as4_session = 1;
+  p->neigh = &bb_neigh;
+  p->event = ev_new(p->p.pool);
+  p->event->hook = bb_nop;
+  p->ptx = bgp_new_pending_tx(p->p.pool);
+  p->feed_state = BFS_NONE;
+  p->load_state = BFS_NONE;
+
+  conn = p->conn = &p->outgoing_conn;
+  conn->bgp = p;
+  conn->sk = sk_new(p->p.pool);		/* Never opened */
+  conn->state = BS_ESTABLISHED;
+  conn->hold_timer = tm_new(p->p.pool);	/* Zero hold time, never started */
+  conn->keepalive_timer = tm_new(p->p.pool);
+  conn->tx_ev = ev_new(p->p.pool);
+  conn->tx_ev->hook = tx_data ? bb_tx : bb_nop;
+  conn->tx_ev->data = tx_data;
+
+  return p;
+}
+
+static int
+bb_rx(struct bgp_conn *conn, byte *pkt, uint len)
+{
+  clock_t t0 = clock();
+
+  bgp_rx_update(conn, pkt, len);
+  bb_rx_time += clock() - t0;
+
+  /* Errors leave the instance half stopped, do not run events then */
+  if (conn->state != BS_ESTABLISHED)
+    return 0;
+
+  if (!(++bb_rx_msgs % BB_BATCH))
+    bb_events();
+
+  return 1;
+}
+
+/* Find the UPDATE message in a BGP4MP record and switch @p to its AS number size */
+static byte *
+bb_bgp4mp(struct bgp_proto *p, uint type, uint subtype, byte *buf, uint len, uint *plen)
+{
+  uint as4, hl, al;
+
+  if (type == BGP4MP_ET)
+    {
+      if (len < 4)
+	return NULL;
+      buf += 4;
+      len -= 4;
+    }
+
+  if (subtype == BGP4MP_MESSAGE)
+    as4 = 0;
+  else if (subtype == BGP4MP_MESSAGE_AS4)
+    as4 = 1;
+  else
+    return NULL;
+
+  /* Peer and local AS, interface, address family */
+  hl = as4 ? 12 : 8;
+  if (len < hl)
+    return NULL;
+
+  switch (get_u16(buf + hl - 2))
+    {
+#ifndef IPV6
+    case BGP_AF_IPV4:	al = 4; break;
+#else
+    case BGP_AF_IPV6:	al = 16; break;
+#endif
+    default:		return NULL;
+    }
+
+  hl += 2 * al;
+  if (len < hl + BGP_HEADER_LENGTH)
+    return NULL;
+
+  buf += hl;
+  len -= hl;
+  if ((buf[18] != PKT_UPDATE) || (get_u16(buf + 16) != len) || (len > bgp_max_packet_length(p)))
+    return NULL;
+
+  p->as4_session = as4;
+  *plen = len;
+  return buf;
+}
+
+/* Build an UPDATE message from a TABLE_DUMP_V2 RIB entry, return its length or 0 */
+static uint
+bb_rib_entry(struct bgp_proto *p, byte *buf, byte *prefix, uint pxlen, byte *attrs, uint alen)
+{
+  byte *end = buf + bgp_max_packet_length(p);
+  byte *w = buf + BGP_HEADER_LENGTH;
+  uint bytes = (pxlen + 7) / 8;
+
+#ifndef IPV6
+  if (w + 4 + alen + 1 + bytes > end)
+    return 0;
+
+  put_u16(w, 0);
+  put_u16(w + 2, alen);
+  memcpy(w + 4, attrs, alen);
+  w += 4 + alen;
+#else
+  /* RIB entries have abbreviated MP_REACH_NLRI with just the next hop */
+  byte *a = w + 4, *nh = NULL;
+  uint i = 0, nhl = 0;
+
+  put_u16(w, 0);
+  w = a;
+
+  while (i < alen)
+    {
+      uint hl = (attrs[i] & BAF_EXT_LEN) ? 4 : 3;
+      uint l;
+
+      if (i + hl > alen)
+	return 0;
+
+      l = (hl == 4) ? get_u16(attrs + i + 2) : attrs[i + 2];
+      if (i + hl + l > alen)
+	return 0;
+
+      if (attrs[i + 1] == BA_MP_REACH_NLRI)
+	{
+	  if (!l || (attrs[i + hl] + 1u > l))
+	    return 0;
+
+	  nhl = attrs[i + hl];
+	  nh = attrs + i + hl + 1;
+	}
+      else
+	{
+	  if (w + hl + l > end)
+	    return 0;
+
+	  memcpy(w, attrs + i, hl + l);
+	  w += hl + l;
+	}
+
+      i += hl + l;
+    }
+
+  if (!nh || (w + 4 + 5 + nhl + 1 + bytes > end))
+    return 0;
+
+  *w++ = BAF_OPTIONAL | BAF_EXT_LEN;
+  *w++ = BA_MP_REACH_NLRI;
+  put_u16(w, 5 + nhl + 1 + bytes);
+  put_u16(w + 2, BGP_AF_IPV6);
+  w[4] = 1;
+  w[5] = nhl;
+  memcpy(w + 6, nh, nhl);
+  w += 6 + nhl;
+  *w++ = 0;
+#endif
+
+  *w++ = pxlen;
+  memcpy(w, prefix, bytes);
+  w += bytes;
+
+#ifdef IPV6
+  /* Attributes with the NLRI in MP_REACH_NLRI */
+  put_u16(a - 2, w - a);
+#endif
+
+  bgp_create_header(buf, w - buf, PKT_UPDATE);
+  return w - buf;
+}
+
+/* Pass UPDATEs from MRT file @name to @conn, return an error or NULL */
+static char *
+bb_mrt(struct bgp_conn *conn, char *name, uint *skipped)
+{
+  struct bgp_proto *p = conn->bgp;
+  uint size = 4096, len, pos, cnt, i;
+  byte hdr[MRTDUMP_HDR_LENGTH];
+  byte *buf, *pkt;
+  char *err = NULL;
+  FILE *f;
+
+  if (!(f = fopen(name, "r")))
+    return "Cannot open file";
+
+  buf = xmalloc(size);
+  while (!err && (fread(hdr, MRTDUMP_HDR_LENGTH, 1, f) == 1))
+    {
+      uint type = get_u16(hdr + 4);
+      uint subtype = get_u16(hdr + 6);
+      len = get_u32(hdr + 8);
+
+      if (len > BB_MAX_RECORD)
+	{
+	  err = "Record too long";
+	  break;
+	}
+
+      if (len > size)
+	{
+	  size = MAX(len, 2 * size);
+	  buf = xrealloc(buf, size);
+	}
+
+      if (len && (fread(buf, len, 1, f) != 1))
+	{
+	  err = "File truncated";
+	  break;
+	}
+
+      if ((type == BGP4MP) || (type == BGP4MP_ET))
+	{
+	  if (!(pkt = bb_bgp4mp(p, type, subtype, buf, len, &len)))
+	    (*skipped)++;
+	  else if (!bb_rx(conn, pkt, len))
+	    err = "Session closed";
+	}
+#ifndef IPV6
+      else if ((type == TABLE_DUMP_V2) && (subtype == RIB_IPV4_UNICAST))
+#else
+      else if ((type == TABLE_DUMP_V2) && (subtype == RIB_IPV6_UNICAST))
+#endif
+	{
+	  /* Sequence number, prefix, entry count */
+	  if ((len < 5) || (buf[4] > BITS_PER_IP_ADDRESS) ||
+	      (len < (pos = 5 + (buf[4] + 7) / 8) + 2))
+	    {
+	      (*skipped)++;
+	      continue;
+	    }
+
+	  cnt = get_u16(buf + pos);
+	  pos += 2;
+
+	  /* Attributes use 4B AS numbers */
+	  p->as4_session = 1;
+
+	  for (i = 0; !err && (i < cnt); i++)
+	    {
+	      uint alen, ulen;
+
+	      /* Peer index, originated time, attribute length */
+	      if ((pos + 8 > len) || (pos + 8 + (alen = get_u16(buf + pos + 6)) > len))
+		{
+		  *skipped += cnt - i;
+		  break;
+		}
+	      pos += 8;
+
+	      if (!(ulen = bb_rib_entry(p, bb_buf, buf + 5, buf[4], buf + pos, alen)))
+		(*skipped)++;
+	      else if (!bb_rx(conn, bb_buf, ulen))
+		err = "Session closed";
+
+	      pos += alen;
+	    }
+	}
+      else
+	(*skipped)++;
+    }
+
+  fclose(f);
+  xfree(buf);
+  return err;
+}
+
+#ifndef IPV6
+
+/* Announce or withdraw @num generated /24 prefixes, return 0 on error */
+static int
+bb_generate(struct bgp_conn *conn, uint num, int withdraw)
+{
+  struct bgp_proto *p = conn->bgp;
+  byte *w, *a;
+  uint i, j, cnt;
+
+  for (i = 0; i < num; i += cnt)
+    {
+      uint k = i / BB_PREFIXES % BB_PATHS;
+
+      cnt = MIN(BB_PREFIXES, num - i);
+      w = bb_buf + BGP_HEADER_LENGTH;
+
+      if (withdraw)
+	{
+	  put_u16(w, 4 * cnt);
+	  w += 2;
+	}
+      else
+	{
+	  put_u16(w, 0);
+	  w += 4;
+	  a = w;
+
+	  *w++ = BAF_TRANSITIVE;
+	  *w++ = BA_ORIGIN;
+	  *w++ = 1;
+	  *w++ = ORIGIN_IGP;
+
+	  *w++ = BAF_TRANSITIVE;
+	  *w++ = BA_AS_PATH;
+	  *w++ = 2 + 3 * 4;
+	  *w++ = AS_PATH_SEQUENCE;
+	  *w++ = 3;
+	  put_u32(w, p->remote_as);
+	  put_u32(w + 4, 64512 + k);
+	  put_u32(w + 8, 64 + k % 7);
+	  w += 12;
+
+	  *w++ = BAF_TRANSITIVE;
+	  *w++ = BA_NEXT_HOP;
+	  *w++ = 4;
+	  put_u32(w, ipa_to_u32(p->cf->remote_ip));
+	  w += 4;
+
+	  put_u16(a - 2, w - a);
+	}
+
+      /* Prefixes 16.0.0.0/24 and up */
+      for (j = 0; j < cnt; j++)
+	{
+	  *w++ = 24;
+	  put_u32(w, 0x10000000 + ((i + j) << 8));
+	  w += 3;
+	}
+
+      if (withdraw)
+	{
+	  put_u16(w, 0);
+	  w += 2;
+	}
+
+      bgp_create_header(bb_buf, w - bb_buf, PKT_UPDATE);
+      if (!bb_rx(conn, bb_buf, w - bb_buf))
+	return 0;
+    }
+
+  return 1;
+}
+
+#endif
+
+static int
+bb_check(struct bb_peer *peers, uint n, uint num, int withdraw)
+{
+  uint i, ok = 1;
+
+  for (i = 0; i < n; i++)
+    {
+      struct proto_stats *s = &peers[i].p->p.stats;
+      uint cnt = withdraw ? s->exp_withdraws_accepted : s->exp_updates_accepted;
+
+      if ((cnt != num) || !EMPTY_LIST(peers[i].p->ptx->bucket_queue))
+	{
+	  debug("  %s: %u of %u routes %s\n", peers[i].p->p.name, cnt, num,
+		withdraw ? "withdrawn" : "announced");
+	  ok = 0;
+	}
+    }
+
+  return ok;
+}
+
+static void
+bb_report(char *step, struct bgp_proto *src, struct bb_peer *peers, uint n)
+{
+  struct proto_stats *s = &src->p.stats;
+  uint rx_ms = bb_rx_time * 1000 / CLOCKS_PER_SEC;
+  uint tx_ms = bb_tx_time * 1000 / CLOCKS_PER_SEC;
+  uint routes = s->imp_updates_received + s->imp_withdraws_received;
+  uint msgs = 0, i;
+  u64 bytes = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      msgs += peers[i].msgs;
+      bytes += peers[i].bytes;
+    }
+
+  debug("%s: %u UPDATEs with %u routes in %u ms, %u networks\n", step,
+	bb_rx_msgs, routes, rx_ms, bb_table.fib.entries);
+  if (rx_ms)
+    debug("  import: %u UPDATEs/s, %u prefixes/s\n",
+	  (uint) ((u64) bb_rx_msgs * 1000 / rx_ms), (uint) ((u64) routes * 1000 / rx_ms));
+  debug("  export: %u UPDATEs (%u kB) to %u peers in %u ms\n",
+	msgs, (uint) (bytes >> 10), n, tx_ms);
+  if (tx_ms)
+    debug("  export: %u UPDATEs/s\n", (uint) ((u64) msgs * 1000 / tx_ms));
+  debug("  memory: %u kB\n", (uint) (rmemsize(&root_pool) >> 10));
+}
+
+int
+main(int argc, char **argv)
+{
+  struct bgp_proto *src;
+  struct bb_peer *peers;
+  uint n = 10, num = 500000, i;
+  uint skipped = 0;
+  int c, ok = 1;
+
+  while ((c = getopt(argc, argv, "p:n:")) >= 0)
+    switch (c)
+      {
+      case 'p':
+	n = atoi(optarg);
+	break;
+      case 'n':
+	num = MIN(atoi(optarg), 1 << 22);
+	break;
+      default:
+	fprintf(stderr, "Usage: %s [-p <peers>] [-n <prefixes>] [<mrt-file>]\n", argv[0]);
+	return 2;
+      }
+
+  log_init_debug("");
+  log_switch(1, NULL, NULL);
+  resource_init();
+  io_init();
+  rt_init();
+  if_init();
+  protos_build();
+  config = &bb_config;
+  bgp_linpool = lp_new(&root_pool, 4080);
+
+  bb_table_config.name = "bench";
+  bb_table_config.table = &bb_table;
+  bb_table_config.gc_max_ops = 1000;
+  bb_table_config.gc_min_time = 5;
+  rt_setup(&root_pool, &bb_table, "bench", &bb_table_config);
+
+  init_list(&bb_protos);
+  init_list(&bb_iface.addrs);
+  init_list(&bb_iface.neighbors);
+  strcpy(bb_iface.name, "bench0");
+  bb_iface.flags = IF_UP | IF_MULTIACCESS | IF_BROADCAST;
+  bb_iface.index = 1;
+  bb_iface.mtu = 1500;
+
+  peers = xmalloc(n * sizeof(struct bb_peer));
+  src = bb_new(0, NULL);
+  for (i = 0; i < n; i++)
+    {
+      peers[i].p = bb_new(1 + i, &peers[i]);
+      peers[i].msgs = peers[i].bytes = 0;
+    }
+
+  bb_neigh.addr = src->cf->remote_ip;
+  bb_neigh.iface = &bb_iface;
+  bb_neigh.proto = &src->p;
+  bb_neigh.scope = SCOPE_UNIVERSE;
+
+  debug("bgp-bench: %u peers, memory %u kB\n", n, (uint) (rmemsize(&root_pool) >> 10));
+
+  if (optind < argc)
+    {
+      char *err = bb_mrt(src->conn, argv[optind], &skipped);
+
+      if (err)
+	{
+	  debug("%s: %s\n", argv[optind], err);
+	  ok = 0;
+	}
+      else
+	bb_events();
+
+      debug("%s: %u records skipped\n", argv[optind], skipped);
+      bb_report("replay", src, peers, n);
+      return !ok;
+    }
+
+#ifndef IPV6
+  if (!bb_generate(src->conn, num, 0))
+    {
+      debug("announce: session closed\n");
+      return 1;
+    }
+
+  bb_events();
+  bb_report("announce", src, peers, n);
+  ok = (bb_table.fib.entries == num) && bb_check(peers, n, num, 0);
+
+  bb_rx_msgs = bb_rx_time = bb_tx_time = 0;
+  for (i = 0; i < n; i++)
+    peers[i].msgs = peers[i].bytes = 0;
+  src->p.stats.imp_updates_received = 0;
+
+  if (!bb_generate(src->conn, num, 1))
+    {
+      debug("withdraw: session closed\n");
+      return 1;
+    }
+
+  bb_events();
+  bb_report("withdraw", src, peers, n);
+  ok = ok && bb_check(peers, n, num, 1);
+
+  debug("%s\n", ok ? "OK" : "FAILED");
+  return !ok;
+#else
+  debug("MRT file needed\n");
+  return 2;
+#endif
+}
+
+#endif
@@ -0,0 +1,575 @@
+/*
+ *	BIRD -- Multi-Threaded Routing Toolkit (MRT) Table Dumps
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: MRT table dumps
+ *
+ * The MRT protocol periodically dumps a routing table to a file in the MRT
+ * TABLE_DUMP_V2 format [RFC6396], which is understood by common tools for
+ * offline analysis of routing tables. It neither imports nor exports any
+ * routes, it just reads its table when a dump is started by its timer.
+ *
+ * Each dump appends to a file named by expanding the configured template,
+ * so that every dump may go to a separate file. It starts with a
+ * PEER_INDEX_TABLE record listing all BGP neighbors, then the table is
+ * walked by a &fib_iterator from an event and one RIB record is written
+ * for each network, with an entry for each of its routes accepted by the
+ * filter. A route is assigned to the peer entry of its BGP protocol, routes
+ * of other protocols refer to the first, empty entry. Each run of the event
+ * processes at most %MRT_DUMP_STEPS routes, so a dump of a large table does
+ * not stall the main loop. Each record is built in a buffer and then passed
+ * to the &mrt_file, which writes it from another thread. When the writer
+ * falls behind, the dump waits a while before the next run.
+ */
+
+#undef LOCAL_DEBUG
+
+#include <time.h>
+
+#include "nest/bird.h"
+#include "nest/iface.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/cli.h"
+#include "conf/conf.h"
+#include "filter/filter.h"
+#include "lib/string.h"
+#include "lib/unaligned.h"
+
+#include "mrt.h"
+
+#ifdef CONFIG_BGP
+#include "proto/bgp/bgp.h"
+#endif
+
+#define PEER_KEY(n)		n->proto
+#define PEER_NEXT(n)		n->next
+#define PEER_EQ(p1,p2)		p1 == p2
+#define PEER_FN(p)		u32_hash((uintptr_t) p)
+
+#define PEER_REHASH		mrt_peer_rehash
+#define PEER_PARAMS		/8, *2, 2, 2, 8, 20
+
+HASH_DEFINE_REHASH_FN(PEER, struct mrt_peer)
+
+#define MRT_BUFFER_SIZE		65536	/* Initial size of the record buffer */
+
+/*
+ *	Record buffer
+ */
+
+static void
+mrt_buffer_grow(struct mrt_table_dump *d, uint len)
+{
+  uint used = d->pos - d->buf;
+  uint size = MAX(2 * (uint) (d->end - d->buf), used + len);
+
+  d->buf = mb_realloc(d->buf, size);
+  d->pos = d->buf + used;
+  d->end = d->buf + size;
+}
+
+static inline void
+mrt_buffer_need(struct mrt_table_dump *d, uint len)
+{
+  if (d->pos + len > d->end)
+    mrt_buffer_grow(d, len);
+}
+
+static inline byte *
+mrt_buffer_get(struct mrt_table_dump *d, uint len)
+{
+  mrt_buffer_need(d, len);
+  d->pos += len;
+  return d->pos - len;
+}
+
+static inline void mrt_put_u8(struct mrt_table_dump *d, u8 v)
+{ *mrt_buffer_get(d, 1) = v; }
+
+static inline void mrt_put_u16(struct mrt_table_dump *d, u16 v)
+{ put_u16(mrt_buffer_get(d, 2), v); }
+
+static inline void mrt_put_u32(struct mrt_table_dump *d, u32 v)
+{ put_u32(mrt_buffer_get(d, 4), v); }
+
+static inline void mrt_put_ipa(struct mrt_table_dump *d, ip_addr a)
+{ put_ipa(mrt_buffer_get(d, sizeof(ip_addr)), a); }
+
+static void
+mrt_init_message(struct mrt_table_dump *d, u16 type, u16 subtype)
+{
+  byte *h = mrt_buffer_get(d, MRTDUMP_HDR_LENGTH);
+
+  d->msg = h - d->buf;
+  put_u32(h+0, now_real);
+  put_u16(h+4, type);
+  put_u16(h+6, subtype);
+}
+
+static void
+mrt_end_message(struct mrt_table_dump *d)
+{
+  byte *h = d->buf + d->msg;
+
+  put_u32(h+8, d->pos - h - MRTDUMP_HDR_LENGTH);
+}
+
+static int
+mrt_flush(struct mrt_proto *p, struct mrt_table_dump *d)
+{
+  if ((d->pos > d->buf) && (mrt_file_write(d->file, d->buf, d->pos - d->buf) < 0))
+    {
+      log(L_ERR "%s: Dump aborted, buffer full", p->p.name);
+      return -1;
+    }
+
+  d->pos = d->buf;
+  return 0;
+}
+
+
+/*
+ *	Table dump
+ */
+
+static void
+mrt_peer_entry(struct mrt_table_dump *d, u32 id, u32 as, ip_addr ip)
+{
+#ifdef IPV6
+  mrt_put_u8(d, MRT_PEER_AS4 | MRT_PEER_IPV6);
+#else
+  mrt_put_u8(d, MRT_PEER_AS4);
+#endif
+  mrt_put_u32(d, id);
+  mrt_put_ipa(d, ip);
+  mrt_put_u32(d, as);
+}
+
+static void
+mrt_peer_table_dump(struct mrt_proto *p, struct mrt_table_dump *d)
+{
+  uint count = 1, pos;
+  uint len = strlen(d->table->name);
+
+  mrt_init_message(d, TABLE_DUMP_V2, PEER_INDEX_TABLE);
+  mrt_put_u32(d, proto_get_router_id(p->p.cf));
+  mrt_put_u16(d, len);
+  memcpy(mrt_buffer_get(d, len), d->table->name, len);
+  pos = d->pos - d->buf;
+  mrt_put_u16(d, 0);
+
+  /* Dummy peer for routes of other protocols */
+  mrt_peer_entry(d, 0, 0, IPA_NONE);
+
+#ifdef CONFIG_BGP
+  struct proto *P;
+  node *n;
+
+  WALK_LIST(n, proto_list)
+    {
+      P = SKIP_BACK(struct proto, glob_node, n);
+      if (P->proto != &proto_bgp)
+	continue;
+
+      if (count >= MRT_MAX_PEERS)
+      {
+	log(L_WARN "%s: Too many peers, some routes are dumped without peer", p->p.name);
+	break;
+      }
+
+      struct bgp_proto *bp = (struct bgp_proto *) P;
+      struct mrt_peer *peer = mb_alloc(d->pool, sizeof(struct mrt_peer));
+      peer->proto = P;
+      peer->index = count++;
+      HASH_INSERT2(d->peer_hash, PEER, d->pool, peer);
+
+      mrt_peer_entry(d, bp->remote_id, bp->remote_as, bp->cf->remote_ip);
+    }
+#endif
+
+  put_u16(d->buf + pos, count);
+  mrt_end_message(d);
+}
+
+static void
+mrt_rib_entry(struct mrt_table_dump *d, rte *e)
+{
+  struct mrt_peer *peer = HASH_FIND(d->peer_hash, PEER, e->attrs->src->proto);
+  uint pos;
+  int len = 0;
+
+  mrt_put_u16(d, peer ? peer->index : 0);
+  mrt_put_u32(d, now_real - (now - e->lastmod));
+  pos = d->pos - d->buf;
+  mrt_put_u16(d, 0);
+
+#ifdef CONFIG_BGP
+  uint room;
+  for (room = 1024; room <= 0x10000; room *= 2)
+    {
+      mrt_buffer_need(d, room);
+      if ((len = bgp_encode_mrt_attrs(d->pos, e->attrs->eattrs, MIN(room, 0xffff))) >= 0)
+	break;
+    }
+
+  if (len < 0)
+    len = 0;
+#endif
+
+  d->pos += len;
+  put_u16(d->buf + pos, len);
+}
+
+static uint
+mrt_rib_net(struct mrt_proto *p, struct mrt_table_dump *d, net *n)
+{
+  struct mrt_config *cf = (struct mrt_config *) p->p.cf;
+  uint count = 0, seen = 0, pos = 0;
+  rte *e, *ee;
+
+  for (e = n->routes; e; e = e->next)
+    {
+      seen++;
+      if (!rte_is_valid(e))
+	continue;
+
+      struct proto *src = e->attrs->src->proto;
+      ea_list *tmpa = src->make_tmp_attrs ? src->make_tmp_attrs(e, d->lp) : NULL;
+
+      ee = e;
+      if (f_run(cf->filter, &e, &tmpa, d->lp, FF_FORCE_TMPATTR) > F_ACCEPT)
+	goto skip;
+
+      if (!count)
+	{
+	  uint bytes = (n->n.pxlen + 7) / 8;
+	  byte px[sizeof(ip_addr)];
+
+#ifdef IPV6
+	  mrt_init_message(d, TABLE_DUMP_V2, RIB_IPV6_UNICAST);
+#else
+	  mrt_init_message(d, TABLE_DUMP_V2, RIB_IPV4_UNICAST);
+#endif
+	  mrt_put_u32(d, d->seqnum++);
+	  mrt_put_u8(d, n->n.pxlen);
+	  put_ipa(px, n->n.prefix);
+	  memcpy(mrt_buffer_get(d, bytes), px, bytes);
+	  pos = d->pos - d->buf;
+	  mrt_put_u16(d, 0);
+	}
+
+      if (count < 0xffff)
+	{
+	  mrt_rib_entry(d, e);
+	  count++;
+	}
+
+    skip:
+      if (e != ee)
+	{
+	  rte_free(e);
+	  e = ee;
+	}
+    }
+
+  if (count)
+    {
+      put_u16(d->buf + pos, count);
+      mrt_end_message(d);
+      d->net_count++;
+      d->route_count += count;
+    }
+
+  lp_flush(d->lp);
+  return seen;
+}
+
+static void
+mrt_dump_free(struct mrt_proto *p)
+{
+  struct mrt_table_dump *d = p->dump;
+
+  if (!d)
+    return;
+
+  /* Unlink the iterator if the walk was suspended */
+  if (d->walking)
+    fit_get(&d->table->fib, &d->fit);
+
+  ev_postpone(p->event);
+  rfree(d->pool);
+  p->dump = NULL;
+}
+
+static void
+mrt_dump_wait(timer *t)
+{
+  struct mrt_proto *p = t->data;
+
+  ev_schedule(p->event);
+}
+
+static void
+mrt_dump_cont(void *P)
+{
+  struct mrt_proto *p = P;
+  struct mrt_table_dump *d = p->dump;
+  int max = MRT_DUMP_STEPS;
+
+  /* Let the writer catch up */
+  if (mrt_file_busy(d->file))
+    {
+      tm_start(d->wait_timer, 1);
+      return;
+    }
+
+  d->walking = 0;
+  FIB_ITERATE_START(&d->table->fib, &d->fit, f)
+    {
+      if (max <= 0)
+	{
+	  FIB_ITERATE_PUT(&d->fit, f);
+	  d->walking = 1;
+	  ev_schedule(p->event);
+	  return;
+	}
+
+      max -= MAX(mrt_rib_net(p, d, (net *) f), 1);
+
+      if (mrt_flush(p, d) < 0)
+	{
+	  mrt_dump_free(p);
+	  return;
+	}
+    }
+  FIB_ITERATE_END(f);
+
+  p->last_dump = d->started;
+  p->last_nets = d->net_count;
+  p->last_routes = d->route_count;
+  TRACE(D_EVENTS, "Dumped %u routes for %u networks", d->route_count, d->net_count);
+
+  mrt_dump_free(p);
+}
+
+static int
+mrt_format_filename(struct mrt_proto *p, char *buf, uint size)
+{
+  struct mrt_config *cf = (struct mrt_config *) p->p.cf;
+  char fmt[size], *dst = fmt, *end = fmt + size - 1;
+  char *src = cf->filename;
+
+  /* Substitute table and protocol names, leave the rest to strftime() */
+  while (*src)
+    {
+      if ((src[0] == '%') && ((src[1] == 'N') || (src[1] == 'P')))
+	{
+	  char *name = (src[1] == 'N') ? p->p.table->name : p->p.name;
+	  uint len = strlen(name);
+
+	  if (dst + len > end)
+	    return 0;
+
+	  memcpy(dst, name, len);
+	  dst += len;
+	  src += 2;
+	  continue;
+	}
+
+      /* Do not break other conversions like %% */
+      if ((src[0] == '%') && src[1])
+	{
+	  if (dst + 1 > end)
+	    return 0;
+	  *dst++ = *src++;
+	}
+
+      if (dst + 1 > end)
+	return 0;
+      *dst++ = *src++;
+    }
+  *dst = 0;
+
+  time_t t = now_real;
+  struct tm tm;
+  localtime_r(&t, &tm);
+
+  return strftime(buf, size, fmt, &tm) > 0;
+}
+
+static void
+mrt_dump_start(struct mrt_proto *p)
+{
+  struct mrt_table_dump *d;
+  struct mrt_file *file;
+  char name[MRT_NAME_MAX];
+  pool *pp;
+
+  if (p->dump)
+    {
+      log(L_WARN "%s: Previous dump still in progress, skipping", p->p.name);
+      return;
+    }
+
+  if (!mrt_format_filename(p, name, sizeof(name)))
+    {
+      log(L_ERR "%s: File name too long", p->p.name);
+      return;
+    }
+
+  pp = rp_new(p->p.pool, "MRT dump");
+  if (!(file = mrt_file_open(pp, name, MRT_FILE_BUFFER, 0, 0)))
+    {
+      log(L_ERR "%s: Cannot open file %s: %m", p->p.name, name);
+      rfree(pp);
+      return;
+    }
+
+  TRACE(D_EVENTS, "Dumping table %s to %s", p->p.table->name, name);
+
+  d = p->dump = mb_allocz(pp, sizeof(struct mrt_table_dump));
+  d->pool = pp;
+  d->lp = lp_new(pp, 4080);
+  d->file = file;
+  d->wait_timer = tm_new_set(pp, mrt_dump_wait, p, 0, 0);
+  d->table = p->p.table;
+  d->started = now;
+  d->buf = d->pos = mb_alloc(pp, MRT_BUFFER_SIZE);
+  d->end = d->buf + MRT_BUFFER_SIZE;
+  HASH_INIT(d->peer_hash, pp, 8);
+
+  mrt_peer_table_dump(p, d);
+  if (mrt_flush(p, d) < 0)
+    {
+      mrt_dump_free(p);
+      return;
+    }
+
+  FIB_ITERATE_INIT(&d->fit, &d->table->fib);
+  d->walking = 1;
+  ev_schedule(p->event);
+}
+
+static void
+mrt_timer(timer *t)
+{
+  mrt_dump_start(t->data);
+}
+
+
+/*
+ *	Protocol glue
+ */
+
+static void
+mrt_postconfig(struct proto_config *C)
+{
+  struct mrt_config *cf = (struct mrt_config *) C;
+
+  if (!cf->filename)
+    cf_error("File name not specified");
+
+  if (!cf->period)
+    cf_error("Dump period not specified");
+}
+
+static struct proto *
+mrt_init(struct proto_config *C)
+{
+  return proto_new(C, sizeof(struct mrt_proto));
+}
+
+static int
+mrt_start(struct proto *P)
+{
+  struct mrt_proto *p = (struct mrt_proto *) P;
+  struct mrt_config *cf = (struct mrt_config *) P->cf;
+
+  p->dump = NULL;
+  p->last_dump = 0;
+  p->event = ev_new(P->pool);
+  p->event->hook = mrt_dump_cont;
+  p->event->data = p;
+  p->timer = tm_new_set(P->pool, mrt_timer, p, 0, cf->period);
+  tm_start(p->timer, cf->period);
+
+  return PS_UP;
+}
+
+static int
+mrt_shutdown(struct proto *P)
+{
+  struct mrt_proto *p = (struct mrt_proto *) P;
+
+  mrt_dump_free(p);
+  return PS_DOWN;
+}
+
+static int
+mrt_reconfigure(struct proto *P, struct proto_config *C)
+{
+  struct mrt_proto *p = (struct mrt_proto *) P;
+  struct mrt_config *old = (struct mrt_config *) P->cf;
+  struct mrt_config *new = (struct mrt_config *) C;
+
+  if (old->period != new->period)
+    {
+      p->timer->recurrent = new->period;
+      tm_start(p->timer, new->period);
+    }
+
+  /* A running dump continues with the old filter, which is equivalent */
+  return filter_same(old->filter, new->filter);
+}
+
+static void
+mrt_copy_config(struct proto_config *dest, struct proto_config *src)
+{
+  /* Just a shallow copy */
+  proto_copy_rest(dest, src, sizeof(struct mrt_config));
+}
+
+static void
+mrt_show_proto_info(struct proto *P)
+{
+  struct mrt_proto *p = (struct mrt_proto *) P;
+  struct mrt_config *cf = (struct mrt_config *) P->cf;
+  byte tbuf[TM_DATETIME_BUFFER_SIZE];
+
+  cli_msg(-1006, "  Table:          %s", P->table->name);
+  cli_msg(-1006, "  Filter:         %s", filter_name(cf->filter));
+  cli_msg(-1006, "  File name:      %s", cf->filename);
+  cli_msg(-1006, "  Period:         %u", cf->period);
+
+  if (P->proto_state != PS_UP)
+    return;
+
+  if (p->last_dump)
+    {
+      tm_format_datetime(tbuf, &config->tf_proto, p->last_dump);
+      cli_msg(-1006, "  Last dump:      %s, %u routes for %u networks",
+	      tbuf, p->last_routes, p->last_nets);
+    }
+
+  if (p->dump)
+    cli_msg(-1006, "  Dump running:   %u routes for %u networks so far",
+	    p->dump->route_count, p->dump->net_count);
+}
+
+
+struct protocol proto_mrt = {
+  .name =		"MRT",
+  .template =		"mrt%d",
+  .config_size =	sizeof(struct mrt_config),
+  .postconfig =		mrt_postconfig,
+  .init =		mrt_init,
+  .start =		mrt_start,
+  .shutdown =		mrt_shutdown,
+  .reconfigure =	mrt_reconfigure,
+  .copy_config =	mrt_copy_config,
+  .show_proto_info =	mrt_show_proto_info
+};
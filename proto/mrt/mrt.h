@@ -0,0 +1,62 @@
+/*
+ *	BIRD -- Multi-Threaded Routing Toolkit (MRT) Table Dumps
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+#ifndef _BIRD_MRT_H_
+#define _BIRD_MRT_H_
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "nest/route.h"
+#include "nest/mrtdump.h"
+#include "lib/hash.h"
+#include "lib/timer.h"
+
+struct mrt_config {
+  struct proto_config c;
+  struct filter *filter;		/* Which routes are dumped */
+  char *filename;			/* File name, with strftime() and %N, %P expansion */
+  unsigned period;			/* Time between dumps */
+};
+
+struct mrt_peer {
+  struct mrt_peer *next;		/* Next in peer_hash */
+  struct proto *proto;			/* Source of routes */
+  u32 index;				/* Index in PEER_INDEX_TABLE */
+};
+
+struct mrt_table_dump {
+  pool *pool;
+  linpool *lp;				/* For filtering, flushed after each network */
+  struct mrt_file *file;
+  timer *wait_timer;			/* Waiting for the writer */
+  rtable *table;
+  struct fib_iterator fit;
+  HASH(struct mrt_peer) peer_hash;
+  byte *buf, *pos, *end;		/* Buffer for records not written yet */
+  uint msg;				/* Offset of the record being built */
+  u8 walking;				/* Iterator is linked to the table */
+  u32 seqnum;				/* Number of RIB records */
+  u32 net_count, route_count;
+  bird_clock_t started;
+};
+
+struct mrt_proto {
+  struct proto p;
+  timer *timer;
+  event *event;
+  struct mrt_table_dump *dump;		/* Dump in progress, or NULL */
+  bird_clock_t last_dump;		/* When the last finished dump was started */
+  u32 last_nets, last_routes;		/* Size of the last finished dump */
+};
+
+#define MRT_DUMP_STEPS	4096		/* Routes processed in one event */
+#define MRT_MAX_PEERS	0xffff
+
+/* Peer types in PEER_INDEX_TABLE */
+#define MRT_PEER_IPV6	1
+#define MRT_PEER_AS4	2
+
+#endif
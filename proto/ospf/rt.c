@@ -1385,16 +1385,14 @@ ospf_rt_abr2(struct ospf_proto *p)
 static void *
 ospf_fib_route(struct fib *f, ip_addr a, int len)
 {
-  ip_addr a0;
   ort *nf;
 
   while (len >= 0)
   {
-    a0 = ipa_and(a, ipa_mkmask(len));
-    nf = fib_find(f, &a0, len);
-    if (nf && nf->n.type)
+    nf = fib_route(f, a, len);
+    if (!nf || nf->n.type)
       return nf;
-    len--;
+    len = nf->fn.pxlen - 1;
   }
   return NULL;
 }
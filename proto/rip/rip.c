@@ -1110,6 +1110,7 @@ rip_start(struct proto *P)
   init_list(&p->iface_list);
   fib_init(&p->rtable, P->pool, sizeof(struct rip_entry), 0, rip_init_entry);
   p->rte_slab = sl_new(P->pool, sizeof(struct rip_rte));
+  sl_set_name(p->rte_slab, "RIP routes");
   p->timer = tm_new_set(P->pool, rip_timer, p, 0, 0);
 
   p->ecmp = cf->ecmp;
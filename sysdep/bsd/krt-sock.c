@@ -298,6 +298,7 @@ krt_send_route(struct krt_proto *p, int cmd, rte *e)
   l = body - (char *)&msg;
   msg.rtm.rtm_msglen = l;
 
+  p->stats.messages++;
   if ((l = write(p->sys.sk->fd, (char *)&msg, l)) < 0) {
     log(L_ERR "KRT: Error sending route %I/%d to kernel: %m", net->n.prefix, net->n.pxlen);
     return -1;
@@ -312,6 +313,8 @@ krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old,
 {
   int err = 0;
 
+  p->stats.updates++;
+
   if (old)
     krt_send_route(p, RTM_DELETE, old);
 
@@ -880,10 +883,21 @@ krt_sysctl_scan(struct proto *p, int cmd, int table_id)
 #endif
 }
 
+/*
+ * The sysctl interface returns the whole table at once, so the dump is
+ * processed in one step, only the prune phase of the scan is incremental.
+ */
+
 void
-krt_do_scan(struct krt_proto *p)
+krt_do_scan_start(struct krt_proto *p UNUSED)
+{
+}
+
+int
+krt_do_scan(struct krt_proto *p, uint limit UNUSED)
 {
   krt_sysctl_scan(&p->p, NET_RT_DUMP, KRT_CF->sys.table_id);
+  return 1;
 }
 
 void
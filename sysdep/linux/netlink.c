@@ -11,6 +11,7 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <poll.h>
 #include <errno.h>
 
 #undef LOCAL_DEBUG
@@ -20,6 +21,7 @@
 #include "nest/protocol.h"
 #include "nest/iface.h"
 #include "lib/alloca.h"
+#include "lib/event.h"
 #include "lib/timer.h"
 #include "lib/unix.h"
 #include "lib/krt.h"
@@ -63,6 +65,7 @@ struct nl_sock
 #define NL_RX_SIZE 8192
 
 static struct nl_sock nl_scan = {.fd = -1};	/* Netlink socket for synchronous scan */
+static struct nl_sock nl_dump = {.fd = -1};	/* Netlink socket for route table dumps */
 static struct nl_sock nl_req  = {.fd = -1};	/* Netlink socket for requests */
 
 static void
@@ -84,6 +87,7 @@ static void
 nl_open(void)
 {
   nl_open_sock(&nl_scan);
+  nl_open_sock(&nl_dump);
   nl_open_sock(&nl_req);
 }
 
@@ -102,7 +106,7 @@ nl_send(struct nl_sock *nl, struct nlmsghdr *nh)
 }
 
 static void
-nl_request_dump(int af, int cmd)
+nl_request_dump(struct nl_sock *nl, int af, int cmd)
 {
   struct {
     struct nlmsghdr nh;
@@ -113,7 +117,7 @@ nl_request_dump(int af, int cmd)
     .nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
     .g.rtgen_family = af
   };
-  nl_send(&nl_scan, &req.nh);
+  nl_send(nl, &req.nh);
 }
 
 static struct nlmsghdr *
@@ -183,9 +187,9 @@ nl_error(struct nlmsghdr *h)
 }
 
 static struct nlmsghdr *
-nl_get_scan(void)
+nl_get_scan(struct nl_sock *nl)
 {
-  struct nlmsghdr *h = nl_get_reply(&nl_scan);
+  struct nlmsghdr *h = nl_get_reply(nl);
 
   if (h->nlmsg_type == NLMSG_DONE)
     return NULL;
@@ -197,20 +201,237 @@ nl_get_scan(void)
   return h;
 }
 
+
+/*
+ *	Pipelined route requests
+ *
+ *	Route updates are not sent one by one with waiting for each ACK.
+ *	Instead, requests are appended to a TX buffer, which is sent as one
+ *	message from an event (or when it is full) and the ACKs are matched
+ *	with the queued requests by sequence number as they arrive on the
+ *	request socket. The number of requests in flight is limited, both
+ *	to keep kernel replies fit into the socket buffer and to keep error
+ *	reports timely. Before a kernel scan and on protocol shutdown we
+ *	wait for all outstanding ACKs.
+ */
+
+#define NL_TX_SIZE 65536
+#define NL_MAX_REQS 256
+
+struct nl_route_req
+{
+  u32 seq;
+  struct krt_proto *p;
+  ip_addr prefix;
+  byte pxlen;
+  byte new;
+};
+
+static sock *nl_req_sk;			/* BIRD socket for ACKs of route requests */
+static event *nl_tx_event;		/* Event sending queued requests */
+static byte *nl_tx_buffer;
+static uint nl_tx_len;
+static struct nl_route_req nl_reqs[NL_MAX_REQS]; /* Queue of unacknowledged requests */
+static uint nl_reqs_first, nl_reqs_num;
+
+static void
+nl_req_done(struct nl_route_req *rq, int err)
+{
+  /* Errors of route deletes are ignored, as before */
+  if (!rq->new)
+    return;
+
+  net *n = net_find(rq->p->p.table, rq->prefix, rq->pxlen);
+  if (!n)
+    return;
+
+  if (err)
+    n->n.flags |= KRF_SYNC_ERROR;
+  else
+    n->n.flags &= ~KRF_SYNC_ERROR;
+}
+
+static void
+nl_req_drop_all(void)
+{
+  for (; nl_reqs_num; nl_reqs_num--, nl_reqs_first = (nl_reqs_first + 1) % NL_MAX_REQS)
+    nl_req_done(&nl_reqs[nl_reqs_first], ENOBUFS);
+}
+
+static void
+nl_req_ack(struct nlmsghdr *h)
+{
+  if (h->nlmsg_type != NLMSG_ERROR)
+    {
+      log(L_WARN "Netlink: Unexpected reply received");
+      return;
+    }
+
+  while (nl_reqs_num)
+    {
+      struct nl_route_req *rq = &nl_reqs[nl_reqs_first];
+      nl_reqs_first = (nl_reqs_first + 1) % NL_MAX_REQS;
+      nl_reqs_num--;
+
+      if (rq->seq == h->nlmsg_seq)
+	{
+	  nl_req_done(rq, nl_error(h));
+	  return;
+	}
+
+      log(L_WARN "Netlink: Missing ACK for request %u", rq->seq);
+      nl_req_done(rq, ENOBUFS);
+    }
+
+  log(L_WARN "Netlink: Ignoring ACK for unknown request %u", h->nlmsg_seq);
+}
+
+/* Process received ACKs, returns 0 when there is nothing more to read */
 static int
-nl_exchange(struct nlmsghdr *pkt)
+nl_req_receive(int wait)
 {
+  struct iovec iov = { nl_req.rx_buffer, NL_RX_SIZE };
+  struct sockaddr_nl sa;
+  struct msghdr m = {
+    .msg_name = &sa,
+    .msg_namelen = sizeof(sa),
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
   struct nlmsghdr *h;
+  int x;
+  uint len;
 
-  nl_send(&nl_req, pkt);
-  for(;;)
+  if (wait)
     {
-      h = nl_get_reply(&nl_req);
-      if (h->nlmsg_type == NLMSG_ERROR)
-	break;
-      log(L_WARN "nl_exchange: Unexpected reply received");
+      struct pollfd pfd = { .fd = nl_req.fd, .events = POLLIN };
+      if ((poll(&pfd, 1, -1) < 0) && (errno != EINTR))
+	die("Netlink poll: %m");
     }
-  return nl_error(h) ? -1 : 0;
+
+  x = recvmsg(nl_req.fd, &m, 0);
+  if (x < 0)
+    {
+      if (errno == ENOBUFS)
+	{
+	  /* Some ACKs were lost, we do not know which requests failed */
+	  log(L_WARN "Netlink: Lost ACKs for route requests");
+	  nl_req_drop_all();
+	  return 1;
+	}
+      if ((errno != EAGAIN) && (errno != EINTR))
+	log(L_ERR "Netlink recvmsg: %m");
+      return 0;
+    }
+
+  if (sa.nl_pid)		/* It isn't from the kernel */
+    return 1;
+
+  if (m.msg_flags & MSG_TRUNC)
+    log(L_WARN "Netlink: Got truncated ACK");
+
+  h = (void *) nl_req.rx_buffer;
+  len = x;
+  for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len))
+    nl_req_ack(h);
+
+  return 1;
+}
+
+static int
+nl_req_hook(sock *sk UNUSED, int size UNUSED)
+{
+  return nl_req_receive(0);
+}
+
+static void
+nl_req_err_hook(sock *sk UNUSED, int e)
+{
+  /* Overrun is reported by POLLERR, SO_ERROR read by sk_err() clears it */
+  if (e == ENOBUFS)
+    {
+      log(L_WARN "Netlink: Lost ACKs for route requests");
+      nl_req_drop_all();
+    }
+}
+
+static void
+nl_req_send(void *data UNUSED)
+{
+  struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+  if (!nl_tx_len)
+    return;
+
+  if (sendto(nl_req.fd, nl_tx_buffer, nl_tx_len, 0, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+    die("rtnetlink sendto: %m");
+
+  nl_tx_len = 0;
+}
+
+/* Send queued requests and wait until at most @max remain unacknowledged */
+static void
+nl_req_wait(uint max)
+{
+  nl_req_send(NULL);
+
+  while (nl_reqs_num > max)
+    nl_req_receive(1);
+}
+
+static void
+nl_req_queue(struct krt_proto *p, net *n, struct nlmsghdr *h, int new)
+{
+  if (nl_reqs_num == NL_MAX_REQS)
+    nl_req_wait(NL_MAX_REQS - 1);
+
+  if (nl_tx_len + h->nlmsg_len > NL_TX_SIZE)
+    nl_req_send(NULL);
+
+  h->nlmsg_pid = 0;
+  h->nlmsg_seq = ++nl_req.seq;
+  memcpy(nl_tx_buffer + nl_tx_len, h, h->nlmsg_len);
+  nl_tx_len += NLMSG_ALIGN(h->nlmsg_len);
+  p->stats.messages++;
+
+  struct nl_route_req *rq = &nl_reqs[(nl_reqs_first + nl_reqs_num) % NL_MAX_REQS];
+  nl_reqs_num++;
+
+  *rq = (struct nl_route_req) {
+    .seq = h->nlmsg_seq,
+    .p = p,
+    .prefix = n->n.prefix,
+    .pxlen = n->n.pxlen,
+    .new = new
+  };
+
+  ev_schedule(nl_tx_event);
+}
+
+static void
+nl_open_req(void)
+{
+  sock *sk;
+  int rcvbuf = NL_MAX_REQS * NL_RX_SIZE / 8;
+
+  if (nl_req_sk)
+    return;
+
+  /* Make some room for the ACKs, errors contain the original request */
+  if (setsockopt(nl_req.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+    log(L_WARN "Netlink: Cannot set receive buffer size: %m");
+
+  nl_tx_buffer = xmalloc(NL_TX_SIZE);
+  nl_tx_event = ev_new(krt_pool);
+  nl_tx_event->hook = nl_req_send;
+
+  sk = nl_req_sk = sk_new(krt_pool);
+  sk->type = SK_MAGIC;
+  sk->rx_hook = nl_req_hook;
+  sk->err_hook = nl_req_err_hook;
+  sk->fd = nl_req.fd;
+  if (sk_open(sk) < 0)
+    bug("Netlink: sk_open failed");
 }
 
 /*
@@ -734,15 +955,15 @@ kif_do_scan(struct kif_proto *p UNUSED)
 
   if_start_update();
 
-  nl_request_dump(AF_UNSPEC, RTM_GETLINK);
-  while (h = nl_get_scan())
+  nl_request_dump(&nl_scan, AF_UNSPEC, RTM_GETLINK);
+  while (h = nl_get_scan(&nl_scan))
     if (h->nlmsg_type == RTM_NEWLINK || h->nlmsg_type == RTM_DELLINK)
       nl_parse_link(h, 1);
     else
       log(L_DEBUG "nl_scan_ifaces: Unknown packet received (type=%d)", h->nlmsg_type);
 
-  nl_request_dump(BIRD_AF, RTM_GETADDR);
-  while (h = nl_get_scan())
+  nl_request_dump(&nl_scan, BIRD_AF, RTM_GETADDR);
+  while (h = nl_get_scan(&nl_scan))
     if (h->nlmsg_type == RTM_NEWADDR || h->nlmsg_type == RTM_DELADDR)
       nl_parse_addr(h, 1);
     else
@@ -807,8 +1028,12 @@ nh_bufsize(struct mpnh *nh)
   return rv;
 }
 
-static int
-nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int new)
+#define NL_OP_DELETE	0
+#define NL_OP_ADD	1
+#define NL_OP_REPLACE	2
+
+static void
+nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int op)
 {
   eattr *ea;
   net *net = e->net;
@@ -819,13 +1044,15 @@ nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int new)
     char buf[128 + KRT_METRICS_MAX*8 + nh_bufsize(a->nexthops)];
   } r;
 
-  DBG("nl_send_route(%I/%d,new=%d)\n", net->n.prefix, net->n.pxlen, new);
+  DBG("nl_send_route(%I/%d,op=%d)\n", net->n.prefix, net->n.pxlen, op);
 
   bzero(&r.h, sizeof(r.h));
   bzero(&r.r, sizeof(r.r));
-  r.h.nlmsg_type = new ? RTM_NEWROUTE : RTM_DELROUTE;
+  r.h.nlmsg_type = op ? RTM_NEWROUTE : RTM_DELROUTE;
   r.h.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
-  r.h.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | (new ? NLM_F_CREATE|NLM_F_EXCL : 0);
+  r.h.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK |
+    ((op == NL_OP_ADD) ? NLM_F_CREATE|NLM_F_EXCL : 0) |
+    ((op == NL_OP_REPLACE) ? NLM_F_CREATE|NLM_F_REPLACE : 0);
 
   r.r.rtm_family = BIRD_AF;
   r.r.rtm_dst_len = net->n.pxlen;
@@ -839,8 +1066,11 @@ nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int new)
     nl_add_attr_u32(&r.h, sizeof(r), RTA_TABLE, krt_table_id(p));
 
   /* For route delete, we do not specify route attributes */
-  if (!new)
-    return nl_exchange(&r.h);
+  if (op == NL_OP_DELETE)
+  {
+    nl_req_queue(p, net, &r.h, 0);
+    return;
+  }
 
 
   if (ea = ea_find(eattrs, EA_KRT_METRIC))
@@ -898,13 +1128,58 @@ nl_send_route(struct krt_proto *p, rte *e, struct ea_list *eattrs, int new)
       bug("krt_capable inconsistent with nl_send_route");
     }
 
-  return nl_exchange(&r.h);
+  nl_req_queue(p, net, &r.h, 1);
+}
+
+/*
+ * A route may be replaced in place by NLM_F_REPLACE if its kernel key
+ * (prefix, table and metric) does not change, otherwise the kernel adds
+ * another route. Prefix and table are given. The metric of routes found
+ * by the kernel scan is in u.krt. For exported routes, it comes from
+ * export filter temporary attributes, which we do not have for the old
+ * route, so we just remember in KRF_METRIC whether it was zero. Multipath
+ * IPv6 routes are always deleted and added, as older kernels append next
+ * hops on replace.
+ */
+static int
+nl_allow_replace(struct krt_proto *p, net *n, rte *old, rte *new, struct ea_list *eattrs)
+{
+  u32 metric = ea_get_int(eattrs, EA_KRT_METRIC, 0);
+
+  if (old->attrs->src->proto == &p->p)
+  {
+    if (old->u.krt.metric != metric)
+      return 0;
+  }
+  else if (metric || (n->n.flags & KRF_METRIC))
+    return 0;
+
+#ifdef IPV6
+  if ((old->attrs->dest == RTD_MULTIPATH) || (new->attrs->dest == RTD_MULTIPATH))
+    return 0;
+#endif
+
+  return 1;
 }
 
 void
 krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old, struct ea_list *eattrs)
 {
-  int err = 0;
+  int replace = old && new && nl_allow_replace(p, n, old, new, eattrs);
+
+  p->stats.updates++;
+
+  if (new && ea_get_int(eattrs, EA_KRT_METRIC, 0))
+    n->n.flags |= KRF_METRIC;
+  else
+    n->n.flags &= ~KRF_METRIC;
+
+  if (replace)
+  {
+    p->stats.replaced++;
+    nl_send_route(p, new, eattrs, NL_OP_REPLACE);
+    return;
+  }
 
   /*
    * NULL for eattr of the old route is a little hack, but we don't
@@ -914,13 +1189,11 @@ krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old, struct ea_list
    */
 
   if (old)
-    nl_send_route(p, old, NULL, 0);
+    nl_send_route(p, old, NULL, NL_OP_DELETE);
 
+  /* KRF_SYNC_ERROR for new routes is updated when the ACK arrives */
   if (new)
-    err = nl_send_route(p, new, eattrs, 1);
-
-  if (err < 0)
-    n->n.flags |= KRF_SYNC_ERROR;
+    nl_send_route(p, new, eattrs, NL_OP_ADD);
   else
     n->n.flags &= ~KRF_SYNC_ERROR;
 }
@@ -1184,17 +1457,48 @@ nl_parse_route(struct nlmsghdr *h, int scan)
     krt_got_route_async(p, e, new);
 }
 
+/*
+ *	The route table dump is read in steps, the kernel keeps its position
+ *	in the dump socket. Only one dump may run on a socket, so an unfinished
+ *	one (from a stopped protocol) is drained before starting another.
+ */
+
+static int nl_dump_running;		/* Route dump on nl_dump is not finished */
+
 void
-krt_do_scan(struct krt_proto *p UNUSED)	/* CONFIG_ALL_TABLES_AT_ONCE => p is NULL */
+krt_do_scan_start(struct krt_proto *p UNUSED)	/* CONFIG_ALL_TABLES_AT_ONCE => p is NULL */
+{
+  if (nl_dump_running)
+    while (nl_get_scan(&nl_dump))
+      ;
+
+  /* Scan should see our pending changes and their errors */
+  nl_req_wait(0);
+
+  nl_request_dump(&nl_dump, BIRD_AF, RTM_GETROUTE);
+  nl_dump_running = 1;
+}
+
+int
+krt_do_scan(struct krt_proto *p UNUSED, uint limit)
 {
   struct nlmsghdr *h;
 
-  nl_request_dump(BIRD_AF, RTM_GETROUTE);
-  while (h = nl_get_scan())
-    if (h->nlmsg_type == RTM_NEWROUTE || h->nlmsg_type == RTM_DELROUTE)
-      nl_parse_route(h, 1);
-    else
-      log(L_DEBUG "nl_scan_fire: Unknown packet received (type=%d)", h->nlmsg_type);
+  for (; limit; limit--)
+    {
+      if (!(h = nl_get_scan(&nl_dump)))
+	{
+	  nl_dump_running = 0;
+	  return 1;
+	}
+
+      if (h->nlmsg_type == RTM_NEWROUTE || h->nlmsg_type == RTM_DELROUTE)
+	nl_parse_route(h, 1);
+      else
+	log(L_DEBUG "nl_scan_fire: Unknown packet received (type=%d)", h->nlmsg_type);
+    }
+
+  return 0;
 }
 
 /*
@@ -1253,9 +1557,9 @@ nl_async_hook(sock *sk, int size UNUSED)
 	{
 	  /*
 	   *  Netlink reports some packets have been thrown away.
-	   *  One day we might react to it by asking for route table
-	   *  scan in near future.
+	   *  We do not know which, so kernel tables are scanned.
 	   */
+	  krt_request_scan();
 	  return 1;	/* More data are likely to be ready */
 	}
       else if (errno != EWOULDBLOCK)
@@ -1284,6 +1588,14 @@ nl_async_hook(sock *sk, int size UNUSED)
   return 1;
 }
 
+static void
+nl_async_err_hook(sock *sk UNUSED, int e)
+{
+  /* Overrun is reported by POLLERR, SO_ERROR read by sk_err() clears it */
+  if (e == ENOBUFS)
+    krt_request_scan();
+}
+
 static void
 nl_open_async(void)
 {
@@ -1322,6 +1634,7 @@ nl_open_async(void)
   sk = nl_async_sk = sk_new(krt_pool);
   sk->type = SK_MAGIC;
   sk->rx_hook = nl_async_hook;
+  sk->err_hook = nl_async_err_hook;
   sk->fd = fd;
   if (sk_open(sk) < 0)
     bug("Netlink: sk_open failed");
@@ -1354,6 +1667,7 @@ krt_sys_start(struct krt_proto *p)
 
   nl_open();
   nl_open_async();
+  nl_open_req();
 
   return 1;
 }
@@ -1361,6 +1675,9 @@ krt_sys_start(struct krt_proto *p)
 void
 krt_sys_shutdown(struct krt_proto *p)
 {
+  /* Queued requests refer to the protocol */
+  nl_req_wait(0);
+
   HASH_REMOVE2(nl_table_map, RTH, krt_pool, p);
 }
 
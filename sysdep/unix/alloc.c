@@ -0,0 +1,346 @@
+/*
+ *	BIRD Internet Routing Daemon -- Page Allocator
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Page allocator
+ *
+ * When BIRD is configured with slab arenas, Slabs do not get their blocks
+ * from malloc(), but from alloc_page(), which carves fixed-size pages of
+ * %ARENA_PAGE_SIZE bytes from large arenas mapped by mmap(). The arenas
+ * are aligned to their size, which is the size of a huge page on common
+ * platforms, and the kernel is advised to back them by transparent huge
+ * pages where it is able to. Millions of small objects like routes, route
+ * attributes and FIB nodes then occupy a small number of TLB entries, and
+ * churn cannot fragment the malloc() heap with them.
+ *
+ * The first page of each arena holds its header. Arenas with free pages
+ * are kept on a list and allocation takes a page from the first of them,
+ * preferring pages freed before to pages never touched yet. When all
+ * pages of an arena are free, it is unmapped and its memory is returned
+ * to the system, except for one arena which is kept to absorb
+ * allocation and freeing around the boundary.
+ */
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "nest/bird.h"
+#include "lib/resource.h"
+
+#ifdef USE_SLAB_ARENAS
+
+#define ARENA_SIZE	(2 << 20)
+#define ARENA_PAGES	(ARENA_SIZE / ARENA_PAGE_SIZE)
+#define MAX_EMPTY_ARENAS 1
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+struct arena {
+  node n;				/* In free_arenas or full_arenas */
+  struct arena_page *first_free;	/* Free list of pages freed before */
+  uint next_unused;			/* Pages above were never used */
+  uint used;				/* Number of allocated pages */
+};
+
+struct arena_page {
+  struct arena_page *next;
+};
+
+static list free_arenas;		/* Arenas with some free pages */
+static list full_arenas;		/* Arenas with all pages allocated */
+static uint num_arenas, num_empty_arenas;
+static int arenas_initialized;
+
+#ifdef USE_PTHREADS
+
+#include <pthread.h>
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static inline void arena_lock(void) { pthread_mutex_lock(&arena_mutex); }
+static inline void arena_unlock(void) { pthread_mutex_unlock(&arena_mutex); }
+
+#else
+
+static inline void arena_lock(void) { }
+static inline void arena_unlock(void) { }
+
+#endif
+
+static inline struct arena *
+arena_of(void *page)
+{
+  return (struct arena *) ((uintptr_t) page & ~((uintptr_t) ARENA_SIZE - 1));
+}
+
+static struct arena *
+arena_new(void)
+{
+  /* Map twice the size and trim it to get an aligned arena */
+  byte *m = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m == MAP_FAILED)
+    die("Unable to map %d bytes of memory: %m", 2 * ARENA_SIZE);
+
+  byte *a = (byte *) BIRD_ALIGN((uintptr_t) m, ARENA_SIZE);
+  if (a > m)
+    munmap(m, a - m);
+  munmap(a + ARENA_SIZE, (m + ARENA_SIZE) - a);
+
+#ifdef MADV_HUGEPAGE
+  /* Just a hint, the kernel may not support it */
+  madvise(a, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+
+  struct arena *ar = (struct arena *) a;
+  ar->first_free = NULL;
+  ar->next_unused = 1;			/* The first page is the header */
+  ar->used = 0;
+  num_arenas++;
+  return ar;
+}
+
+/**
+ * alloc_page - allocate a page
+ *
+ * This function returns a new page of %ARENA_PAGE_SIZE bytes aligned to
+ * its size. It is used by Slabs for their blocks.
+ */
+void *
+alloc_page(void)
+{
+  struct arena *ar;
+  void *p;
+
+  arena_lock();
+  if (!arenas_initialized)
+    {
+      init_list(&free_arenas);
+      init_list(&full_arenas);
+      arenas_initialized = 1;
+    }
+
+  ar = HEAD(free_arenas);
+  if (!ar->n.next)
+    {
+      ar = arena_new();
+      add_tail(&free_arenas, &ar->n);
+    }
+  else if (!ar->used)
+    num_empty_arenas--;
+
+  if (ar->first_free)
+    {
+      p = ar->first_free;
+      ar->first_free = ar->first_free->next;
+    }
+  else
+    p = (byte *) ar + ar->next_unused++ * ARENA_PAGE_SIZE;
+
+  if (++ar->used == ARENA_PAGES - 1)
+    {
+      rem_node(&ar->n);
+      add_tail(&full_arenas, &ar->n);
+    }
+  arena_unlock();
+
+  return p;
+}
+
+/**
+ * free_page - free a page
+ * @page: page returned by alloc_page()
+ *
+ * This function returns the page back to its arena. If the arena becomes
+ * empty, it may be returned to the system.
+ */
+void
+free_page(void *page)
+{
+  struct arena *ar = arena_of(page);
+  struct arena_page *p = page;
+
+  arena_lock();
+  if (ar->used == ARENA_PAGES - 1)
+    {
+      /*
+       * Arenas are allocated from the head of the list, so the ones used
+       * for long stay full and the ones which just got some free space
+       * have a chance to drain and be returned to the system.
+       */
+      rem_node(&ar->n);
+      add_tail(&free_arenas, &ar->n);
+    }
+
+  p->next = ar->first_free;
+  ar->first_free = p;
+
+  if (!--ar->used)
+    {
+      if (num_empty_arenas >= MAX_EMPTY_ARENAS)
+	{
+	  rem_node(&ar->n);
+	  munmap(ar, ARENA_SIZE);
+	  num_arenas--;
+	}
+      else
+	{
+	  /* Keep it, but allocate from partially used arenas first */
+	  rem_node(&ar->n);
+	  add_tail(&free_arenas, &ar->n);
+	  num_empty_arenas++;
+	}
+    }
+  arena_unlock();
+}
+
+#endif
+
+
+#ifdef TEST
+
+/*
+ * Memory benchmark: objects of the sizes of FIB nodes, routes and route
+ * attributes are allocated from Slabs like for a full table, then a random
+ * half of them is freed and allocated again a few times, then they are
+ * read in random order and finally all of them are freed. Build it with and
+ * without slab arenas to compare the times and the resident memory.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nest/route.h"
+#include "lib/unix.h"
+
+#define AB_KINDS 3
+
+static int
+arena_bench_ms(clock_t t0)
+{
+  return (clock() - t0) * 1000 / CLOCKS_PER_SEC;
+}
+
+/* Get a value in kB from a /proc file, 0 if not available */
+static long
+arena_bench_proc(const char *file, const char *key)
+{
+  char line[256];
+  long val = 0;
+  FILE *f = fopen(file, "r");
+
+  if (!f)
+    return 0;
+  while (fgets(line, sizeof(line), f))
+    if (!strncmp(line, key, strlen(key)))
+      {
+	val = atol(line + strlen(key));
+	break;
+      }
+  fclose(f);
+  return val;
+}
+
+static void
+arena_bench_mem(const char *step)
+{
+  debug("  %s: RSS %ld kB, huge pages %ld kB\n", step,
+	arena_bench_proc("/proc/self/status", "VmRSS:"),
+	arena_bench_proc("/proc/self/smaps_rollup", "AnonHugePages:"));
+}
+
+static inline void
+arena_bench_get(slab **s, void **objs, int i)
+{
+  int k;
+
+  for (k = 0; k < AB_KINDS; k++)
+    {
+      objs[AB_KINDS * i + k] = sl_alloc(s[k]);
+      *(long *) objs[AB_KINDS * i + k] = i;
+    }
+}
+
+static inline void
+arena_bench_put(slab **s, void **objs, int i)
+{
+  int k;
+
+  for (k = 0; k < AB_KINDS; k++)
+    {
+      sl_free(s[k], objs[AB_KINDS * i + k]);
+      objs[AB_KINDS * i + k] = NULL;
+    }
+}
+
+void
+arena_bench(int num, int flaps, int lookups)
+{
+  uint sizes[AB_KINDS] = { sizeof(net), sizeof(rte), sizeof(rta) };
+  void **objs = xmalloc(AB_KINDS * num * sizeof(void *));
+  slab *s[AB_KINDS];
+  clock_t t0;
+  long sum = 0;
+  int i, k;
+
+  debug("arena_bench: %d networks, %d flaps, %d lookups\n", num, flaps, lookups);
+  for (k = 0; k < AB_KINDS; k++)
+    s[k] = sl_new(&root_pool, sizes[k]);
+
+  t0 = clock();
+  for (i = 0; i < num; i++)
+    arena_bench_get(s, objs, i);
+  debug("  load: %d ms\n", arena_bench_ms(t0));
+  arena_bench_mem("after load");
+
+  t0 = clock();
+  for (k = 0; k < flaps; k++)
+    {
+      for (i = 0; i < num; i++)
+	if (random() & 1)
+	  arena_bench_put(s, objs, i);
+
+      for (i = 0; i < num; i++)
+	if (!objs[AB_KINDS * i])
+	  arena_bench_get(s, objs, i);
+    }
+  debug("  flap: %d ms\n", arena_bench_ms(t0));
+  arena_bench_mem("after flap");
+
+  t0 = clock();
+  for (i = 0; i < lookups; i++)
+    {
+      int j = random() % num;
+      for (k = 0; k < AB_KINDS; k++)
+	sum += *(long *) objs[AB_KINDS * j + k];
+    }
+  debug("  lookups: %d ms (%ld)\n", arena_bench_ms(t0), sum);
+
+  t0 = clock();
+  for (i = 0; i < num; i++)
+    arena_bench_put(s, objs, i);
+  while (sl_reclaim(~0U))
+    ;
+  debug("  flush: %d ms\n", arena_bench_ms(t0));
+  arena_bench_mem("after flush");
+
+  for (k = 0; k < AB_KINDS; k++)
+    rfree(s[k]);
+  xfree(objs);
+}
+
+int
+main(void)
+{
+  log_init_debug("");
+  resource_init();
+  arena_bench_mem("start");
+  arena_bench(500000, 5, 2000000);
+  return 0;
+}
+
+#endif
@@ -30,6 +30,8 @@
 #include <netinet/icmp6.h>
 
 #include "nest/bird.h"
+#include "lib/buffer.h"
+#include "lib/heap.h"
 #include "lib/lists.h"
 #include "lib/resource.h"
 #include "lib/timer.h"
@@ -41,6 +43,10 @@
 #include "lib/unix.h"
 #include "lib/sysio.h"
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 /* Maximum number of calls of tx handler for one socket in one
  * poll iteration. Should be small enough to not monopolize CPU by
  * one protocol instance.
@@ -52,6 +58,10 @@
    this to gen small latencies */
 #define MAX_RX_STEPS 4
 
+/* Maximum number of slabs processed by sl_reclaim() in one idle
+   poll iteration */
+#define RECLAIM_STEP 64
+
 /*
  *	Tracked Files
  */
@@ -117,15 +127,46 @@ tracked_fopen(pool *p, char *name, char *mode)
  * to the handler function (@hook), data private to this function (@data),
  * time the function should be called at (@expires, 0 for inactive timers),
  * for the other fields see |timer.h|.
+ *
+ * Where one second is too coarse, microsecond timers described by a &utimer
+ * structure can be used instead. They work the same way, but their time is
+ * of the &btime type, counted in microseconds and compared to variable
+ * @now_us, which is updated together with @now. Both kinds of timers are
+ * run from the main loop and can be mixed freely.
+ */
+
+/*
+ * Active timers are kept in a binary heap ordered by @expires, so starting,
+ * restarting and stopping a timer costs O(log n) and the first timer to
+ * expire is always at the top of the heap. The heap array is 1-based, the
+ * index of each timer in it is kept in @index to allow removal of arbitrary
+ * timers.
  */
 
-#define NEAR_TIMER_LIMIT 4
+#define TIMER_LESS(a,b)		((a)->expires < (b)->expires)
+#define TIMER_SWAP(heap,a,b,t)	(t = heap[a], heap[a] = heap[b], heap[b] = t, \
+				   heap[a]->index = (a), heap[b]->index = (b))
+
+static BUFFER(timer *) timers;
+
+static inline uint timers_count(void)
+{ return timers.used - 1; }
+
+static inline timer *timers_first(void)
+{ return (timers.used > 1) ? timers.data[1] : NULL; }
 
-static list near_timers, far_timers;
-static bird_clock_t first_far_timer = TIME_INFINITY;
+static BUFFER(utimer *) utimers;
+
+static inline uint utimers_count(void)
+{ return utimers.used - 1; }
+
+static inline utimer *utimers_first(void)
+{ return (utimers.used > 1) ? utimers.data[1] : NULL; }
 
 /* now must be different from 0, because 0 is a special value in timer->expires */
 bird_clock_t now = 1, now_real, boot_time;
+btime now_us = 1 S;
+static btime now_real_us;
 
 static void
 update_times_plain(void)
@@ -139,6 +180,18 @@ update_times_plain(void)
    log(L_WARN "Time jump, delta %d s", delta);
 
   now_real = new_time;
+
+  struct timeval tv;
+  if (gettimeofday(&tv, NULL) < 0)
+    die("gettimeofday: %m");
+
+  btime new_time_us = ((s64) tv.tv_sec S) + tv.tv_usec;
+  btime delta_us = new_time_us - now_real_us;
+
+  if ((delta_us >= 0) && (delta_us < 60 S))
+    now_us += delta_us;
+
+  now_real_us = new_time_us;
 }
 
 static void
@@ -151,6 +204,8 @@ update_times_gettime(void)
   if (rv != 0)
     die("clock_gettime: %m");
 
+  now_us = ((s64) ts.tv_sec S) + (ts.tv_nsec / 1000);
+
   if (ts.tv_sec != now) {
     if (ts.tv_sec < now)
       log(L_ERR "Monotonic timer is broken");
@@ -226,19 +281,10 @@ timer *
 tm_new(pool *p)
 {
   timer *t = ralloc(p, &tm_class);
+  t->index = -1;
   return t;
 }
 
-static inline void
-tm_insert_near(timer *t)
-{
-  node *n = HEAD(near_timers);
-
-  while (n->next && (SKIP_BACK(timer, n, n)->expires < t->expires))
-    n = n->next;
-  insert_node(&t->n, n->prev);
-}
-
 /**
  * tm_start - start a timer
  * @t: timer
@@ -260,22 +306,30 @@ void
 tm_start(timer *t, unsigned after)
 {
   bird_clock_t when;
+  uint tc = timers_count();
 
   if (t->randomize)
     after += random() % (t->randomize + 1);
   when = now + after;
   if (t->expires == when)
     return;
-  if (t->expires)
-    rem_node(&t->n);
-  t->expires = when;
-  if (after <= NEAR_TIMER_LIMIT)
-    tm_insert_near(t);
+
+  if (!t->expires)
+    {
+      t->index = ++tc;
+      t->expires = when;
+      BUFFER_PUSH(timers) = t;
+      HEAP_INSERT(timers.data, tc, timer *, TIMER_LESS, TIMER_SWAP);
+    }
+  else if (t->expires < when)
+    {
+      t->expires = when;
+      HEAP_INCREASE(timers.data, tc, timer *, TIMER_LESS, TIMER_SWAP, t->index);
+    }
   else
     {
-      if (!first_far_timer || first_far_timer > when)
-	first_far_timer = when;
-      add_tail(&far_timers, &t->n);
+      t->expires = when;
+      HEAP_DECREASE(timers.data, tc, timer *, TIMER_LESS, TIMER_SWAP, t->index);
     }
 }
 
@@ -289,48 +343,155 @@ tm_start(timer *t, unsigned after)
 void
 tm_stop(timer *t)
 {
-  if (t->expires)
-    {
-      rem_node(&t->n);
-      t->expires = 0;
-    }
+  if (!t->expires)
+    return;
+
+  uint tc = timers_count();
+
+  HEAP_DELETE(timers.data, tc, timer *, TIMER_LESS, TIMER_SWAP, t->index);
+  BUFFER_POP(timers);
+
+  t->index = -1;
+  t->expires = 0;
+}
+
+static inline time_t
+tm_first_shot(void)
+{
+  timer *t = timers_first();
+
+  return t ? t->expires : TIME_INFINITY;
 }
 
+
 static void
-tm_dump_them(char *name, list *l)
+ut_free(resource *r)
 {
-  node *n;
-  timer *t;
+  utimer *t = (utimer *) r;
+
+  ut_stop(t);
+}
+
+static void
+ut_dump(resource *r)
+{
+  utimer *t = (utimer *) r;
+
+  debug("(code %p, data %p, ", t->hook, t->data);
+  if (t->randomize)
+    debug("rand %d us, ", t->randomize);
+  if (t->recurrent)
+    debug("recur %d us, ", t->recurrent);
+  if (t->expires)
+    debug("expires in %d ms)\n", (int) ((t->expires - now_us) TO_MS));
+  else
+    debug("inactive)\n");
+}
+
+static struct resclass ut_class = {
+  "Microsecond timer",
+  sizeof(utimer),
+  ut_free,
+  ut_dump,
+  NULL,
+  NULL
+};
+
+/**
+ * ut_new - create a microsecond timer
+ * @p: pool
+ *
+ * This function creates a new microsecond timer resource and returns
+ * a pointer to it. To use the timer, you need to fill in the structure
+ * fields and call ut_start() or ut_set() to start timing.
+ */
+utimer *
+ut_new(pool *p)
+{
+  utimer *t = ralloc(p, &ut_class);
+  t->index = -1;
+  return t;
+}
+
+/**
+ * ut_set - start a microsecond timer at given time
+ * @t: timer
+ * @when: absolute expiration time in microseconds
+ *
+ * This function schedules the hook function of the timer to be called
+ * when @now_us reaches @when. If the timer has been already started,
+ * its expiration time is replaced by the new value. The @randomize
+ * field is not applied here, only in ut_start() and to recurrent runs.
+ */
+void
+ut_set(utimer *t, btime when)
+{
+  uint tc = utimers_count();
 
-  debug("%s timers:\n", name);
-  WALK_LIST(n, *l)
+  if (!t->expires)
     {
-      t = SKIP_BACK(timer, n, n);
-      debug("%p ", t);
-      tm_dump(&t->r);
+      t->index = ++tc;
+      t->expires = when;
+      BUFFER_PUSH(utimers) = t;
+      HEAP_INSERT(utimers.data, tc, utimer *, TIMER_LESS, TIMER_SWAP);
+    }
+  else if (t->expires < when)
+    {
+      t->expires = when;
+      HEAP_INCREASE(utimers.data, tc, utimer *, TIMER_LESS, TIMER_SWAP, t->index);
+    }
+  else if (t->expires > when)
+    {
+      t->expires = when;
+      HEAP_DECREASE(utimers.data, tc, utimer *, TIMER_LESS, TIMER_SWAP, t->index);
     }
-  debug("\n");
 }
 
+/**
+ * ut_start - start a microsecond timer
+ * @t: timer
+ * @after: number of microseconds the timer should be run after
+ *
+ * This function is a relative variant of ut_set(). If the @randomize
+ * field of @t is set, the timeout is increased by a random number of
+ * microseconds chosen uniformly from range 0 .. @randomize.
+ */
 void
-tm_dump_all(void)
+ut_start(utimer *t, btime after)
 {
-  tm_dump_them("Near", &near_timers);
-  tm_dump_them("Far", &far_timers);
+  if (t->randomize)
+    after += random() % (t->randomize + 1);
+  ut_set(t, now_us + MAX(after, 0));
 }
 
-static inline time_t
-tm_first_shot(void)
+/**
+ * ut_stop - stop a microsecond timer
+ * @t: timer
+ *
+ * This function stops a timer. If the timer is already stopped,
+ * nothing happens.
+ */
+void
+ut_stop(utimer *t)
 {
-  time_t x = first_far_timer;
+  if (!t->expires)
+    return;
 
-  if (!EMPTY_LIST(near_timers))
-    {
-      timer *t = SKIP_BACK(timer, n, HEAD(near_timers));
-      if (t->expires < x)
-	x = t->expires;
-    }
-  return x;
+  uint tc = utimers_count();
+
+  HEAP_DELETE(utimers.data, tc, utimer *, TIMER_LESS, TIMER_SWAP, t->index);
+  BUFFER_POP(utimers);
+
+  t->index = -1;
+  t->expires = 0;
+}
+
+static inline btime
+ut_first_shot(void)
+{
+  utimer *t = utimers_first();
+
+  return t ? t->expires : BTIME_INFINITY;
 }
 
 void io_log_event(void *hook, void *data);
@@ -339,35 +500,14 @@ static void
 tm_shot(void)
 {
   timer *t;
-  node *n, *m;
 
-  if (first_far_timer <= now)
-    {
-      bird_clock_t limit = now + NEAR_TIMER_LIMIT;
-      first_far_timer = TIME_INFINITY;
-      n = HEAD(far_timers);
-      while (m = n->next)
-	{
-	  t = SKIP_BACK(timer, n, n);
-	  if (t->expires <= limit)
-	    {
-	      rem_node(n);
-	      tm_insert_near(t);
-	    }
-	  else if (t->expires < first_far_timer)
-	    first_far_timer = t->expires;
-	  n = m;
-	}
-    }
-  while ((n = HEAD(near_timers)) -> next)
+  while (t = timers_first())
     {
       int delay;
-      t = SKIP_BACK(timer, n, n);
       if (t->expires > now)
 	break;
-      rem_node(n);
       delay = t->expires - now;
-      t->expires = 0;
+      tm_stop(t);
       if (t->recurrent)
 	{
 	  int i = t->recurrent - delay;
@@ -380,6 +520,60 @@ tm_shot(void)
     }
 }
 
+static void
+ut_shot(void)
+{
+  utimer *t;
+
+  while (t = utimers_first())
+    {
+      if (t->expires > now_us)
+	break;
+
+      if (t->recurrent)
+	{
+	  btime when = t->expires + t->recurrent;
+
+	  if (when <= now_us)
+	    when = now_us + t->recurrent;
+
+	  if (t->randomize)
+	    when += random() % (t->randomize + 1);
+
+	  ut_set(t, when);
+	}
+      else
+	ut_stop(t);
+
+      io_log_event(t->hook, t->data);
+      t->hook(t);
+    }
+}
+
+void
+tm_dump_all(void)
+{
+  uint i;
+
+  debug("Timers:\n");
+  for (i = 1; i < timers.used; i++)
+    {
+      timer *t = timers.data[i];
+      debug("%p ", t);
+      tm_dump(&t->r);
+    }
+  debug("\n");
+
+  debug("Microsecond timers:\n");
+  for (i = 1; i < utimers.used; i++)
+    {
+      utimer *t = utimers.data[i];
+      debug("%p ", t);
+      ut_dump(&t->r);
+    }
+  debug("\n");
+}
+
 /**
  * tm_parse_datetime - parse a date and time
  * @x: datetime string
@@ -1034,15 +1228,39 @@ static list sock_list;
 static struct birdsock *current_sock;
 static struct birdsock *stored_sock;
 
+/*
+ * With the epoll backend, sockets are registered in edge-triggered mode
+ * when inserted to the main loop and their pending events are kept in
+ * @revents until sk_read() or sk_write() find them exhausted. Sockets with
+ * pending events are linked in @ready_list and only those are walked by
+ * io_loop(), so sk_next() follows that list instead of @sock_list.
+ */
+static int epoll_fd = -1;
+static list ready_list;
+
 static inline sock *
 sk_next(sock *s)
 {
-  if (!s->n.next->next)
+  /* Sockets already unlinked from the walked list have no successor */
+  if (epoll_fd >= 0)
+    return (s->ready_n.next && s->ready_n.next->next) ?
+      SKIP_BACK(sock, ready_n, s->ready_n.next) : NULL;
+
+  if (!s->n.next || !s->n.next->next)
     return NULL;
   else
     return SKIP_BACK(sock, n, s->n.next);
 }
 
+static inline sock *
+sk_first(void)
+{
+  if (epoll_fd >= 0)
+    return !EMPTY_LIST(ready_list) ? SKIP_BACK(sock, ready_n, HEAD(ready_list)) : NULL;
+
+  return !EMPTY_LIST(sock_list) ? SKIP_BACK(sock, n, HEAD(sock_list)) : NULL;
+}
+
 static void
 sk_alloc_bufs(sock *s)
 {
@@ -1077,6 +1295,11 @@ sk_free(resource *r)
   sk_free_bufs(s);
   if (s->fd >= 0)
   {
+#ifdef USE_EPOLL
+    if ((epoll_fd >= 0) && !(s->flags & SKF_THREAD))
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+#endif
+
     close(s->fd);
 
     /* FIXME: we should call sk_stop() for SKF_THREAD sockets */
@@ -1088,6 +1311,9 @@ sk_free(resource *r)
     if (s == stored_sock)
       stored_sock = sk_next(s);
     rem_node(&s->n);
+
+    if (s->ready_n.next)
+      rem_node(&s->ready_n);
   }
 }
 
@@ -1285,6 +1511,19 @@ static void
 sk_insert(sock *s)
 {
   add_tail(&sock_list, &s->n);
+
+#ifdef USE_EPOLL
+  if (epoll_fd >= 0)
+  {
+    struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLOUT | EPOLLET,
+      .data.ptr = s
+    };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->fd, &ev) < 0)
+      die("epoll_ctl: %m");
+  }
+#endif
 }
 
 static void
@@ -2046,14 +2285,23 @@ watchdog_stop(void)
 
 volatile int async_config_flag;		/* Asynchronous reconfiguration/dump scheduled */
 volatile int async_dump_flag;
+volatile int async_shutdown_flag;
 
 void
 io_init(void)
 {
-  init_list(&near_timers);
-  init_list(&far_timers);
+  BUFFER_INIT(timers, &root_pool, 4);
+  BUFFER_PUSH(timers) = NULL;
+  BUFFER_INIT(utimers, &root_pool, 4);
+  BUFFER_PUSH(utimers) = NULL;
   init_list(&sock_list);
+  init_list(&ready_list);
   init_list(&global_event_list);
+#ifdef USE_EPOLL
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0)
+    log(L_WARN "Cannot create epoll instance, using poll: %m");
+#endif
   krt_io_init();
   init_times();
   update_times();
@@ -2064,16 +2312,180 @@ io_init(void)
 static int short_loops = 0;
 #define SHORT_LOOP_MAX 10
 
+/*
+ * Wait for socket events using poll(). All sockets are scanned and the
+ * returned events are stored to their @revents.
+ */
+static int
+io_poll(int tout)
+{
+  static struct pollfd *pfd;
+  static int fdmax;
+  int nfds, pout;
+  node *n;
+  sock *s;
+
+  if (!pfd)
+    {
+      fdmax = 256;
+      pfd = xmalloc(fdmax * sizeof(struct pollfd));
+    }
+
+  nfds = 0;
+  WALK_LIST(n, sock_list)
+    {
+      pfd[nfds] = (struct pollfd) { .fd = -1 }; /* everything other set to 0 by this */
+      s = SKIP_BACK(sock, n, n);
+      if (s->rx_hook)
+	{
+	  pfd[nfds].fd = s->fd;
+	  pfd[nfds].events |= POLLIN;
+	}
+      if (s->tx_hook && s->ttx != s->tpos)
+	{
+	  pfd[nfds].fd = s->fd;
+	  pfd[nfds].events |= POLLOUT;
+	}
+      if (pfd[nfds].fd != -1)
+	{
+	  s->index = nfds;
+	  nfds++;
+	}
+      else
+	s->index = -1;
+
+      if (nfds >= fdmax)
+	{
+	  fdmax *= 2;
+	  pfd = xrealloc(pfd, fdmax * sizeof(struct pollfd));
+	}
+    }
+
+  watchdog_stop();
+  pout = poll(pfd, nfds, tout);
+  watchdog_start();
+
+  if (pout <= 0)
+    return pout;
+
+  WALK_LIST(n, sock_list)
+    {
+      s = SKIP_BACK(sock, n, n);
+      s->revents = (s->index != -1) ? pfd[s->index].revents : 0;
+    }
+
+  return pout;
+}
+
+#ifdef USE_EPOLL
+
+#define EPOLL_MAX_EVENTS 256
+
+/*
+ * Sockets stay in @ready_list while they have pending events. Events which
+ * can not be handled now (input on a socket without @rx_hook, output on a
+ * socket with empty TX buffer) are not a reason to wake up immediately.
+ */
+static inline int
+sk_ready(sock *s)
+{
+  return ((s->revents & POLLIN) && s->rx_hook) ||
+    ((s->revents & POLLOUT) && (s->ttx != s->tpos)) ||
+    (s->revents & (POLLHUP | POLLERR));
+}
+
+/*
+ * Wait for socket events using epoll. Only the sockets reported by the
+ * kernel are touched, their events are added to @revents and the sockets
+ * are linked to @ready_list. Edge-triggered events are reported once, so
+ * the sockets are kept there until the events are consumed.
+ */
+static int
+io_epoll(int tout)
+{
+  static struct epoll_event ev[EPOLL_MAX_EVENTS];
+  int i, pout;
+  node *n, *nxt;
+
+  WALK_LIST_DELSAFE(n, nxt, ready_list)
+    {
+      sock *s = SKIP_BACK(sock, ready_n, n);
+
+      if (!s->revents)
+	{
+	  if (s == current_sock)
+	    current_sock = sk_next(s);
+	  if (s == stored_sock)
+	    stored_sock = sk_next(s);
+	  rem_node(&s->ready_n);
+	}
+      else if (sk_ready(s))
+	tout = 0;
+    }
+
+  watchdog_stop();
+  pout = epoll_wait(epoll_fd, ev, EPOLL_MAX_EVENTS, tout);
+  watchdog_start();
+
+  if (pout < 0)
+    return pout;
+
+  for (i = 0; i < pout; i++)
+    {
+      sock *s = ev[i].data.ptr;
+
+      /* EPOLL* event flags have the same values as POLL* ones */
+      int revents = ev[i].events & (POLLIN | POLLOUT | POLLHUP | POLLERR);
+
+      /* Output readiness is interesting only with data waiting to be sent */
+      if (!s->tx_hook || (s->ttx == s->tpos))
+	revents &= ~POLLOUT;
+
+      if (!revents)
+	continue;
+
+      s->revents |= revents;
+      if (!s->ready_n.next)
+	add_tail(&ready_list, &s->ready_n);
+    }
+
+  return !EMPTY_LIST(ready_list);
+}
+
+#endif
+
+/*
+ * Wrappers for socket handlers in io_loop(). With the epoll backend, events
+ * stay in @revents between loops, so they have to be cleared when the
+ * socket is exhausted, which is when the handler returns zero.
+ */
+static inline int
+io_sk_read(sock *s)
+{
+  int e = sk_read(s, s->revents);
+  if (!e && (s == current_sock))
+    s->revents &= ~POLLIN;
+  return e;
+}
+
+static inline int
+io_sk_write(sock *s)
+{
+  int e = sk_write(s);
+  if (!e && (s == current_sock))
+    s->revents &= ~POLLOUT;
+  return e;
+}
+
 void
 io_loop(void)
 {
   int poll_tout;
   time_t tout;
-  int nfds, events, pout;
-  sock *s;
-  node *n;
-  int fdmax = 256;
-  struct pollfd *pfd = xmalloc(fdmax * sizeof(struct pollfd));
+  btime utout;
+  int events, pout;
+  int reclaim_more = 0;
+  time_t reclaim_last = 0;
 
   watchdog_start1();
   for(;;)
@@ -2087,40 +2499,27 @@ io_loop(void)
 	  tm_shot();
 	  goto timers;
 	}
+      utout = ut_first_shot();
+      if (utout <= now_us)
+	{
+	  ut_shot();
+	  goto timers;
+	}
       poll_tout = (events ? 0 : MIN(tout - now, 3)) * 1000; /* Time in milliseconds */
+      if ((utout - now_us) < (poll_tout MS))
+	poll_tout = (utout - now_us + 999) TO_MS;
 
-      io_close_event();
-
-      nfds = 0;
-      WALK_LIST(n, sock_list)
+      /* Release unused memory when there is nothing else to do */
+      if (!events && (reclaim_more || (now != reclaim_last)))
 	{
-	  pfd[nfds] = (struct pollfd) { .fd = -1 }; /* everything other set to 0 by this */
-	  s = SKIP_BACK(sock, n, n);
-	  if (s->rx_hook)
-	    {
-	      pfd[nfds].fd = s->fd;
-	      pfd[nfds].events |= POLLIN;
-	    }
-	  if (s->tx_hook && s->ttx != s->tpos)
-	    {
-	      pfd[nfds].fd = s->fd;
-	      pfd[nfds].events |= POLLOUT;
-	    }
-	  if (pfd[nfds].fd != -1)
-	    {
-	      s->index = nfds;
-	      nfds++;
-	    }
-	  else
-	    s->index = -1;
-
-	  if (nfds >= fdmax)
-	    {
-	      fdmax *= 2;
-	      pfd = xrealloc(pfd, fdmax * sizeof(struct pollfd));
-	    }
+	  reclaim_more = sl_reclaim(RECLAIM_STEP);
+	  reclaim_last = now;
+	  if (reclaim_more)
+	    poll_tout = 0;
 	}
 
+      io_close_event();
+
       /*
        * Yes, this is racy. But even if the signal comes before this test
        * and entering poll(), it gets caught on the next timer tick.
@@ -2149,9 +2548,12 @@ io_loop(void)
 	}
 
       /* And finally enter poll() to find active sockets */
-      watchdog_stop();
-      pout = poll(pfd, nfds, poll_tout);
-      watchdog_start();
+#ifdef USE_EPOLL
+      if (epoll_fd >= 0)
+	pout = io_epoll(poll_tout);
+      else
+#endif
+	pout = io_poll(poll_tout);
 
       if (pout < 0)
 	{
@@ -2161,13 +2563,12 @@ io_loop(void)
 	}
       if (pout)
 	{
-	  /* guaranteed to be non-empty */
-	  current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
+	  current_sock = sk_first();
 
 	  while (current_sock)
 	    {
 	      sock *s = current_sock;
-	      if (s->index == -1)
+	      if (!s->revents)
 		{
 		  current_sock = sk_next(s);
 		  goto next;
@@ -2177,24 +2578,24 @@ io_loop(void)
 	      int steps;
 
 	      steps = MAX_STEPS;
-	      if (s->fast_rx && (pfd[s->index].revents & POLLIN) && s->rx_hook)
+	      if (s->fast_rx && (s->revents & POLLIN) && s->rx_hook)
 		do
 		  {
 		    steps--;
 		    io_log_event(s->rx_hook, s->data);
-		    e = sk_read(s, pfd[s->index].revents);
+		    e = io_sk_read(s);
 		    if (s != current_sock)
 		      goto next;
 		  }
 		while (e && s->rx_hook && steps);
 
 	      steps = MAX_STEPS;
-	      if (pfd[s->index].revents & POLLOUT)
+	      if (s->revents & POLLOUT)
 		do
 		  {
 		    steps--;
 		    io_log_event(s->tx_hook, s->data);
-		    e = sk_write(s);
+		    e = io_sk_write(s);
 		    if (s != current_sock)
 		      goto next;
 		  }
@@ -2212,30 +2613,32 @@ io_loop(void)
 	  int count = 0;
 	  current_sock = stored_sock;
 	  if (current_sock == NULL)
-	    current_sock = SKIP_BACK(sock, n, HEAD(sock_list));
+	    current_sock = sk_first();
 
 	  while (current_sock && count < MAX_RX_STEPS)
 	    {
 	      sock *s = current_sock;
-	      if (s->index == -1)
+	      if (!s->revents)
 		{
 		  current_sock = sk_next(s);
 		  goto next2;
 		}
 
-	      if (!s->fast_rx && (pfd[s->index].revents & POLLIN) && s->rx_hook)
+	      if (!s->fast_rx && (s->revents & POLLIN) && s->rx_hook)
 		{
 		  count++;
 		  io_log_event(s->rx_hook, s->data);
-		  sk_read(s, pfd[s->index].revents);
+		  io_sk_read(s);
 		  if (s != current_sock)
 		    goto next2;
 		}
 
-	      if (pfd[s->index].revents & (POLLHUP | POLLERR))
+	      if (s->revents & (POLLHUP | POLLERR))
 		{
-		  sk_err(s, pfd[s->index].revents);
-		    goto next2;
+		  int revents = s->revents;
+		  s->revents &= ~(POLLHUP | POLLERR);
+		  sk_err(s, revents);
+		  goto next2;
 		}
 
 	      current_sock = sk_next(s);
@@ -2244,6 +2647,7 @@ io_loop(void)
 
 
 	  stored_sock = current_sock;
+	  current_sock = NULL;
 	}
     }
 }
@@ -2266,3 +2670,90 @@ test_old_bird(char *path)
     die("I found another BIRD running.");
   close(fd);
 }
+
+#ifdef TEST
+
+/*
+ * Timer benchmark: start, restart, stop and fire a large number of timers.
+ * Time is advanced by hand, so the hooks run without any sleeping.
+ */
+
+#include <stdlib.h>
+
+static int tm_bench_fired;
+static bird_clock_t tm_bench_last;
+
+static void
+tm_bench_hook(timer *t)
+{
+  if (t->expires || (now < tm_bench_last))
+    bug("tm_bench: timer fired out of order");
+  tm_bench_last = now;
+  tm_bench_fired++;
+}
+
+static int
+tm_bench_ms(clock_t t0)
+{
+  return (clock() - t0) * 1000 / CLOCKS_PER_SEC;
+}
+
+void
+tm_bench(int num, int range)
+{
+  timer **ts = xmalloc(num * sizeof(timer *));
+  clock_t t0;
+  int i, stopped = 0;
+
+  debug("tm_bench: %d timers within %d s\n", num, range);
+
+  t0 = clock();
+  for (i = 0; i < num; i++)
+    {
+      ts[i] = tm_new_set(&root_pool, tm_bench_hook, NULL, 0, 0);
+      tm_start(ts[i], 1 + random() % range);
+    }
+  debug("  start: %d ms\n", tm_bench_ms(t0));
+
+  t0 = clock();
+  for (i = 0; i < num; i++)
+    tm_start(ts[i], 1 + random() % range);
+  debug("  restart: %d ms\n", tm_bench_ms(t0));
+
+  t0 = clock();
+  for (i = 0; i < num; i += 4, stopped++)
+    tm_stop(ts[i]);
+  debug("  stop: %d ms\n", tm_bench_ms(t0));
+
+  t0 = clock();
+  while (timers_first())
+    {
+      now = tm_first_shot();
+      tm_shot();
+    }
+  debug("  fire: %d ms\n", tm_bench_ms(t0));
+
+  if (tm_bench_fired != num - stopped)
+    bug("tm_bench: %d timers fired, %d expected", tm_bench_fired, num - stopped);
+
+  for (i = 0; i < num; i++)
+    rfree(ts[i]);
+  xfree(ts);
+  tm_bench_fired = 0;
+}
+
+int
+main(void)
+{
+  static struct config tm_bench_config;
+
+  log_init_debug("");
+  resource_init();
+  config = &tm_bench_config;
+  io_init();
+  tm_bench(100000, 4);
+  tm_bench(100000, 600);
+  return 0;
+}
+
+#endif
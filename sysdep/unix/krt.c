@@ -27,9 +27,12 @@
  * In this case, we keep only a single scan timer.
  *
  * We use FIB node flags in the routing table to keep track of route
- * synchronization status. We also attach temporary &rte's to the routing table,
- * but it cannot do any harm to the rest of BIRD since table synchronization is
- * an atomic process.
+ * synchronization status. Table scans are not atomic, they are done in small
+ * steps interleaved with other work. Routes found in the kernel are updated
+ * right away and their FIB nodes are marked by the number of the running scan,
+ * then the routing table is walked to reinstall routes which were not marked.
+ * Asynchronous notifications keep the tables in sync meanwhile, so the periodic
+ * scan is just a consistency check.
  *
  * When starting up, we cheat by looking if there is another
  * KRT instance to be initialized later and performing table scan
@@ -55,8 +58,10 @@
 #include "nest/iface.h"
 #include "nest/route.h"
 #include "nest/protocol.h"
+#include "nest/cli.h"
 #include "filter/filter.h"
 #include "lib/timer.h"
+#include "lib/event.h"
 #include "conf/conf.h"
 #include "lib/string.h"
 
@@ -402,21 +407,26 @@ krt_learn_scan(struct krt_proto *p, rte *e)
     }
 }
 
-static void
-krt_learn_prune(struct krt_proto *p)
+/* Returns 1 when the whole table is pruned */
+static int
+krt_learn_prune_step(struct krt_proto *p, int *limit)
 {
   struct fib *fib = &p->krt_table.fib;
-  struct fib_iterator fit;
-
-  KRT_TRACE(p, D_EVENTS, "Pruning inherited routes");
+  struct fib_iterator *fit = &p->learn_fit;
 
-  FIB_ITERATE_INIT(&fit, fib);
 again:
-  FIB_ITERATE_START(fib, &fit, f)
+  FIB_ITERATE_START(fib, fit, f)
     {
       net *n = (net *) f;
       rte *e, **ee, *best, **pbest, *old_best;
 
+      if (*limit <= 0)
+	{
+	  FIB_ITERATE_PUT(fit, f);
+	  return 0;
+	}
+      (*limit)--;
+
       /*
        * Note that old_best may be NULL even if there was an old best route in
        * the previous step, because it might be replaced in krt_learn_scan().
@@ -455,7 +465,7 @@ again:
 	  if (old_best)
 	    krt_learn_announce_delete(p, n);
 
-	  FIB_ITERATE_PUT(&fit, f);
+	  FIB_ITERATE_PUT(fit, f);
 	  fib_delete(fib, f);
 	  goto again;
 	}
@@ -465,7 +475,7 @@ again:
       best->next = n->routes;
       n->routes = best;
 
-      if ((best != old_best) || p->reload)
+      if ((best != old_best) || p->reloading)
 	{
 	  DBG("%I/%d: announcing (metric=%d)\n", n->n.prefix, n->n.pxlen, best->u.krt.metric);
 	  krt_learn_announce_update(p, best);
@@ -475,7 +485,7 @@ again:
     }
   FIB_ITERATE_END(f);
 
-  p->reload = 0;
+  return 1;
 }
 
 static void
@@ -508,6 +518,8 @@ krt_learn_async(struct krt_proto *p, rte *e, int new)
       else
 	krt_trace_in(p, e, "[alien async] created");
 
+      /* The running scan might have missed it */
+      e->u.krt.seen = (p->scan_state != KRT_SCAN_IDLE);
       e->next = n->routes;
       n->routes = e;
     }
@@ -667,17 +679,40 @@ krt_same_dest(rte *k, rte *e)
     }
 }
 
+static inline int
+krt_seen(struct krt_proto *p, struct fib_node *n)
+{
+  return (n->flags & KRF_SCAN_MASK) == p->scan_epoch;
+}
+
+static inline void
+krt_set_seen(struct krt_proto *p, struct fib_node *n)
+{
+  n->flags = (n->flags & ~KRF_SCAN_MASK) | p->scan_epoch;
+}
+
 /*
  *  This gets called back when the low-level scanning code discovers a route.
  *  We expect that the route is a temporary rte and its attributes are uncached.
+ *  The kernel is updated right away, entries handled by the running scan are
+ *  marked by its number, so the prune phase knows which routes were missing.
  */
 
 void
 krt_got_route(struct krt_proto *p, rte *e)
 {
   net *net = e->net;
+  rte *new = NULL, *rt_free = NULL;
+  ea_list *tmpa = NULL;
   int verdict;
 
+  /* Protocol started during the scan, it will be synced by the next one */
+  if (p->scan_state != KRT_SCAN_DUMP)
+    {
+      rte_free(e);
+      return;
+    }
+
 #ifdef KRT_ALLOW_LEARN
   switch (e->u.krt.src)
     {
@@ -702,9 +737,9 @@ krt_got_route(struct krt_proto *p, rte *e)
 #endif
   /* The rest is for KRT_SRC_BIRD (or KRT_SRC_UNKNOWN) */
 
-  if (net->n.flags & KRF_VERDICT_MASK)
+  if (krt_seen(p, &net->n))
     {
-      /* Route to this destination was already seen. Strange, but it happens... */
+      /* Route to this destination was already seen or just updated by us */
       krt_trace_in(p, e, "already seen");
       rte_free(e);
       return;
@@ -719,9 +754,6 @@ krt_got_route(struct krt_proto *p, rte *e)
 
   if (net->n.flags & KRF_INSTALLED)
     {
-      rte *new, *rt_free;
-      ea_list *tmpa;
-
       new = krt_export_net(p, net, &rt_free, &tmpa);
 
       /* TODO: There also may be changes in route eattrs, we ignore that for now. */
@@ -732,107 +764,126 @@ krt_got_route(struct krt_proto *p, rte *e)
 	verdict = KRF_UPDATE;
       else
 	verdict = KRF_SEEN;
-
-      if (rt_free)
-	rte_free(rt_free);
-
-      lp_flush(krt_filter_lp);
     }
   else
     verdict = KRF_DELETE;
 
  sentenced:
-  krt_trace_in(p, e, ((char *[]) { "?", "seen", "will be updated", "will be removed", "ignored" }) [verdict]);
-  net->n.flags = (net->n.flags & ~KRF_VERDICT_MASK) | verdict;
-  if (verdict == KRF_UPDATE || verdict == KRF_DELETE)
-    {
-      /* Get a cached copy of attributes and temporarily link the route */
-      rta *a = e->attrs;
-      a->source = RTS_DUMMY;
-      e->attrs = rta_lookup(a);
-      e->next = net->routes;
-      net->routes = e;
-    }
-  else
-    rte_free(e);
+  krt_trace_in(p, e, ((char *[]) { "?", "seen", "updating", "deleting", "ignored" }) [verdict]);
+  krt_set_seen(p, &net->n);
+
+  if (verdict == KRF_UPDATE)
+    krt_replace_rte(p, net, new, e, ea_append(tmpa, new->attrs->eattrs));
+  else if (verdict == KRF_DELETE)
+    krt_replace_rte(p, net, NULL, e, NULL);
+
+  if (rt_free)
+    rte_free(rt_free);
+  lp_flush(krt_filter_lp);
+  rte_free(e);
 }
 
 static void
-krt_prune(struct krt_proto *p)
+krt_reinstall(struct krt_proto *p, net *n)
 {
-  struct rtable *t = p->p.table;
+  rte *new, *rt_free = NULL;
+  ea_list *tmpa = NULL;
 
-  KRT_TRACE(p, D_EVENTS, "Pruning table %s", t->name);
-  FIB_WALK(&t->fib, f)
+  new = krt_export_net(p, n, &rt_free, &tmpa);
+  if (new)
     {
-      net *n = (net *) f;
-      int verdict = f->flags & KRF_VERDICT_MASK;
-      rte *new, *old, *rt_free = NULL;
-      ea_list *tmpa = NULL;
+      krt_trace_in(p, new, "reinstalling");
+      krt_replace_rte(p, n, new, NULL, ea_append(tmpa, new->attrs->eattrs));
+    }
 
-      if (verdict == KRF_UPDATE || verdict == KRF_DELETE)
-	{
-	  /* Get a dummy route from krt_got_route() */
-	  old = n->routes;
-	  n->routes = old->next;
-	}
-      else
-	old = NULL;
+  if (rt_free)
+    rte_free(rt_free);
+  lp_flush(krt_filter_lp);
+}
 
-      if (verdict == KRF_CREATE || verdict == KRF_UPDATE)
-	{
-	  /* We have to run export filter to get proper 'new' route */
-	  new = krt_export_net(p, n, &rt_free, &tmpa);
+static void
+krt_prune_start(struct krt_proto *p)
+{
+  KRT_TRACE(p, D_EVENTS, "Pruning table %s", p->p.table->name);
+  FIB_ITERATE_INIT(&p->prune_fit, &p->p.table->fib);
+  p->scan_state = KRT_SCAN_PRUNE;
+}
 
-	  if (!new)
-	    verdict = (verdict == KRF_CREATE) ? KRF_IGNORE : KRF_DELETE;
-	  else
-	    tmpa = ea_append(tmpa, new->attrs->eattrs);
-	}
-      else
-	new = NULL;
+/* Returns 1 when the scan is finished */
+static int
+krt_prune_step(struct krt_proto *p, int *limit)
+{
+  struct fib *fib = &p->p.table->fib;
 
-      switch (verdict)
+  if (p->scan_state == KRT_SCAN_PRUNE)
+    {
+      FIB_ITERATE_START(fib, &p->prune_fit, f)
 	{
-	case KRF_CREATE:
-	  if (new && (f->flags & KRF_INSTALLED))
+	  if (*limit <= 0)
 	    {
-	      krt_trace_in(p, new, "reinstalling");
-	      krt_replace_rte(p, n, new, NULL, tmpa);
+	      FIB_ITERATE_PUT(&p->prune_fit, f);
+	      return 0;
 	    }
-	  break;
-	case KRF_SEEN:
-	case KRF_IGNORE:
-	  /* Nothing happens */
-	  break;
-	case KRF_UPDATE:
-	  krt_trace_in(p, new, "updating");
-	  krt_replace_rte(p, n, new, old, tmpa);
-	  break;
-	case KRF_DELETE:
-	  krt_trace_in(p, old, "deleting");
-	  krt_replace_rte(p, n, NULL, old, NULL);
-	  break;
-	default:
-	  bug("krt_prune: invalid route status");
+	  (*limit)--;
+
+	  /* Installed routes not seen by the scan are missing in the kernel */
+	  if ((f->flags & KRF_INSTALLED) && !krt_seen(p, f))
+	    krt_reinstall(p, (net *) f);
+
+	  krt_set_seen(p, f);
 	}
+      FIB_ITERATE_END(f);
 
-      if (old)
-	rte_free(old);
-      if (rt_free)
-	rte_free(rt_free);
-      lp_flush(krt_filter_lp);
-      f->flags &= ~KRF_VERDICT_MASK;
+#ifdef KRT_ALLOW_LEARN
+      if (KRT_CF->learn)
+	{
+	  KRT_TRACE(p, D_EVENTS, "Pruning inherited routes");
+	  FIB_ITERATE_INIT(&p->learn_fit, &p->krt_table.fib);
+	  p->scan_state = KRT_SCAN_LEARN;
+	}
+#endif
     }
-  FIB_WALK_END;
 
 #ifdef KRT_ALLOW_LEARN
-  if (KRT_CF->learn)
-    krt_learn_prune(p);
+  if (p->scan_state == KRT_SCAN_LEARN)
+    if (!krt_learn_prune_step(p, limit))
+      return 0;
 #endif
 
+  if (p->scan_state == KRT_SCAN_IDLE)
+    return 1;
+
+  p->scan_state = KRT_SCAN_IDLE;
+  p->reloading = 0;
+
   if (p->ready)
     p->initialized = 1;
+
+  return 1;
+}
+
+static void
+krt_scan_begin(struct krt_proto *p)
+{
+  /* Scans are numbered 1-15, zero is kept for entries never synced */
+  p->scan_epoch = (p->scan_epoch % KRF_SCAN_MASK) + 1;
+  p->scan_state = KRT_SCAN_DUMP;
+  p->reloading = p->reload;
+  p->reload = 0;
+}
+
+static void
+krt_scan_abort(struct krt_proto *p)
+{
+  if (p->scan_state == KRT_SCAN_PRUNE)
+    FIB_ITERATE_UNLINK(&p->prune_fit, &p->p.table->fib);
+
+#ifdef KRT_ALLOW_LEARN
+  if (p->scan_state == KRT_SCAN_LEARN)
+    FIB_ITERATE_UNLINK(&p->learn_fit, &p->krt_table.fib);
+#endif
+
+  p->scan_state = KRT_SCAN_IDLE;
 }
 
 void
@@ -871,15 +922,28 @@ krt_got_route_async(struct krt_proto *p, rte *e, int new)
  */
 
 
+/*
+ *  A scan reads the kernel table in steps of KRT_SCAN_LIMIT routes and then
+ *  checks the routing table for routes missing in the kernel in steps of
+ *  KRT_PRUNE_LIMIT entries, returning to the main loop between the steps.
+ *  A running scan is never restarted, a scan requested meanwhile follows it.
+ */
+
 #ifdef CONFIG_ALL_TABLES_AT_ONCE
 
 static timer *krt_scan_timer;
+static event *krt_scan_event;
 static int krt_scan_count;
+static byte krt_scan_state, krt_scan_again;
 
 static void
 krt_scan(timer *t UNUSED)
 {
   struct krt_proto *p;
+  node *n;
+
+  if (krt_scan_state)
+    return;
 
   kif_force_scan();
 
@@ -887,43 +951,95 @@ krt_scan(timer *t UNUSED)
   p = SKIP_BACK(struct krt_proto, krt_node, HEAD(krt_proto_list));
   KRT_TRACE(p, D_EVENTS, "Scanning routing table");
 
-  krt_do_scan(NULL);
+  WALK_LIST(n, krt_proto_list)
+    krt_scan_begin(SKIP_BACK(struct krt_proto, krt_node, n));
 
-  void *q;
-  WALK_LIST(q, krt_proto_list)
-  {
-    p = SKIP_BACK(struct krt_proto, krt_node, q);
-    krt_prune(p);
-  }
+  krt_do_scan_start(NULL);
+  krt_scan_state = KRT_SCAN_DUMP;
+  ev_schedule(krt_scan_event);
+}
+
+static void
+krt_scan_loop(void *data UNUSED)
+{
+  struct krt_proto *p;
+  int limit = KRT_PRUNE_LIMIT;
+  node *n;
+
+  if (krt_scan_state == KRT_SCAN_DUMP)
+    {
+      if (!krt_do_scan(NULL, KRT_SCAN_LIMIT))
+	goto again;
+
+      WALK_LIST(n, krt_proto_list)
+	{
+	  p = SKIP_BACK(struct krt_proto, krt_node, n);
+	  if (p->scan_state == KRT_SCAN_DUMP)
+	    krt_prune_start(p);
+	}
+
+      krt_scan_state = KRT_SCAN_PRUNE;
+    }
+
+  WALK_LIST(n, krt_proto_list)
+    if (!krt_prune_step(SKIP_BACK(struct krt_proto, krt_node, n), &limit))
+      goto again;
+
+  krt_scan_state = KRT_SCAN_IDLE;
+
+  if (krt_scan_again)
+    {
+      krt_scan_again = 0;
+      krt_scan(krt_scan_timer);
+    }
+  return;
+
+ again:
+  ev_schedule(krt_scan_event);
 }
 
 static void
 krt_scan_timer_start(struct krt_proto *p)
 {
   if (!krt_scan_count)
-    krt_scan_timer = tm_new_set(krt_pool, krt_scan, NULL, 0, KRT_CF->scan_time);
+    {
+      krt_scan_timer = tm_new_set(krt_pool, krt_scan, NULL, 0, KRT_CF->scan_time);
+      krt_scan_event = ev_new(krt_pool);
+      krt_scan_event->hook = krt_scan_loop;
+    }
 
   krt_scan_count++;
 
-  tm_start(krt_scan_timer, 1);
+  if (krt_scan_state)
+    krt_scan_again = 1;
+  else
+    tm_start(krt_scan_timer, 1);
 }
 
 static void
 krt_scan_timer_stop(struct krt_proto *p)
 {
+  krt_scan_abort(p);
   krt_scan_count--;
 
   if (!krt_scan_count)
   {
     rfree(krt_scan_timer);
     krt_scan_timer = NULL;
+    rfree(krt_scan_event);
+    krt_scan_event = NULL;
+    krt_scan_state = KRT_SCAN_IDLE;
+    krt_scan_again = 0;
   }
 }
 
 static void
 krt_scan_timer_kick(struct krt_proto *p UNUSED)
 {
-  tm_start(krt_scan_timer, 0);
+  if (krt_scan_state)
+    krt_scan_again = 1;
+  else
+    tm_start(krt_scan_timer, 0);
 }
 
 #else
@@ -933,17 +1049,52 @@ krt_scan(timer *t)
 {
   struct krt_proto *p = t->data;
 
+  if (p->scan_state)
+    return;
+
   kif_force_scan();
 
   KRT_TRACE(p, D_EVENTS, "Scanning routing table");
-  krt_do_scan(p);
-  krt_prune(p);
+  krt_scan_begin(p);
+  krt_do_scan_start(p);
+  ev_schedule(p->scan_event);
+}
+
+static void
+krt_scan_loop(void *data)
+{
+  struct krt_proto *p = data;
+  int limit = KRT_PRUNE_LIMIT;
+
+  if (p->scan_state == KRT_SCAN_DUMP)
+    {
+      if (!krt_do_scan(p, KRT_SCAN_LIMIT))
+	goto again;
+
+      krt_prune_start(p);
+    }
+
+  if (!krt_prune_step(p, &limit))
+    goto again;
+
+  if (p->scan_again)
+    {
+      p->scan_again = 0;
+      krt_scan(p->scan_timer);
+    }
+  return;
+
+ again:
+  ev_schedule(p->scan_event);
 }
 
 static void
 krt_scan_timer_start(struct krt_proto *p)
 {
   p->scan_timer = tm_new_set(p->p.pool, krt_scan, p, 0, KRT_CF->scan_time);
+  p->scan_event = ev_new(p->p.pool);
+  p->scan_event->hook = krt_scan_loop;
+  p->scan_event->data = p;
   tm_start(p->scan_timer, 1);
 }
 
@@ -951,17 +1102,37 @@ static void
 krt_scan_timer_stop(struct krt_proto *p)
 {
   tm_stop(p->scan_timer);
+  ev_postpone(p->scan_event);
+  krt_scan_abort(p);
+  p->scan_again = 0;
 }
 
 static void
 krt_scan_timer_kick(struct krt_proto *p)
 {
-  tm_start(p->scan_timer, 0);
+  if (p->scan_state)
+    p->scan_again = 1;
+  else
+    tm_start(p->scan_timer, 0);
 }
 
 #endif
 
+/**
+ * krt_request_scan - request a scan of kernel routing tables
+ *
+ * This function is called by the sysdep code when it finds out that some
+ * asynchronous notifications about route changes were lost, so the tables
+ * should be checked as soon as possible.
+ */
+void
+krt_request_scan(void)
+{
+  node *n;
 
+  WALK_LIST(n, krt_proto_list)
+    krt_scan_timer_kick(SKIP_BACK(struct krt_proto, krt_node, n));
+}
 
 
 /*
@@ -1047,7 +1218,13 @@ krt_rt_notify(struct proto *P, struct rtable *table UNUSED, net *net,
   else
     net->n.flags &= ~KRF_INSTALLED;
   if (p->initialized)		/* Before first scan we don't touch the routes */
+  {
     krt_replace_rte(p, net, new, old, eattrs);
+
+    /* The running scan should not touch it again */
+    if (new || old)
+      krt_set_seen(p, &net->n);
+  }
 }
 
 static void
@@ -1134,6 +1311,7 @@ krt_start(struct proto *P)
   struct krt_proto *p = (struct krt_proto *) P;
 
   add_tail(&krt_proto_list, &p->krt_node);
+  memset(&p->stats, 0, sizeof(p->stats));
 
 #ifdef KRT_ALLOW_LEARN
   krt_learn_init(p);
@@ -1241,6 +1419,19 @@ krt_copy_config(struct proto_config *dest, struct proto_config *src)
   krt_sys_copy_config(d, s);
 }
 
+static void
+krt_show_proto_info(struct proto *P)
+{
+  struct krt_proto *p = (struct krt_proto *) P;
+  struct krt_stats *s = &p->stats;
+
+  proto_show_basic_info(P);
+
+  if (P->proto_state != PS_DOWN)
+    cli_msg(-1006, "  Kernel updates: %u changes, %u messages, %u replaced in place",
+	    s->updates, s->messages, s->replaced);
+}
+
 static int
 krt_get_attr(eattr *a, byte *buf, int buflen)
 {
@@ -1274,6 +1465,7 @@ struct protocol proto_unix_kernel = {
   .reconfigure =	krt_reconfigure,
   .copy_config =	krt_copy_config,
   .get_attr =		krt_get_attr,
+  .show_proto_info =	krt_show_proto_info,
 #ifdef KRT_ALLOW_LEARN
   .dump =		krt_dump,
   .dump_attrs =		krt_dump_attrs,
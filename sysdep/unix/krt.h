@@ -19,13 +19,27 @@ struct kif_proto;
 
 /* Flags stored in net->n.flags, rest are in nest/route.h */
 
-#define KRF_VERDICT_MASK 0x0f
+#define KRF_SCAN_MASK 0x0f		/* Number of the last scan which synced this entry */
+#define KRF_METRIC 0x20		/* Installed route has non-zero metric */
+
+/* Verdicts of krt_got_route() */
+
 #define KRF_CREATE 0			/* Not seen in kernel table */
 #define KRF_SEEN 1			/* Seen in kernel table during last scan */
 #define KRF_UPDATE 2			/* Need to update this entry */
 #define KRF_DELETE 3			/* Should be deleted */
 #define KRF_IGNORE 4			/* To be ignored */
 
+/* Phases of the kernel table scan */
+
+#define KRT_SCAN_IDLE	0		/* No scan is running */
+#define KRT_SCAN_DUMP	1		/* Reading routes from the kernel */
+#define KRT_SCAN_PRUNE	2		/* Reinstalling routes not seen in the kernel */
+#define KRT_SCAN_LEARN	3		/* Pruning table of inherited routes */
+
+#define KRT_SCAN_LIMIT	512		/* Kernel routes processed in one scan step */
+#define KRT_PRUNE_LIMIT	4096		/* Table entries checked in one prune step */
+
 #define KRT_DEFAULT_ECMP_LIMIT	16
 
 #define EA_KRT_SOURCE	EA_CODE(EAP_KRT, 0)
@@ -62,12 +76,28 @@ struct krt_proto {
 
 #ifndef CONFIG_ALL_TABLES_AT_ONCE
   timer *scan_timer;
+  struct event *scan_event;	/* Event running the next scan step */
+  byte scan_again;		/* Scan was requested while another was running */
 #endif
 
+  struct fib_iterator prune_fit;	/* Position of prune in the table */
+#ifdef KRT_ALLOW_LEARN
+  struct fib_iterator learn_fit;	/* Position of prune in krt_table */
+#endif
+  byte scan_state;		/* Phase of the running scan (KRT_SCAN_*) */
+  byte scan_epoch;		/* Number of the running scan, see KRF_SCAN_MASK */
+
+  struct krt_stats {
+    u32 updates;		/* Route changes sent to the kernel */
+    u32 messages;		/* Kernel messages sent for them */
+    u32 replaced;		/* Route changes done in place */
+  } stats;
+
   node krt_node;		/* Node in krt_proto_list */
   byte ready;			/* Initial feed has been finished */
   byte initialized;		/* First scan has been finished */
   byte reload;			/* Next scan is doing reload */
+  byte reloading;		/* Running scan is doing reload */
 };
 
 extern pool *krt_pool;
@@ -81,6 +111,7 @@ extern pool *krt_pool;
 
 struct proto_config * kif_init_config(int class);
 void kif_request_scan(void);
+void krt_request_scan(void);
 void krt_got_route(struct krt_proto *p, struct rte *e);
 void krt_got_route_async(struct krt_proto *p, struct rte *e, int new);
 
@@ -112,7 +143,7 @@ struct kif_proto {
   struct kif_state sys;		/* Sysdep state */
 };
 
-struct kif_proto *kif_proto;
+extern struct kif_proto *kif_proto;
 
 #define KIF_CF ((struct kif_config *)p->p.cf)
 
@@ -133,7 +164,8 @@ void krt_sys_init_config(struct krt_config *);
 void krt_sys_copy_config(struct krt_config *, struct krt_config *);
 
 int  krt_capable(rte *e);
-void krt_do_scan(struct krt_proto *);
+void krt_do_scan_start(struct krt_proto *);
+int krt_do_scan(struct krt_proto *, uint limit);
 void krt_replace_rte(struct krt_proto *p, net *n, rte *new, rte *old, struct ea_list *eattrs);
 int krt_sys_get_attr(eattr *a, byte *buf, int buflen);
 
@@ -559,6 +559,7 @@ async_shutdown(void)
 void
 sysdep_shutdown_done(void)
 {
+  mrt_shutdown();
   unlink_pid_file();
   unlink(path_control_socket);
   log_msg(L_FATAL "Shutdown completed");
@@ -778,6 +779,7 @@ main(int argc, char **argv)
   resource_init();
   olock_init();
   io_init();
+  mrt_init();
   rt_init();
   if_init();
   roa_init();
@@ -0,0 +1,586 @@
+/*
+ *	BIRD -- MRT Dump Files
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: MRT dump files
+ *
+ * MRT records, both BGP messages passed to mrt_dump_message() and table
+ * dumps of the MRT protocol, are written through &mrt_file objects. The
+ * main thread just copies records to a memory block of the file. A block
+ * is queued for writing when it is full or when it has waited for
+ * %MRT_FLUSH_TIME, and the queue is written by a writer thread of the
+ * file, so disk latency never stalls the main loop. Memory used by blocks
+ * of a file is limited; when the writer falls behind and the limit is
+ * reached, new records are dropped and the number of dropped records is
+ * logged.
+ *
+ * The writer also rotates the file when it would grow over a size limit or
+ * when a new period starts. The file name is then a template expanded by
+ * strftime() each time the file is opened; when it expands to the same
+ * name again, the old file is renamed with an |.old| suffix first.
+ *
+ * When a file is freed, its writer finishes the queue on its own and exits.
+ * Before BIRD exits, mrt_shutdown() waits for all writers. Without POSIX
+ * threads, blocks are written directly by the main thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "nest/bird.h"
+#include "nest/protocol.h"
+#include "nest/mrtdump.h"
+#include "conf/conf.h"
+#include "lib/string.h"
+#include "lib/timer.h"
+#include "lib/unix.h"
+
+#define MRT_BLOCK_SIZE	65536
+#define MRT_FLUSH_TIME	1		/* Max delay of a record in a partial block */
+
+struct mrt_block {
+  struct mrt_block *next;
+  uint len, size;
+  byte data[0];
+};
+
+struct mrt_writer {
+  int fd;
+  int error;				/* Last open or write failed */
+  uint rotate_size, rotate_period;
+  u64 size;				/* Size of the current file */
+  time_t opened;			/* When the current file was opened */
+  char *fmt;				/* File name template, if rotated */
+  char name[MRT_NAME_MAX];		/* Name of the current file */
+
+  /* Protected by mrt_mutex */
+  struct mrt_block *queue, **queue_tail;
+  struct mrt_block *free;		/* Unused blocks of MRT_BLOCK_SIZE */
+  uint used, limit;			/* Memory in blocks, including the one being filled */
+#ifdef USE_PTHREADS
+  u8 busy;				/* Has queued blocks */
+  u8 closing;				/* File was freed, exit when done */
+  u8 running;
+  pthread_t thread;
+  pthread_cond_t wakeup;
+#endif
+};
+
+struct mrt_file {
+  resource r;
+  node n;				/* In mrt_files */
+  struct mrt_writer *w;
+  struct mrt_block *cur;		/* Block being filled */
+  timer *flush_timer;
+  u32 dropped;				/* Records dropped since the last report */
+};
+
+static list mrt_files;
+
+#ifdef USE_PTHREADS
+
+#include <pthread.h>
+#include <signal.h>
+
+static pthread_mutex_t mrt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mrt_idle = PTHREAD_COND_INITIALIZER;
+static uint mrt_busy;			/* Writers with queued blocks */
+static inline void mrt_lock(void) { pthread_mutex_lock(&mrt_mutex); }
+static inline void mrt_unlock(void) { pthread_mutex_unlock(&mrt_mutex); }
+
+#else
+
+static inline void mrt_lock(void) { }
+static inline void mrt_unlock(void) { }
+
+#endif
+
+
+/*
+ *	Writer, runs in its own thread
+ */
+
+static inline char *
+mrt_writer_label(struct mrt_writer *w)
+{
+  /* Unlike name, it does not change */
+  return w->fmt ?: w->name;
+}
+
+static int
+mrt_writer_open(struct mrt_writer *w, time_t t)
+{
+  struct stat st;
+  int fd;
+
+  if (w->fmt)
+    {
+      char name[MRT_NAME_MAX];
+      struct tm tm;
+
+      localtime_r(&t, &tm);
+      if (!strftime(name, sizeof(name), w->fmt, &tm))
+	{
+	  errno = ENAMETOOLONG;
+	  return -1;
+	}
+
+      /* Do not append to the file being rotated */
+      if ((w->fd >= 0) && !strcmp(name, w->name))
+	{
+	  char old[MRT_NAME_MAX + 4];
+	  bsnprintf(old, sizeof(old), "%s.old", name);
+	  rename(name, old);
+	}
+
+      strcpy(w->name, name);
+    }
+
+  fd = open(w->name, O_WRONLY | O_CREAT | O_APPEND, 0666);
+  if (fd < 0)
+    return -1;
+
+  if (w->fd >= 0)
+    close(w->fd);
+
+  w->fd = fd;
+  w->size = !fstat(fd, &st) ? st.st_size : 0;
+  w->opened = t;
+  return 0;
+}
+
+static void
+mrt_writer_rotate(struct mrt_writer *w, uint len)
+{
+  time_t t = time(NULL);
+
+  /* Periods are aligned to multiples of their length */
+  if ((w->rotate_size && w->size && (w->size + len > w->rotate_size)) ||
+      (w->rotate_period && ((t / w->rotate_period) != (w->opened / w->rotate_period))))
+    if ((mrt_writer_open(w, t) < 0) && !w->error)
+      {
+	log(L_ERR "MRT dump: Cannot rotate %s: %m", w->name);
+	w->error = 1;
+      }
+}
+
+static void
+mrt_writer_write(struct mrt_writer *w, struct mrt_block *b)
+{
+  byte *buf = b->data;
+  uint len = b->len;
+
+  if (w->rotate_size || w->rotate_period)
+    mrt_writer_rotate(w, len);
+
+  while (len)
+    {
+      int e = write(w->fd, buf, len);
+      if (e < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  if (!w->error)
+	    log(L_ERR "MRT dump: Cannot write to %s: %m", w->name);
+	  w->error = 1;
+	  return;
+	}
+      buf += e;
+      len -= e;
+      w->size += e;
+    }
+
+  w->error = 0;
+}
+
+/* Called with mrt_mutex locked */
+static void
+mrt_writer_put_block(struct mrt_writer *w, struct mrt_block *b)
+{
+  w->used -= b->size;
+
+  if (b->size == MRT_BLOCK_SIZE)
+    {
+      b->next = w->free;
+      w->free = b;
+    }
+  else
+    xfree(b);
+}
+
+static void
+mrt_writer_free(struct mrt_writer *w)
+{
+  struct mrt_block *b;
+
+  while (b = w->free)
+    {
+      w->free = b->next;
+      xfree(b);
+    }
+
+#ifdef USE_PTHREADS
+  pthread_cond_destroy(&w->wakeup);
+#endif
+
+  close(w->fd);
+  xfree(w->fmt);
+  xfree(w);
+}
+
+#ifdef USE_PTHREADS
+
+static void *
+mrt_writer_main(void *arg)
+{
+  struct mrt_writer *w = arg;
+  struct mrt_block *b;
+  sigset_t all;
+
+  /* Signals are handled by the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  mrt_lock();
+  while (1)
+    {
+      while (!w->queue && !w->closing)
+	pthread_cond_wait(&w->wakeup, &mrt_mutex);
+
+      if (!(b = w->queue))
+	break;
+
+      if (!(w->queue = b->next))
+	w->queue_tail = &w->queue;
+      mrt_unlock();
+
+      mrt_writer_write(w, b);
+
+      mrt_lock();
+      mrt_writer_put_block(w, b);
+
+      if (!w->queue)
+	{
+	  w->busy = 0;
+	  if (!--mrt_busy)
+	    pthread_cond_broadcast(&mrt_idle);
+	}
+    }
+  mrt_unlock();
+
+  mrt_writer_free(w);
+  return NULL;
+}
+
+#endif
+
+
+/*
+ *	Files, used from the main thread
+ */
+
+static void
+mrt_file_push(struct mrt_file *f)
+{
+  struct mrt_writer *w = f->w;
+  struct mrt_block *b = f->cur;
+
+  if (!b)
+    return;
+
+  f->cur = NULL;
+  tm_stop(f->flush_timer);
+
+#ifdef USE_PTHREADS
+  mrt_lock();
+  b->next = NULL;
+  *w->queue_tail = b;
+  w->queue_tail = &b->next;
+
+  if (!w->busy)
+    {
+      w->busy = 1;
+      mrt_busy++;
+    }
+
+  if (!w->running)
+    {
+      int rv = pthread_create(&w->thread, NULL, mrt_writer_main, w);
+      if (rv)
+	die("pthread_create(): %M", rv);
+
+      pthread_detach(w->thread);
+      w->running = 1;
+    }
+
+  pthread_cond_signal(&w->wakeup);
+  mrt_unlock();
+#else
+  mrt_writer_write(w, b);
+  mrt_writer_put_block(w, b);
+#endif
+}
+
+static struct mrt_block *
+mrt_file_get_block(struct mrt_file *f, uint len)
+{
+  struct mrt_writer *w = f->w;
+  struct mrt_block *b = NULL;
+  uint size = MAX(len, MRT_BLOCK_SIZE);
+
+  mrt_lock();
+  if (w->used + size > w->limit)
+    {
+      mrt_unlock();
+      return NULL;
+    }
+
+  w->used += size;
+  if ((size == MRT_BLOCK_SIZE) && (b = w->free))
+    w->free = b->next;
+  mrt_unlock();
+
+  if (!b)
+    {
+      b = xmalloc(sizeof(struct mrt_block) + size);
+      b->size = size;
+    }
+
+  b->len = 0;
+  return b;
+}
+
+static void
+mrt_file_flush_timer(timer *t)
+{
+  mrt_file_push(t->data);
+}
+
+static void
+mrt_file_free(resource *r)
+{
+  struct mrt_file *f = (struct mrt_file *) r;
+  struct mrt_writer *w = f->w;
+
+  mrt_file_push(f);
+  rem_node(&f->n);
+
+#ifdef USE_PTHREADS
+  mrt_lock();
+  w->closing = 1;
+  if (w->running)
+    {
+      /* The writer frees itself when done */
+      pthread_cond_signal(&w->wakeup);
+      w = NULL;
+    }
+  mrt_unlock();
+
+  if (w)
+#endif
+    mrt_writer_free(w);
+}
+
+static void
+mrt_file_dump(resource *r)
+{
+  struct mrt_file *f = (struct mrt_file *) r;
+
+  debug("(%s, fd %d)\n", mrt_writer_label(f->w), f->w->fd);
+}
+
+static size_t
+mrt_file_memsize(resource *r)
+{
+  struct mrt_file *f = (struct mrt_file *) r;
+  size_t used;
+
+  mrt_lock();
+  used = f->w->used;
+  mrt_unlock();
+
+  return sizeof(struct mrt_file) + sizeof(struct mrt_writer) + used + 2*ALLOC_OVERHEAD;
+}
+
+static struct resclass mrt_file_class = {
+  "MRT file",
+  sizeof(struct mrt_file),
+  mrt_file_free,
+  mrt_file_dump,
+  NULL,
+  mrt_file_memsize
+};
+
+/**
+ * mrt_file_open - open a file for MRT records
+ * @p: pool
+ * @name: file name
+ * @buffer: max memory for records waiting to be written
+ * @rotate_size: max size of a file, or 0
+ * @rotate_period: time between file rotations in seconds, or 0
+ *
+ * This function opens the file @name for appending MRT records, creating
+ * it if it does not exist. When rotation is enabled by @rotate_size or
+ * @rotate_period, @name is a template expanded by strftime(). The file is
+ * closed when the returned resource is freed, after all records are
+ * written. On error, NULL is returned and errno is set.
+ */
+struct mrt_file *
+mrt_file_open(pool *p, char *name, uint buffer, uint rotate_size, uint rotate_period)
+{
+  struct mrt_writer *w = xmalloc(sizeof(struct mrt_writer));
+  struct mrt_file *f;
+
+  memset(w, 0, sizeof(struct mrt_writer));
+  w->fd = -1;
+  w->limit = buffer;
+  w->rotate_size = rotate_size;
+  w->rotate_period = rotate_period;
+  w->queue_tail = &w->queue;
+
+  if (rotate_size || rotate_period)
+    {
+      w->fmt = xmalloc(strlen(name) + 1);
+      strcpy(w->fmt, name);
+    }
+  else if (strlen(name) < sizeof(w->name))
+    strcpy(w->name, name);
+  else
+    {
+      errno = ENAMETOOLONG;
+      goto err;
+    }
+
+  if (mrt_writer_open(w, time(NULL)) < 0)
+    goto err;
+
+#ifdef USE_PTHREADS
+  pthread_cond_init(&w->wakeup, NULL);
+#endif
+
+  f = ralloc(p, &mrt_file_class);
+  f->w = w;
+  f->flush_timer = tm_new_set(p, mrt_file_flush_timer, f, 0, 0);
+  add_tail(&mrt_files, &f->n);
+  return f;
+
+ err:
+  xfree(w->fmt);
+  xfree(w);
+  return NULL;
+}
+
+/**
+ * mrt_file_write - queue MRT records
+ * @f: file
+ * @buf: complete records
+ * @len: length of the records
+ *
+ * This function copies the records to the buffer of the file, they are
+ * written later. When the buffer is full, the records are dropped and -1
+ * is returned.
+ */
+int
+mrt_file_write(struct mrt_file *f, byte *buf, uint len)
+{
+  struct mrt_block *b = f->cur;
+
+  if (b && (b->len + len > b->size))
+    {
+      mrt_file_push(f);
+      b = NULL;
+    }
+
+  if (!b && !(b = f->cur = mrt_file_get_block(f, len)))
+    {
+      if (!f->dropped++)
+	log(L_WARN "MRT dump: Buffer for %s full, dropping records", mrt_writer_label(f->w));
+      return -1;
+    }
+
+  if (f->dropped)
+    {
+      log(L_WARN "MRT dump: %u records for %s dropped", f->dropped, mrt_writer_label(f->w));
+      f->dropped = 0;
+    }
+
+  memcpy(b->data + b->len, buf, len);
+  b->len += len;
+
+  if (!tm_active(f->flush_timer))
+    tm_start(f->flush_timer, MRT_FLUSH_TIME);
+
+  return 0;
+}
+
+/**
+ * mrt_file_busy - check whether the writer falls behind
+ * @f: file
+ *
+ * Returns nonzero when more than a half of the buffer of the file is in
+ * use, so producers of large amounts of records may wait a while.
+ */
+int
+mrt_file_busy(struct mrt_file *f)
+{
+  uint used;
+
+  mrt_lock();
+  used = f->w->used;
+  mrt_unlock();
+
+  return used > f->w->limit / 2;
+}
+
+void
+mrt_dump_message(struct proto *p, u16 type, u16 subtype, byte *buf, u32 len)
+{
+  struct mrt_file *f = p->cf->global->mrtdump_file;
+
+  /* Prepare header */
+  put_u32(buf+0, now_real);
+  put_u16(buf+4, type);
+  put_u16(buf+6, subtype);
+  put_u32(buf+8, len - MRTDUMP_HDR_LENGTH);
+
+  if (f)
+    mrt_file_write(f, buf, len);
+}
+
+void
+mrt_init(void)
+{
+  init_list(&mrt_files);
+}
+
+/**
+ * mrt_shutdown - write all MRT records before exit
+ *
+ * This function queues partial blocks of all open files and waits until
+ * all writers are done.
+ */
+void
+mrt_shutdown(void)
+{
+  node *n;
+
+  WALK_LIST(n, mrt_files)
+    mrt_file_push(SKIP_BACK(struct mrt_file, n, n));
+
+#ifdef USE_PTHREADS
+  mrt_lock();
+  while (mrt_busy)
+    pthread_cond_wait(&mrt_idle, &mrt_mutex);
+  mrt_unlock();
+#endif
+}
@@ -0,0 +1,55 @@
+/*
+ *	BIRD Internet Routing Daemon -- Stubs for Test Programs
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/*
+ * Test programs are built from TEST sections of the sources and linked
+ * with all the daemon objects except main.o, so they provide their own
+ * main(). These are the functions of main.c the other modules refer to.
+ * There is no configuration file, no control socket and no signals.
+ */
+
+#include <stdlib.h>
+
+#include "nest/bird.h"
+#include "nest/cli.h"
+#include "conf/conf.h"
+#include "lib/unix.h"
+
+char *bird_name = "bird";
+
+void async_config(void) { }
+void async_dump(void) { }
+void async_shutdown(void) { }
+
+cli *cmd_reconfig_stored_cli;
+
+void cmd_check_config(char *name UNUSED) { }
+void cmd_reconfig(char *name UNUSED, int type UNUSED, int timeout UNUSED) { }
+void cmd_reconfig_confirm(void) { }
+void cmd_reconfig_undo(void) { }
+void cmd_reconfig_undo_notify(void) { }
+void cmd_shutdown(void) { }
+
+void cli_write_trigger(cli *c UNUSED) { }
+int cli_get_command(cli *c UNUSED) { return 0; }
+
+void
+sysdep_preconfig(struct config *c)
+{
+  init_list(&c->logfiles);
+}
+
+int
+sysdep_commit(struct config *new UNUSED, struct config *old UNUSED)
+{
+  return 0;
+}
+
+void
+sysdep_shutdown_done(void)
+{
+  exit(0);
+}
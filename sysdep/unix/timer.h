@@ -21,8 +21,8 @@ typedef struct timer {
   void *data;
   unsigned randomize;			/* Amount of randomization */
   unsigned recurrent;			/* Timer recurrence */
-  node n;				/* Internal link */
   bird_clock_t expires;			/* 0=inactive */
+  int index;				/* Position in the timer heap */
 } timer;
 
 timer *tm_new(pool *);
@@ -33,6 +33,7 @@ void tm_dump_all(void);
 extern bird_clock_t now; 		/* Relative, monotonic time in seconds */
 extern bird_clock_t now_real;		/* Time in seconds since fixed known epoch */
 extern bird_clock_t boot_time;
+extern btime now_us;			/* Relative, monotonic time in microseconds */
 
 static inline int
 tm_active(timer *t)
@@ -64,6 +65,55 @@ tm_new_set(pool *p, void (*hook)(struct timer *), void *data, unsigned rand, uns
   return t;
 }
 
+/* Microsecond timers, scheduled against now_us */
+
+typedef struct utimer {
+  resource r;
+  void (*hook)(struct utimer *);
+  void *data;
+  btime expires;			/* 0=inactive */
+  uint randomize;			/* Amount of randomization [us] */
+  uint recurrent;			/* Timer recurrence [us] */
+  int index;				/* Position in the timer heap */
+} utimer;
+
+#define BTIME_INFINITY ((btime) 0x7fffffffffffffffLL)
+
+utimer *ut_new(pool *);
+void ut_set(utimer *, btime when);
+void ut_start(utimer *, btime after);
+void ut_stop(utimer *);
+
+static inline int
+ut_active(utimer *t)
+{
+  return t->expires != 0;
+}
+
+static inline btime
+ut_remains(utimer *t)
+{
+  return (t->expires > now_us) ? (t->expires - now_us) : 0;
+}
+
+static inline void
+ut_start_max(utimer *t, btime after)
+{
+  btime rem = ut_remains(t);
+  ut_start(t, (rem > after) ? rem : after);
+}
+
+static inline utimer *
+ut_new_set(pool *p, void (*hook)(struct utimer *), void *data, uint rand, uint rec)
+{
+  utimer *t = ut_new(p);
+  t->hook = hook;
+  t->data = data;
+  t->randomize = rand;
+  t->recurrent = rec;
+  return t;
+}
+
 
 struct timeformat {
   char *fmt1, *fmt2;
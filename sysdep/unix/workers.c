@@ -0,0 +1,261 @@
+/*
+ *	BIRD -- Worker Threads
+ *
+ *	Can be freely distributed and used under the terms of the GNU GPL.
+ */
+
+/**
+ * DOC: Worker threads
+ *
+ * BIRD does all its work in the main thread, but some computations on
+ * a consistent snapshot of data may be split to many independent items,
+ * like running export filters without side effects for many protocols.
+ * Such jobs are run by workers_run(), which hands the items out in small
+ * chunks to a pool of worker threads and to the calling thread itself and
+ * returns when all items are done. The main thread does nothing else in
+ * the meantime, so the hooks may read any data, but they must not modify
+ * anything shared. Each thread has its own &linpool for temporary
+ * allocations of the hooks.
+ *
+ * The number of worker threads is set by workers_set() from the
+ * configuration. When it is zero, or BIRD is built without POSIX threads,
+ * workers_run() just runs all items in the calling thread.
+ */
+
+#include "nest/bird.h"
+#include "lib/resource.h"
+#include "lib/workers.h"
+
+#define WORKER_CHUNK	8		/* Items taken by a thread at once */
+
+static pool *workers_pool;
+static linpool *workers_main_lp;	/* Linpool of the calling thread */
+
+#ifdef USE_PTHREADS
+
+#include <pthread.h>
+#include <signal.h>
+
+struct worker {
+  pthread_t thread;
+  linpool *lp;
+};
+
+static pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workers_done = PTHREAD_COND_INITIALIZER;
+
+static struct worker *workers;
+static uint workers_num;
+static int workers_stop;
+
+/* The current job, protected by workers_mutex */
+static worker_hook job_hook;
+static void *job_data;
+static uint job_next, job_count;
+static uint job_busy;			/* Threads working on the job */
+static uint job_gen;			/* Incremented for each new job */
+
+static int
+job_take(uint *from, uint *to)
+{
+  if (job_next >= job_count)
+    return 0;
+
+  *from = job_next;
+  job_next = MIN(job_next + WORKER_CHUNK, job_count);
+  *to = job_next;
+  return 1;
+}
+
+/* Called and returns with workers_mutex locked */
+static void
+job_work(linpool *lp)
+{
+  worker_hook hook = job_hook;
+  void *data = job_data;
+  uint from, to;
+
+  while (job_take(&from, &to))
+    {
+      pthread_mutex_unlock(&workers_mutex);
+      for (; from < to; from++)
+	{
+	  hook(data, from, lp);
+	  lp_flush(lp);
+	}
+      pthread_mutex_lock(&workers_mutex);
+    }
+}
+
+static void *
+worker_main(void *arg)
+{
+  struct worker *w = arg;
+  uint gen = 0;
+  sigset_t all;
+
+  /* Signals are handled by the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+  pthread_mutex_lock(&workers_mutex);
+  while (1)
+    {
+      while (!workers_stop && (gen == job_gen))
+	pthread_cond_wait(&workers_wakeup, &workers_mutex);
+
+      if (workers_stop)
+	break;
+
+      gen = job_gen;
+      job_busy++;
+      job_work(w->lp);
+      if (!--job_busy)
+	pthread_cond_signal(&workers_done);
+    }
+  pthread_mutex_unlock(&workers_mutex);
+
+  return NULL;
+}
+
+/**
+ * workers_set - set the number of worker threads
+ * @num: number of threads
+ *
+ * This function starts or stops worker threads, so that there are @num of
+ * them. It must not be called while workers_run() is running.
+ */
+void
+workers_set(uint num)
+{
+  uint i;
+  int rv;
+
+  if (!workers_pool)
+    {
+      workers_pool = rp_new(&root_pool, "Workers");
+      workers_main_lp = lp_new(workers_pool, 4080);
+    }
+
+  if (num == workers_num)
+    return;
+
+  if (workers_num)
+    {
+      pthread_mutex_lock(&workers_mutex);
+      workers_stop = 1;
+      pthread_cond_broadcast(&workers_wakeup);
+      pthread_mutex_unlock(&workers_mutex);
+
+      for (i = 0; i < workers_num; i++)
+	{
+	  if (rv = pthread_join(workers[i].thread, NULL))
+	    die("pthread_join(): %M", rv);
+	  rfree(workers[i].lp);
+	}
+
+      mb_free(workers);
+      workers = NULL;
+      workers_num = 0;
+      workers_stop = 0;
+    }
+
+  if (!num)
+    return;
+
+  workers = mb_allocz(workers_pool, num * sizeof(struct worker));
+  for (i = 0; i < num; i++)
+    {
+      workers[i].lp = lp_new(workers_pool, 4080);
+      if (rv = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]))
+	die("pthread_create(): %M", rv);
+    }
+  workers_num = num;
+}
+
+/**
+ * workers_count - get the number of worker threads
+ */
+uint
+workers_count(void)
+{
+  return workers_num;
+}
+
+/**
+ * workers_run - run a job in worker threads
+ * @hook: function to be called for each item
+ * @data: data passed to @hook
+ * @count: number of items
+ *
+ * This function calls @hook for items 0 to @count-1 in worker threads and
+ * in the calling thread, in no particular order, and returns when all calls
+ * finished.
+ */
+void
+workers_run(worker_hook hook, void *data, uint count)
+{
+  uint i;
+
+  if (!workers_num)
+    {
+      for (i = 0; i < count; i++)
+	{
+	  hook(data, i, workers_main_lp);
+	  lp_flush(workers_main_lp);
+	}
+      return;
+    }
+
+  pthread_mutex_lock(&workers_mutex);
+  job_hook = hook;
+  job_data = data;
+  job_next = 0;
+  job_count = count;
+  job_gen++;
+  pthread_cond_broadcast(&workers_wakeup);
+
+  job_busy++;
+  job_work(workers_main_lp);
+  job_busy--;
+
+  while (job_busy)
+    pthread_cond_wait(&workers_done, &workers_mutex);
+  pthread_mutex_unlock(&workers_mutex);
+}
+
+#else
+
+void
+workers_set(uint num)
+{
+  if (num)
+    log(L_WARN "Worker threads not supported without POSIX threads");
+
+  if (!workers_pool)
+    {
+      workers_pool = rp_new(&root_pool, "Workers");
+      workers_main_lp = lp_new(workers_pool, 4080);
+    }
+}
+
+uint
+workers_count(void)
+{
+  return 0;
+}
+
+void
+workers_run(worker_hook hook, void *data, uint count)
+{
+  uint i;
+
+  for (i = 0; i < count; i++)
+    {
+      hook(data, i, workers_main_lp);
+      lp_flush(workers_main_lp);
+    }
+}
+
+#endif